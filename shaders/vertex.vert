@@ -1,52 +1,72 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shader_draw_parameters : require
 
-layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inColor;
-layout(location = 2) in vec3 inNorm;
-layout(location = 3) in mat4 instanceRotation;
-layout(location = 7) in vec3 instancePosition;
-layout(location = 8) in vec3 instanceScale;
-layout(location = 9) in uint instanceId;
+layout(location = 0) in vec4 inPackedPosition;
+layout(location = 1) in uint inPackedColor;
+layout(location = 2) in vec2 inPackedNorm;
+// Has to match Instance in src/model.h
+layout(location = 3) in vec3 instancePosition;
+layout(location = 4) in vec3 instanceScale;
+layout(location = 5) in vec4 instanceOrientation;
+layout(location = 6) in uint instanceId;
 
-layout(set = 0, binding = 0) uniform Block {
+layout(set = 0, binding = 0) uniform Camera {
 	mat4 model;
 	mat4 view;
-  mat4 proj;
+	mat4 proj;
+	// proj * inverse(view) and its inverse, worked out once a frame on the CPU
+	mat4 viewProj;
+	mat4 inverseViewProj;
 };
 
-layout(set = 0, binding = 1) buffer Block {
-  vec4 mouse;
-	vec2 windowSize;
-  uint mouseButtons;
-	uint selectionBufferLength;
-	uint frameId;
-  uint selectionMap[4096];
-  uint selectionBuffer[256];
+// Has to match model.h
+#define MODEL_MAX_LODS 4
+
+// One per def, indexed by which of the indirect draws this is. Each def has
+// a draw per level of detail
+struct DrawInfo {
+	vec4 positionScale;
+	vec4 positionBias;
+	vec4 sphere;
+	vec4 lodError;
+	// Which of src/window.c's index arenas the model's indices are in
+	uint indexArena;
+};
+
+layout(set = 0, binding = 3) readonly buffer Draws {
+	DrawInfo draws[];
 };
 
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec3 fragNorm;
 layout(location = 2) out flat uint outInstanceId;
-layout(location = 3) out mat4 mvp;
-layout(location = 7) out vec4 preproj;
+
+vec3 octDecode(vec2 e) {
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	float t = max(-n.z, 0.0);
+	n.x += n.x >= 0.0 ? -t : t;
+	n.y += n.y >= 0.0 ? -t : t;
+	return normalize(n);
+}
+
+// Same as shaders/cull.comp and RotateByQuaternion in src/cull.h
+vec3 rotate(vec4 q, vec3 v) {
+	return v + 2 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+vec3 unpackColor565(uint c) {
+	return vec3(float((c >> 11) & 31u) / 31.0, float((c >> 5) & 63u) / 63.0, float(c & 31u) / 31.0);
+}
 
 void main() {
-		if((mouseButtons & 2) == 2) {
-			if(selectionMap[instanceId] != 0 && 
-				!(selectionMap[instanceId] == 15 && frameId == 1) &&
-				!(selectionMap[instanceId] == 15 && frameId == 2) &&
-				!(selectionMap[instanceId] == (frameId - 0)) &&
-			  !(selectionMap[instanceId] == (frameId - 1)) &&
-				!(selectionMap[instanceId] == (frameId - 2))
-				 ) {
-				selectionMap[instanceId] = 0;
-			}
-		}
-    gl_Position = (proj * inverse(view)) * (instanceRotation * vec4(inPosition * instanceScale,1) + vec4(instancePosition,1));
-		mvp = proj * view;
-		preproj = (instanceRotation * vec4(inPosition * instanceScale,1) + vec4(instancePosition,1));
+		DrawInfo draw = draws[gl_DrawIDARB / MODEL_MAX_LODS];
+		vec3 inPosition = inPackedPosition.xyz * draw.positionScale.xyz + draw.positionBias.xyz;
+		vec3 inColor = unpackColor565(inPackedColor);
+		vec3 inNorm = octDecode(inPackedNorm);
+		vec3 world = rotate(instanceOrientation, inPosition * instanceScale) + instancePosition;
+    gl_Position = viewProj * vec4(world, 1);
     fragColor = inColor;
-		fragNorm = vec3(instanceRotation * vec4(inNorm, 1));
+		fragNorm = rotate(instanceOrientation, inNorm);
 		outInstanceId = instanceId;
 }
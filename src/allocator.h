@@ -0,0 +1,341 @@
+#ifndef OPENDOM_ALLOCATOR
+#define OPENDOM_ALLOCATOR
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+// GPU memory is allocated in large blocks per memory type and buffers and
+// images are placed inside them, so the number of vkAllocateMemory calls
+// stays far below maxMemoryAllocationCount no matter how many unit types get
+// loaded. Anything bigger than a block gets a block of its own.
+#define GPU_BLOCK_SIZE (64 * 1024 * 1024)
+
+typedef struct GpuFreeRange {
+  VkDeviceSize offset;
+  VkDeviceSize size;
+} GpuFreeRange;
+
+typedef struct GpuBlock {
+  // VK_NULL_HANDLE when the slot is unused
+  VkDeviceMemory memory;
+  VkDeviceSize size;
+  VkDeviceSize used;
+  uint32_t memoryType;
+  // Buffers and optimally tiled images live in separate blocks so we never
+  // have to worry about bufferImageGranularity
+  bool image;
+  // Host visible blocks stay mapped for their whole lifetime
+  char *mapped;
+  // Sorted by offset, neighbours are merged on free
+  GpuFreeRange *freeRanges;
+  uint32_t freeCount;
+  uint32_t freeCapacity;
+} GpuBlock;
+
+typedef struct GpuAllocation {
+  VkDeviceMemory memory;
+  VkDeviceSize offset;
+  VkDeviceSize size;
+  uint32_t block;
+  // NULL unless the memory is host visible
+  void *mapped;
+} GpuAllocation;
+
+typedef struct GpuAllocator {
+  VkDevice device;
+  VkPhysicalDeviceMemoryProperties properties;
+  GpuBlock *blocks;
+  uint32_t blockCount;
+} GpuAllocator;
+
+typedef struct GpuAllocatorStats {
+  uint32_t blocks;
+  VkDeviceSize reserved;
+  VkDeviceSize used;
+  // 1 - largest free range / total free, 0 when all free space is in one
+  // piece
+  float fragmentation;
+} GpuAllocatorStats;
+
+void InitGpuAllocator(GpuAllocator *allocator, VkPhysicalDevice physical,
+                      VkDevice device) {
+  *allocator = (GpuAllocator){.device = device};
+  vkGetPhysicalDeviceMemoryProperties(physical, &allocator->properties);
+}
+
+// Returns UINT32_MAX if no memory type fits
+uint32_t FindMemoryType(GpuAllocator *allocator, uint32_t memoryTypeBits,
+                        VkMemoryPropertyFlags flags) {
+  for (uint32_t i = 0; i < allocator->properties.memoryTypeCount; i++) {
+    if ((memoryTypeBits & (1u << i)) &&
+        (allocator->properties.memoryTypes[i].propertyFlags & flags) ==
+            flags) {
+      return i;
+    }
+  }
+  return UINT32_MAX;
+}
+
+void InsertFreeRange(GpuBlock *block, uint32_t at, VkDeviceSize offset,
+                     VkDeviceSize size) {
+  if (block->freeCount == block->freeCapacity) {
+    block->freeCapacity = block->freeCapacity ? block->freeCapacity * 2 : 16;
+    block->freeRanges = realloc(block->freeRanges,
+                                sizeof(GpuFreeRange) * block->freeCapacity);
+  }
+  memmove(&block->freeRanges[at + 1], &block->freeRanges[at],
+          sizeof(GpuFreeRange) * (block->freeCount - at));
+  block->freeRanges[at] = (GpuFreeRange){.offset = offset, .size = size};
+  block->freeCount++;
+}
+
+void RemoveFreeRange(GpuBlock *block, uint32_t at) {
+  memmove(&block->freeRanges[at], &block->freeRanges[at + 1],
+          sizeof(GpuFreeRange) * (block->freeCount - at - 1));
+  block->freeCount--;
+}
+
+// First fit inside block, returns false if nothing fits
+bool AllocateFromBlock(GpuBlock *block, VkMemoryRequirements *requirements,
+                       VkDeviceSize *offset) {
+  for (uint32_t i = 0; i < block->freeCount; i++) {
+    GpuFreeRange range = block->freeRanges[i];
+    VkDeviceSize aligned = (range.offset + requirements->alignment - 1) /
+                           requirements->alignment * requirements->alignment;
+    if (aligned + requirements->size > range.offset + range.size) {
+      continue;
+    }
+    VkDeviceSize end = aligned + requirements->size;
+    VkDeviceSize rangeEnd = range.offset + range.size;
+    // Replace the range with whatever is left either side of the allocation
+    RemoveFreeRange(block, i);
+    if (rangeEnd > end) {
+      InsertFreeRange(block, i, end, rangeEnd - end);
+    }
+    if (aligned > range.offset) {
+      InsertFreeRange(block, i, range.offset, aligned - range.offset);
+    }
+    block->used += requirements->size;
+    *offset = aligned;
+    return true;
+  }
+  return false;
+}
+
+// Returns the index of the new block, or UINT32_MAX if the device is out of
+// memory
+uint32_t CreateGpuBlock(GpuAllocator *allocator, uint32_t memoryType,
+                        bool image, VkDeviceSize size) {
+  uint32_t index;
+  for (index = 0; index < allocator->blockCount; index++) {
+    if (allocator->blocks[index].memory == VK_NULL_HANDLE) {
+      break;
+    }
+  }
+  if (index == allocator->blockCount) {
+    allocator->blocks = realloc(allocator->blocks,
+                                sizeof(GpuBlock) * (allocator->blockCount + 1));
+    allocator->blocks[allocator->blockCount++] = (GpuBlock){0};
+  }
+  GpuBlock *block = &allocator->blocks[index];
+  *block = (GpuBlock){.size = size, .memoryType = memoryType, .image = image};
+  VkResult res = vkAllocateMemory(
+      allocator->device,
+      &(VkMemoryAllocateInfo){.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                              .allocationSize = size,
+                              .memoryTypeIndex = memoryType},
+      NULL, &block->memory);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "Failed to allocate %llu byte GPU block: %d\n",
+            (unsigned long long)size, res);
+    block->memory = VK_NULL_HANDLE;
+    return UINT32_MAX;
+  }
+  if (allocator->properties.memoryTypes[memoryType].propertyFlags &
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    vkMapMemory(allocator->device, block->memory, 0, VK_WHOLE_SIZE, 0,
+                (void **)&block->mapped);
+  }
+  InsertFreeRange(block, 0, 0, size);
+  return index;
+}
+
+/**
+ * Find space for something with the given requirements in memory with at
+ * least flags set. Fills in allocation and returns 0 on success, 1 if no
+ * memory type matches or the device is out of memory.
+ */
+uint32_t GpuAllocate(GpuAllocator *allocator,
+                     VkMemoryRequirements *requirements,
+                     VkMemoryPropertyFlags flags, bool image,
+                     GpuAllocation *allocation) {
+  uint32_t memoryType =
+      FindMemoryType(allocator, requirements->memoryTypeBits, flags);
+  if (memoryType == UINT32_MAX) {
+    fprintf(stderr, "No memory type with flags %x for type bits %x\n", flags,
+            requirements->memoryTypeBits);
+    return 1;
+  }
+  VkDeviceSize offset;
+  uint32_t b;
+  for (b = 0; b < allocator->blockCount; b++) {
+    GpuBlock *block = &allocator->blocks[b];
+    if (block->memory != VK_NULL_HANDLE && block->memoryType == memoryType &&
+        block->image == image &&
+        AllocateFromBlock(block, requirements, &offset)) {
+      break;
+    }
+  }
+  if (b == allocator->blockCount) {
+    VkDeviceSize size = requirements->size > GPU_BLOCK_SIZE
+                            ? requirements->size
+                            : GPU_BLOCK_SIZE;
+    b = CreateGpuBlock(allocator, memoryType, image, size);
+    if (b == UINT32_MAX ||
+        !AllocateFromBlock(&allocator->blocks[b], requirements, &offset)) {
+      return 1;
+    }
+  }
+  GpuBlock *block = &allocator->blocks[b];
+  *allocation =
+      (GpuAllocation){.memory = block->memory,
+                      .offset = offset,
+                      .size = requirements->size,
+                      .block = b,
+                      .mapped = block->mapped ? block->mapped + offset : NULL};
+  return 0;
+}
+
+void GpuFree(GpuAllocator *allocator, GpuAllocation *allocation) {
+  if (allocation->memory == VK_NULL_HANDLE) {
+    return;
+  }
+  GpuBlock *block = &allocator->blocks[allocation->block];
+  uint32_t at = 0;
+  while (at < block->freeCount &&
+         block->freeRanges[at].offset < allocation->offset) {
+    at++;
+  }
+  InsertFreeRange(block, at, allocation->offset, allocation->size);
+  // Merge with the following and then the preceding range
+  if (at + 1 < block->freeCount &&
+      block->freeRanges[at].offset + block->freeRanges[at].size ==
+          block->freeRanges[at + 1].offset) {
+    block->freeRanges[at].size += block->freeRanges[at + 1].size;
+    RemoveFreeRange(block, at + 1);
+  }
+  if (at > 0 && block->freeRanges[at - 1].offset +
+                        block->freeRanges[at - 1].size ==
+                    block->freeRanges[at].offset) {
+    block->freeRanges[at - 1].size += block->freeRanges[at].size;
+    RemoveFreeRange(block, at);
+  }
+  block->used -= allocation->size;
+  // Give empty blocks back to the driver
+  if (block->used == 0) {
+    vkFreeMemory(allocator->device, block->memory, NULL);
+    free(block->freeRanges);
+    *block = (GpuBlock){0};
+  }
+  *allocation = (GpuAllocation){0};
+}
+
+GpuAllocatorStats GetGpuAllocatorStats(GpuAllocator *allocator) {
+  GpuAllocatorStats stats = {0};
+  VkDeviceSize largestFree = 0;
+  for (uint32_t b = 0; b < allocator->blockCount; b++) {
+    GpuBlock *block = &allocator->blocks[b];
+    if (block->memory == VK_NULL_HANDLE) {
+      continue;
+    }
+    stats.blocks++;
+    stats.reserved += block->size;
+    stats.used += block->used;
+    for (uint32_t i = 0; i < block->freeCount; i++) {
+      if (block->freeRanges[i].size > largestFree) {
+        largestFree = block->freeRanges[i].size;
+      }
+    }
+  }
+  VkDeviceSize totalFree = stats.reserved - stats.used;
+  stats.fragmentation =
+      totalFree ? 1.f - (float)largestFree / (float)totalFree : 0;
+  return stats;
+}
+
+void PrintGpuAllocatorStats(GpuAllocator *allocator) {
+  GpuAllocatorStats stats = GetGpuAllocatorStats(allocator);
+  printf("GPU memory: %d blocks, %.2fMB used of %.2fMB, %.1f%% fragmented\n",
+         stats.blocks, stats.used / (1024. * 1024.),
+         stats.reserved / (1024. * 1024.), stats.fragmentation * 100);
+}
+
+/**
+ * Create a buffer and place it in memory with at least memoryFlags set,
+ * honouring the buffer's size, alignment and memory type requirements. The
+ * buffer can be used from every one of the familyCount queue families in
+ * families without ownership transfers. Returns 0 on success.
+ */
+uint32_t CreateSharedBuffer(GpuAllocator *allocator, size_t size,
+                            VkMemoryPropertyFlags memoryFlags,
+                            VkBufferUsageFlags usageFlags,
+                            uint32_t familyCount, const uint32_t *families,
+                            VkBuffer *buffer, GpuAllocation *allocation) {
+  // Concurrent sharing needs at least two distinct families
+  bool concurrent = familyCount > 1 && families[0] != families[1];
+  vkCreateBuffer(allocator->device,
+                 &(VkBufferCreateInfo){
+                     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                     .size = size,
+                     .usage = usageFlags,
+                     .sharingMode = concurrent ? VK_SHARING_MODE_CONCURRENT
+                                               : VK_SHARING_MODE_EXCLUSIVE,
+                     .queueFamilyIndexCount = concurrent ? familyCount : 0,
+                     .pQueueFamilyIndices = concurrent ? families : NULL},
+                 NULL, buffer);
+  VkMemoryRequirements requirements;
+  vkGetBufferMemoryRequirements(allocator->device, *buffer, &requirements);
+  if (GpuAllocate(allocator, &requirements, memoryFlags, false, allocation)) {
+    vkDestroyBuffer(allocator->device, *buffer, NULL);
+    *buffer = VK_NULL_HANDLE;
+    return 1;
+  }
+  vkBindBufferMemory(allocator->device, *buffer, allocation->memory,
+                     allocation->offset);
+  return 0;
+}
+
+// CreateSharedBuffer for a buffer owned by one queue family at a time
+uint32_t CreateBuffer(GpuAllocator *allocator, size_t size,
+                      VkMemoryPropertyFlags memoryFlags,
+                      VkBufferUsageFlags usageFlags, VkBuffer *buffer,
+                      GpuAllocation *allocation) {
+  return CreateSharedBuffer(allocator, size, memoryFlags, usageFlags, 0, NULL,
+                            buffer, allocation);
+}
+
+void DestroyBuffer(GpuAllocator *allocator, VkBuffer buffer,
+                   GpuAllocation *allocation) {
+  vkDestroyBuffer(allocator->device, buffer, NULL);
+  GpuFree(allocator, allocation);
+}
+
+// Place an already created image in memory with at least memoryFlags set,
+// returns 0 on success
+uint32_t AllocateImageMemory(GpuAllocator *allocator, VkImage image,
+                             VkMemoryPropertyFlags memoryFlags,
+                             GpuAllocation *allocation) {
+  VkMemoryRequirements requirements;
+  vkGetImageMemoryRequirements(allocator->device, image, &requirements);
+  if (GpuAllocate(allocator, &requirements, memoryFlags, true, allocation)) {
+    return 1;
+  }
+  vkBindImageMemory(allocator->device, image, allocation->memory,
+                    allocation->offset);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef OPENDOM_ASSETLOADER
+#define OPENDOM_ASSETLOADER
+#include "./modelcache.h"
+#include <pthread.h>
+#include <unistd.h>
+
+// Most loaders will be loadFromFile, importFromFile skips the model cache
+typedef Model (*ModelLoader)(char *path);
+
+typedef struct ModelLoadJobs {
+  char **paths;
+  Model *models;
+  uint32_t count;
+  ModelLoader load;
+  // Next path to be picked up by a worker
+  uint32_t next;
+  pthread_mutex_t lock;
+} ModelLoadJobs;
+
+void *ModelLoadWorker(void *arg) {
+  ModelLoadJobs *jobs = arg;
+  while (true) {
+    pthread_mutex_lock(&jobs->lock);
+    uint32_t job = jobs->next++;
+    pthread_mutex_unlock(&jobs->lock);
+    if (job >= jobs->count) {
+      return NULL;
+    }
+    jobs->models[job] = jobs->load(jobs->paths[job]);
+  }
+}
+
+uint32_t DefaultLoaderThreads() {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? cores : 1;
+}
+
+/**
+ * Load every model in paths across threadCount worker threads, models[i]
+ * receives the model loaded from paths[i]. A threadCount of 0 uses one
+ * thread per core. Blocks until everything is loaded, hand the results to
+ * CreateEntityDefs to get them onto the GPU in a few batched transfers.
+ */
+void LoadModels(char **paths, uint32_t count, uint32_t threadCount,
+                ModelLoader load, Model *models) {
+  if (threadCount == 0) {
+    threadCount = DefaultLoaderThreads();
+  }
+  if (threadCount > count) {
+    threadCount = count;
+  }
+  ModelLoadJobs jobs = {
+      .paths = paths, .models = models, .count = count, .load = load};
+  pthread_mutex_init(&jobs.lock, NULL);
+  // The calling thread works through the jobs too
+  pthread_t *workers = calloc(threadCount, sizeof(pthread_t));
+  uint32_t started = 0;
+  for (uint32_t i = 1; i < threadCount; i++) {
+    if (pthread_create(&workers[started], NULL, ModelLoadWorker, &jobs) == 0) {
+      started++;
+    }
+  }
+  ModelLoadWorker(&jobs);
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+  pthread_mutex_destroy(&jobs.lock);
+}
+
+#endif
@@ -0,0 +1,28 @@
+#include "modelcache.h"
+
+// Offline model baking, writes the model cache for every asset given so
+// the game never has to go through assimp at startup
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <model> [model...]\n", argv[0]);
+    return 1;
+  }
+  int failures = 0;
+  for (int i = 1; i < argc; i++) {
+    uint64_t sourceHash = HashFile(argv[i]);
+    if (!sourceHash) {
+      fprintf(stderr, "Unable to read %s\n", argv[i]);
+      failures++;
+      continue;
+    }
+    Model model = importFromFile(argv[i]);
+    if (!model.vertices || WriteModelCache(argv[i], sourceHash, &model)) {
+      FreeModel(&model);
+      failures++;
+      continue;
+    }
+    printf("Baked %s\n", argv[i]);
+    FreeModel(&model);
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,999 @@
+#include "window.c"
+#include "assetloader.h"
+#include "cull.h"
+#include "selection.h"
+
+// One benchmark per subcommand. There is no test suite, the benchmarks that
+// compare against a CPU reference or read back what they sent the GPU are
+// the checks, and exit non-zero when anything disagrees
+#define BENCH_MODEL "./data/SpaceShipDetailed.obj"
+#define BENCH_INSTANCES 100000
+
+// Set by --headless, every benchmark then draws offscreen without a window
+bool benchHeadless = false;
+
+double BenchSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Models/sec parsing copies of the ship through assimp, with the model cache
+// out of the picture, and the ship's size indexed and not
+void BenchLoad() {
+#define BENCH_LOAD_MODELS 32
+  char *paths[BENCH_LOAD_MODELS];
+  Model models[BENCH_LOAD_MODELS];
+  for (uint32_t i = 0; i < BENCH_LOAD_MODELS; i++) {
+    paths[i] = BENCH_MODEL;
+  }
+  uint32_t threadCounts[] = {1, 2, 4, 8};
+  double rates[4];
+  for (uint32_t t = 0; t < 4; t++) {
+    double start = BenchSeconds();
+    LoadModels(paths, BENCH_LOAD_MODELS, threadCounts[t], importFromFile,
+               models);
+    rates[t] = BENCH_LOAD_MODELS / (BenchSeconds() - start);
+    if (t == 0) {
+      // What the indexed mesh saves over a de-indexed triangle soup
+      Model *model = &models[0];
+      size_t soupBytes = (size_t)model->lods[0].indexCount * sizeof(Vertex);
+      size_t indexedBytes =
+          (size_t)model->vertexCount * sizeof(GpuVertex) +
+          (size_t)model->indexCount * IndexSize(model->indexType);
+      printf("load: %d vertices, %d indices (%d bit), %zu bytes vs %zu bytes "
+             "unindexed\n",
+             model->vertexCount, model->indexCount,
+             IndexSize(model->indexType) * 8, indexedBytes, soupBytes);
+    }
+    for (uint32_t i = 0; i < BENCH_LOAD_MODELS; i++) {
+      FreeModel(&models[i]);
+    }
+  }
+  for (uint32_t t = 0; t < 4; t++) {
+    printf("load: %d threads %.2f models/sec\n", threadCounts[t], rates[t]);
+  }
+}
+
+// Worst round trip error of vertices through GpuVertex, over random ones
+// and the normals along each axis where the octahedral fold has its edges.
+// Fails if either goes past what the vertex layout promises
+uint32_t BenchVertices() {
+#define BENCH_VERTICES 100000
+  Vertex *vertices = calloc(BENCH_VERTICES, sizeof(Vertex));
+  srand(1);
+  for (uint32_t i = 0; i < BENCH_VERTICES; i++) {
+    for (uint32_t k = 0; k < 3; k++) {
+      vertices[i].position[k] = (float)rand() / RAND_MAX * 170 - 50;
+      vertices[i].normal[k] = (float)rand() / RAND_MAX * 2 - 1;
+    }
+    vertices[i].position[3] = 1;
+    vertices[i].color[0] = vertices[i].color[1] = vertices[i].color[2] = 1;
+  }
+  for (uint32_t k = 0; k < 6; k++) {
+    glm_vec4_zero(vertices[k].normal);
+    vertices[k].normal[k % 3] = k < 3 ? 1 : -1;
+  }
+  Model model = {.vertexCount = BENCH_VERTICES};
+  double start = BenchSeconds();
+  PackVertices(&model, vertices);
+  double packTime = BenchSeconds() - start;
+  float positionError = 0, normalError = 0;
+  for (uint32_t i = 0; i < BENCH_VERTICES; i++) {
+    vec3 position, normal, expected;
+    UnpackVertex(&model, &model.vertices[i], position, normal);
+    for (uint32_t k = 0; k < 3; k++) {
+      positionError = glm_max(positionError,
+                              fabsf(position[k] - vertices[i].position[k]) /
+                                  model.positionScale[k]);
+    }
+    glm_vec3_normalize_to(vertices[i].normal, expected);
+    normalError = glm_max(normalError, glm_vec3_distance(normal, expected));
+  }
+  printf("vertices: %zu bytes each, packed %d in %.2f ms, worst error "
+         "position %g normal %g\n",
+         sizeof(GpuVertex), BENCH_VERTICES, packTime * 1000, positionError,
+         normalError);
+  free(model.vertices);
+  free(vertices);
+  if (positionError > VERTEX_POSITION_TOLERANCE ||
+      normalError > VERTEX_NORMAL_TOLERANCE) {
+    fprintf(stderr, "Vertex round trip error out of bounds\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Streams a buffer's worth of odd sized uploads through a staging ring a
+// fraction of its size, so the ring wraps around and blocks on its own
+// chunks many times over, then reads the buffer back and fails unless
+// every byte landed where it was sent
+uint32_t BenchStaging() {
+#define BENCH_STAGING_RING_SIZE (64 * 1024)
+#define BENCH_STAGING_BYTES (4 * 1024 * 1024)
+  GraphicsState graphics = InitGraphics(benchHeadless);
+  VkBuffer ringBuffer, dstBuffer;
+  GpuAllocation ringMemory, dstMemory;
+  if (CreateBuffer(&graphics.allocator, BENCH_STAGING_RING_SIZE,
+                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                       VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                   VK_BUFFER_USAGE_TRANSFER_SRC_BIT, &ringBuffer,
+                   &ringMemory) ||
+      CreateBuffer(&graphics.allocator, BENCH_STAGING_BYTES,
+                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                       VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                   VK_BUFFER_USAGE_TRANSFER_DST_BIT, &dstBuffer,
+                   &dstMemory)) {
+    fprintf(stderr, "Failed to create staging test buffers\n");
+    return 1;
+  }
+  StagingRing ring;
+  InitStagingRing(&ring, graphics.transferTimeline,
+                  graphics.transferCommandPool, ringBuffer, ringMemory.mapped,
+                  BENCH_STAGING_RING_SIZE);
+  uint8_t *data = malloc(BENCH_STAGING_BYTES);
+  srand(1);
+  for (uint32_t i = 0; i < BENCH_STAGING_BYTES; i++) {
+    data[i] = rand();
+  }
+  memset(dstMemory.mapped, 0, BENCH_STAGING_BYTES);
+  // From a byte up to a few chunks, so uploads get split as well as packed
+  // in together
+  uint32_t uploads = 0;
+  double start = BenchSeconds();
+  for (VkDeviceSize offset = 0; offset < BENCH_STAGING_BYTES; uploads++) {
+    VkDeviceSize size = 1 + rand() % (3 * BENCH_STAGING_RING_SIZE / 4);
+    if (offset + size > BENCH_STAGING_BYTES) {
+      size = BENCH_STAGING_BYTES - offset;
+    }
+    StagingUpload(&ring, dstBuffer, offset, data + offset, size);
+    offset += size;
+  }
+  uint64_t landed;
+  uint32_t failed = FinishStaging(&ring, &landed);
+  WaitTimeline(graphics.transferTimeline, landed);
+  double uploadTime = BenchSeconds() - start;
+  uint32_t wrong = 0;
+  for (uint32_t i = 0; i < BENCH_STAGING_BYTES; i++) {
+    wrong += ((uint8_t *)dstMemory.mapped)[i] != data[i];
+  }
+  uint32_t laps = ring.head / BENCH_STAGING_RING_SIZE;
+  printf("staging: %d uploads through a %d KB ring, wrapped %d times, "
+         "%.1f MB/s, %d bytes wrong\n",
+         uploads, BENCH_STAGING_RING_SIZE / 1024, laps,
+         BENCH_STAGING_BYTES / uploadTime / 1e6, wrong);
+  free(data);
+  DestroyBuffer(&graphics.allocator, ringBuffer, &ringMemory);
+  DestroyBuffer(&graphics.allocator, dstBuffer, &dstMemory);
+  if (failed) {
+    fprintf(stderr, "Staged uploads failed to submit\n");
+    return 1;
+  }
+  if (wrong > 0) {
+    fprintf(stderr, "Staged uploads came out corrupted\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Line up count more ships of def on a grid
+void AddBenchInstances(EntityDef *def, uint32_t count) {
+  uint32_t side = 316; // ~sqrt(BENCH_INSTANCES)
+  for (uint32_t k = 0; k < count; k++) {
+    uint32_t i = def->instances.count;
+    AddEntityInstance(def, (vec3){(i % side) * 5., 0, (i / side) * 5.},
+                      (versor)GLM_QUAT_IDENTITY_INIT,
+                      (vec3){0.01, 0.01, 0.01});
+  }
+}
+
+// Load the bench ship as a new def of graphics and line up instances of it.
+// Returns the def, NULL if the model couldn't be loaded or uploaded
+EntityDef *BenchScene(GraphicsState *graphics, uint32_t instances) {
+  Model model = loadFromFile(BENCH_MODEL);
+  if (!model.vertices) {
+    fprintf(stderr, "Failed to load %s\n", BENCH_MODEL);
+    return NULL;
+  }
+  uint32_t id = CreateEntityDef(graphics, &model);
+  FreeModel(&model);
+  if (id == UINT32_MAX) {
+    return NULL;
+  }
+  EntityDef *def = &graphics->entities[id];
+  AddBenchInstances(def, instances);
+  return def;
+}
+
+// Frame times while an army of a single ship type builds up to 100k
+// instances, growing its instance buffer along the way
+uint32_t BenchInstances() {
+#define BENCH_INSTANCE_BATCH 10000
+#define BENCH_INSTANCE_FRAMES 16
+  GraphicsState graphics = InitGraphics(benchHeadless);
+  EntityDef *def = BenchScene(&graphics, 0);
+  if (!def) {
+    return 1;
+  }
+  while (def->instances.count < BENCH_INSTANCES) {
+    AddBenchInstances(def, BENCH_INSTANCE_BATCH);
+    double start = BenchSeconds();
+    for (uint32_t f = 0; f < BENCH_INSTANCE_FRAMES; f++) {
+      PollWindowEvents(&graphics);
+      DrawGraphics(&graphics);
+    }
+    double frameTime = (BenchSeconds() - start) / BENCH_INSTANCE_FRAMES;
+    printf("instances: %6d instances, room for %6d, %d retiring, %.3f "
+           "ms/frame\n",
+           def->instances.count, def->gpuInstances, graphics.retiredCount,
+           frameTime * 1000);
+    if (def->gpuInstances < def->instances.count) {
+      fprintf(stderr, "Instance buffer fell behind the instances\n");
+      return 1;
+    }
+  }
+  PrintGpuAllocatorStats(&graphics.allocator);
+  return 0;
+}
+
+// Frame time histograms with one and then two frames in flight. Each frame
+// spins on a stand-in simulation tick first, so the CPU has work of its own
+// to overlap with the GPU's
+uint32_t BenchFrames() {
+#define BENCH_FRAME_INSTANCES 10000
+#define BENCH_FRAMES 600
+#define BENCH_SIM_SECONDS 0.004
+  GraphicsState graphics = InitGraphics(benchHeadless);
+  EntityDef *def = BenchScene(&graphics, BENCH_FRAME_INSTANCES);
+  if (!def) {
+    return 1;
+  }
+  double means[2];
+  for (uint32_t n = 1; n <= 2; n++) {
+    SetFramesInFlight(&graphics, n);
+    // Settle any uploads and re-recording outside of the measurement
+    DrawGraphics(&graphics);
+    ResetFrameHistogram(&graphics.frameTimes);
+    for (uint32_t f = 0; f < BENCH_FRAMES; f++) {
+      PollWindowEvents(&graphics);
+      double start = BenchSeconds();
+      while (BenchSeconds() - start < BENCH_SIM_SECONDS) {
+      }
+      DrawGraphics(&graphics);
+    }
+    printf("frames: %d in flight\n", n);
+    PrintFrameHistogram(&graphics.frameTimes);
+    means[n - 1] = graphics.frameTimes.total / graphics.frameTimes.frames;
+  }
+  printf("frames: %.2fx throughput with 2 frames in flight\n",
+         means[0] / means[1]);
+  return 0;
+}
+
+// Time to record the draw command buffer as the number of unit types grows,
+// which should stay flat now every def goes out in one indirect draw
+uint32_t BenchDefs() {
+#define BENCH_MAX_DEFS 256
+#define BENCH_DEF_INSTANCES 100
+#define BENCH_RECORDS 100
+  GraphicsState graphics = InitGraphics(benchHeadless);
+  Model model = loadFromFile(BENCH_MODEL);
+  if (!model.vertices) {
+    fprintf(stderr, "Failed to load %s\n", BENCH_MODEL);
+    return 1;
+  }
+  for (uint32_t defs = 1; defs <= BENCH_MAX_DEFS; defs *= 4) {
+    while (graphics.entityCount < defs) {
+      uint32_t id = CreateEntityDef(&graphics, &model);
+      if (id == UINT32_MAX) {
+        FreeModel(&model);
+        return 1;
+      }
+      AddBenchInstances(&graphics.entities[id], BENCH_DEF_INSTANCES);
+    }
+    DrawGraphics(&graphics);
+    WaitForFrames(&graphics);
+    FrameResources *frame = &graphics.frames[0];
+    double start = BenchSeconds();
+    for (uint32_t r = 0; r < BENCH_RECORDS; r++) {
+      vkResetCommandBuffer(frame->commandbuffers[0], 0);
+      SetupCommandBuffer(&graphics, frame, 0);
+    }
+    double recordTime = (BenchSeconds() - start) / BENCH_RECORDS;
+    start = BenchSeconds();
+    for (uint32_t f = 0; f < BENCH_FRAMES; f++) {
+      PollWindowEvents(&graphics);
+      DrawGraphics(&graphics);
+    }
+    double frameTime = (BenchSeconds() - start) / BENCH_FRAMES;
+    printf("defs: %4d defs, %.1f us to record, %.3f ms/frame\n", defs,
+           recordTime * 1e6, frameTime * 1000);
+  }
+  FreeModel(&model);
+  return 0;
+}
+
+// Copy size bytes of buffer back to the CPU, blocking until they land. The
+// returned copy is the caller's to free
+void *BenchReadBack(GraphicsState *graphics, VkBuffer buffer,
+                    VkDeviceSize size) {
+  VkBuffer readBuffer;
+  GpuAllocation readMemory;
+  CreateBuffer(&graphics->allocator, size,
+               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+               VK_BUFFER_USAGE_TRANSFER_DST_BIT, &readBuffer, &readMemory);
+  VkCommandBuffer commandBuffer;
+  vkAllocateCommandBuffers(
+      graphics->device,
+      &(VkCommandBufferAllocateInfo){
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+          .commandPool = graphics->commandPool,
+          .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+          .commandBufferCount = 1},
+      &commandBuffer);
+  vkBeginCommandBuffer(
+      commandBuffer,
+      &(VkCommandBufferBeginInfo){
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+          .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT});
+  vkCmdPipelineBarrier(
+      commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1,
+      &(VkMemoryBarrier){.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                         .srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT,
+                         .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT},
+      0, NULL, 0, NULL);
+  vkCmdCopyBuffer(commandBuffer, buffer, readBuffer, 1,
+                  &(VkBufferCopy){.size = size});
+  vkCmdPipelineBarrier(
+      commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_HOST_BIT, 0, 1,
+      &(VkMemoryBarrier){.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                         .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                         .dstAccessMask = VK_ACCESS_HOST_READ_BIT},
+      0, NULL, 0, NULL);
+  vkEndCommandBuffer(commandBuffer);
+  WaitTimeline(graphics->graphicsTimeline,
+               SubmitTimeline(graphics->graphicsTimeline, &commandBuffer, 1,
+                              NULL, 0, VK_NULL_HANDLE));
+  void *data = malloc(size);
+  memcpy(data, readMemory.mapped, size);
+  vkFreeCommandBuffers(graphics->device, graphics->commandPool, 1,
+                       &commandBuffer);
+  DestroyBuffer(&graphics->allocator, readBuffer, &readMemory);
+  return data;
+}
+
+// The per level draws of def t that culling filled in for one of its passes
+// into draws, one of the frame's culled or late draw buffers. The returned
+// MODEL_MAX_LODS draws are the caller's to free
+VkDrawIndexedIndirectCommand *BenchReadLodDraws(GraphicsState *graphics,
+                                                FrameResources *frame,
+                                                VkBuffer draws, uint32_t t) {
+  uint32_t arenaDraws = frame->drawCapacity * MODEL_MAX_LODS;
+  VkDrawIndexedIndirectCommand *all = BenchReadBack(
+      graphics, draws,
+      sizeof(VkDrawIndexedIndirectCommand) * arenaDraws * INDEX_ARENAS);
+  VkDrawIndexedIndirectCommand *lodDraws =
+      malloc(sizeof(VkDrawIndexedIndirectCommand) * MODEL_MAX_LODS);
+  uint32_t arena = IndexArena(graphics->entities[t].model.indexType);
+  memcpy(lodDraws, &all[arena * arenaDraws + t * MODEL_MAX_LODS],
+         sizeof(VkDrawIndexedIndirectCommand) * MODEL_MAX_LODS);
+  free(all);
+  return lodDraws;
+}
+
+// How far inside the frustum a sphere is, negative when outside
+float BenchSphereMargin(Frustum *frustum, vec4 sphere) {
+  float margin = INFINITY;
+  for (uint32_t p = 0; p < 6; p++) {
+    float distance = glm_vec3_dot(frustum->planes[p], sphere) +
+                     frustum->planes[p][3] + sphere[3];
+    margin = distance < margin ? distance : margin;
+  }
+  return margin;
+}
+
+// Checks the GPU's frustum culling against the CPU reference, and the SIMD
+// reference against the scalar one while timing both
+uint32_t BenchCull() {
+#define BENCH_CULL_RUNS 20
+// Spheres this close to a plane may land either side of it on the GPU
+#define BENCH_CULL_EPSILON 1e-3
+  GraphicsState graphics = InitGraphics(benchHeadless);
+  // The CPU reference only knows about the frustum
+  SetOcclusionCulling(&graphics, false);
+  EntityDef *def = BenchScene(&graphics, BENCH_INSTANCES);
+  if (!def) {
+    return 1;
+  }
+  // Over the middle of the grid looking along it
+  glm_translate_make(graphics.camera->view, (vec3){790, 10, 800});
+  Frustum frustum;
+  FrustumFromCamera(graphics.camera->view, graphics.camera->proj, &frustum);
+
+  uint32_t *reference = malloc(sizeof(uint32_t) * def->instances.count);
+  uint32_t *visible = malloc(sizeof(uint32_t) * def->instances.count);
+  uint32_t referenceCount = 0, visibleCount = 0;
+  double start = BenchSeconds();
+  for (uint32_t r = 0; r < BENCH_CULL_RUNS; r++) {
+    referenceCount = CullInstancesScalar(&frustum, &def->model,
+                                         &def->instances, reference);
+  }
+  double scalarTime = (BenchSeconds() - start) / BENCH_CULL_RUNS;
+  start = BenchSeconds();
+  for (uint32_t r = 0; r < BENCH_CULL_RUNS; r++) {
+    visibleCount =
+        CullInstances(&frustum, &def->model, &def->instances, visible);
+  }
+  double simdTime = (BenchSeconds() - start) / BENCH_CULL_RUNS;
+  printf("cull: %d of %d visible, scalar %.3f ms, simd %.3f ms (%.2fx)\n",
+         referenceCount, def->instances.count, scalarTime * 1000,
+         simdTime * 1000, scalarTime / simdTime);
+  if (visibleCount != referenceCount ||
+      memcmp(visible, reference, sizeof(uint32_t) * visibleCount)) {
+    fprintf(stderr, "SIMD and scalar culling disagree\n");
+    return 1;
+  }
+
+  DrawGraphics(&graphics);
+  WaitForFrames(&graphics);
+  FrameResources *frame =
+      &graphics.frames[(graphics.frameCount - 1) % graphics.framesInFlight];
+  VkDrawIndexedIndirectCommand *draws =
+      BenchReadLodDraws(&graphics, frame, frame->culledDrawBuffer, 0);
+  Instance *culled = BenchReadBack(&graphics, frame->culledBuffer,
+                                   sizeof(Instance) * frame->culledCapacity);
+  // This is the only def so instance ids count up from its first instance
+  uint32_t firstId = def->instances.ids[0];
+  bool *onCpu = calloc(def->instances.count, sizeof(bool));
+  bool *onGpu = calloc(def->instances.count, sizeof(bool));
+  for (uint32_t i = 0; i < referenceCount; i++) {
+    onCpu[reference[i]] = true;
+  }
+  uint32_t gpuCount = 0;
+  bool packed = true;
+  for (uint32_t l = 0; l < MODEL_MAX_LODS; l++) {
+    // Every level straight after the one before, from the def's first
+    // instance, there being no late pass without occlusion culling
+    uint32_t first = def->firstInstance + gpuCount;
+    packed = packed &&
+             (!draws[l].instanceCount || draws[l].firstInstance == first);
+    for (uint32_t i = 0; i < draws[l].instanceCount; i++) {
+      onGpu[culled[draws[l].firstInstance + i].instanceId - firstId] = true;
+    }
+    gpuCount += draws[l].instanceCount;
+  }
+  uint32_t borderline = 0, mismatches = 0;
+  for (uint32_t i = 0; i < def->instances.count; i++) {
+    if (onCpu[i] == onGpu[i]) {
+      continue;
+    }
+    vec4 sphere;
+    InstanceSphere(&def->model, &def->instances, i, sphere);
+    if (fabsf(BenchSphereMargin(&frustum, sphere)) < BENCH_CULL_EPSILON) {
+      borderline++;
+    } else {
+      mismatches++;
+    }
+  }
+  printf("cull: gpu drew %d, %d borderline, %d mismatched\n", gpuCount,
+         borderline, mismatches);
+  if (!packed) {
+    fprintf(stderr, "Culled instances aren't packed level after level\n");
+  }
+  free(draws);
+  free(culled);
+  free(onCpu);
+  free(onGpu);
+  free(reference);
+  free(visible);
+  return mismatches > 0 || !packed;
+}
+
+// How close SelectLod's pick for instance index is to tipping over to
+// another level, relative to the error allowed at its distance
+float BenchLodMargin(Model *model, InstanceStore *store, uint32_t index,
+                     vec4 sphere, vec3 eye, mat4 proj, float screenHeight) {
+  float *scale = store->scales[index];
+  float distance = glm_vec3_distance(sphere, eye) - sphere[3];
+  float projected =
+      glm_max(glm_max(fabsf(scale[0]), fabsf(scale[1])), fabsf(scale[2])) *
+      fabsf(proj[1][1]);
+  float allowed = LOD_SCREEN_PIXELS * 2 / screenHeight * distance;
+  float margin = INFINITY;
+  for (uint32_t l = 1; l < model->lodCount; l++) {
+    float off = fabsf(model->lods[l].error * projected - allowed) /
+                fabsf(allowed);
+    margin = off < margin ? off : margin;
+  }
+  return margin;
+}
+
+// Triangles the GPU gets asked to draw as the camera backs away from a fleet,
+// against what the same ships would cost at full detail. The GPU's pick of
+// levels is checked against the CPU's
+uint32_t BenchLod() {
+#define BENCH_LOD_INSTANCES 10000
+// Instances this close to a level's threshold may pick either level on the GPU
+#define BENCH_LOD_EPSILON 1e-3
+  GraphicsState graphics = InitGraphics(benchHeadless);
+  SetOcclusionCulling(&graphics, false);
+  EntityDef *def = BenchScene(&graphics, BENCH_LOD_INSTANCES);
+  if (!def) {
+    return 1;
+  }
+  for (uint32_t l = 0; l < def->model.lodCount; l++) {
+    printf("lod: level %d has %d triangles, error %g\n", l,
+           def->model.lods[l].indexCount / 3, def->model.lods[l].error);
+  }
+  uint32_t *visible = malloc(sizeof(uint32_t) * def->instances.count);
+  uint32_t mismatched = 0;
+  float distances[] = {1, 5, 10, 20, 40};
+  for (uint32_t d = 0; d < sizeof(distances) / sizeof(float); d++) {
+    // In front of the grid's first row looking along it
+    vec3 eye = {790, 2, -distances[d]};
+    glm_translate_make(graphics.camera->view, eye);
+    glm_rotate_y(graphics.camera->view, GLM_PI, graphics.camera->view);
+    DrawGraphics(&graphics);
+    WaitForFrames(&graphics);
+    FrameResources *frame =
+        &graphics.frames[(graphics.frameCount - 1) % graphics.framesInFlight];
+    VkDrawIndexedIndirectCommand *draws =
+        BenchReadLodDraws(&graphics, frame, frame->culledDrawBuffer, 0);
+    uint64_t submitted = 0, full = 0;
+    uint32_t levels[MODEL_MAX_LODS] = {0};
+    for (uint32_t l = 0; l < MODEL_MAX_LODS; l++) {
+      submitted += (uint64_t)draws[l].instanceCount * draws[l].indexCount / 3;
+      full += (uint64_t)draws[l].instanceCount *
+              def->model.lods[0].indexCount / 3;
+    }
+    Frustum frustum;
+    FrustumFromCamera(graphics.camera->view, graphics.camera->proj, &frustum);
+    uint32_t visibleCount =
+        CullInstances(&frustum, &def->model, &def->instances, visible);
+    uint64_t expected = 0;
+    for (uint32_t i = 0; i < visibleCount; i++) {
+      vec4 sphere;
+      InstanceSphere(&def->model, &def->instances, visible[i], sphere);
+      uint32_t lod =
+          SelectLod(&def->model, &def->instances, visible[i], sphere, eye,
+                    graphics.camera->proj, graphics.renderArea.height);
+      levels[lod]++;
+      expected += def->model.lods[lod].indexCount / 3;
+    }
+    // Each borderline instance can move one count between two levels, or
+    // in or out of one if it's on the edge of the frustum
+    uint32_t borderline = 0;
+    for (uint32_t i = 0; i < def->instances.count; i++) {
+      vec4 sphere;
+      InstanceSphere(&def->model, &def->instances, i, sphere);
+      if (fabsf(BenchSphereMargin(&frustum, sphere)) < BENCH_CULL_EPSILON ||
+          BenchLodMargin(&def->model, &def->instances, i, sphere, eye,
+                         graphics.camera->proj,
+                         graphics.renderArea.height) < BENCH_LOD_EPSILON) {
+        borderline++;
+      }
+    }
+    uint32_t off = 0;
+    for (uint32_t l = 0; l < MODEL_MAX_LODS; l++) {
+      off += draws[l].instanceCount > levels[l]
+                 ? draws[l].instanceCount - levels[l]
+                 : levels[l] - draws[l].instanceCount;
+    }
+    printf("lod: %4.0f units, %8" PRIu64 " triangles/frame (cpu %8" PRIu64
+           "), %8" PRIu64 " at full detail, instances per level",
+           distances[d], submitted, expected, full);
+    for (uint32_t l = 0; l < MODEL_MAX_LODS; l++) {
+      printf(" %d/%d", draws[l].instanceCount, levels[l]);
+    }
+    printf(", %d borderline\n", borderline);
+    if (off > 2 * borderline) {
+      fprintf(stderr, "GPU and CPU disagree on levels at %g units\n",
+              distances[d]);
+      mismatched++;
+    }
+    free(draws);
+  }
+  free(visible);
+  return mismatched > 0;
+}
+
+// Frame time and instances drawn from inside a fleet, where most ships are
+// hidden behind the ones nearest the camera, with and without testing them
+// against the depth pyramid
+uint32_t BenchOcclusion() {
+#define BENCH_OCCLUSION_FRAMES 300
+  GraphicsState graphics = InitGraphics(benchHeadless);
+  EntityDef *def = BenchScene(&graphics, BENCH_INSTANCES);
+  if (!def) {
+    return 1;
+  }
+  // Level with the ships in the middle of the grid, looking along it
+  glm_translate_make(graphics.camera->view, (vec3){790, 0, 800});
+  double frameTimes[2];
+  uint32_t drawn[2];
+  for (uint32_t on = 0; on < 2; on++) {
+    SetOcclusionCulling(&graphics, on);
+    // Re-record, and give the pyramid a frame to catch up with the camera
+    DrawGraphics(&graphics);
+    DrawGraphics(&graphics);
+    WaitForFrames(&graphics);
+    double start = BenchSeconds();
+    for (uint32_t f = 0; f < BENCH_OCCLUSION_FRAMES; f++) {
+      PollWindowEvents(&graphics);
+      DrawGraphics(&graphics);
+    }
+    WaitForFrames(&graphics);
+    frameTimes[on] = (BenchSeconds() - start) / BENCH_OCCLUSION_FRAMES;
+    FrameResources *frame =
+        &graphics.frames[(graphics.frameCount - 1) % graphics.framesInFlight];
+    VkDrawIndexedIndirectCommand *early =
+        BenchReadLodDraws(&graphics, frame, frame->culledDrawBuffer, 0);
+    VkDrawIndexedIndirectCommand *late =
+        BenchReadLodDraws(&graphics, frame, frame->lateDrawBuffer, 0);
+    drawn[on] = 0;
+    for (uint32_t l = 0; l < MODEL_MAX_LODS; l++) {
+      drawn[on] += early[l].instanceCount + late[l].instanceCount;
+    }
+    printf("occlusion: %s, %6d of %d instances drawn, %.3f ms/frame\n",
+           on ? "on " : "off", drawn[on], def->instances.count,
+           frameTimes[on] * 1000);
+    free(early);
+    free(late);
+  }
+  printf("occlusion: %.2fx fewer instances, %.2fx frame time\n",
+         (double)drawn[0] / (drawn[1] ? drawn[1] : 1),
+         frameTimes[0] / frameTimes[1]);
+  return 0;
+}
+
+// Microseconds to box select out of a fleet on the CPU, scalar against SIMD,
+// for a small box and one covering most of the screen. Then the size of the
+// selection buffer and time to write it out with a million instances
+uint32_t BenchSelect() {
+#define BENCH_SELECT_RUNS 50
+#define BENCH_SELECT_MAX_INSTANCES 1000000
+  Model model = loadFromFile(BENCH_MODEL);
+  if (!model.vertices) {
+    fprintf(stderr, "Failed to load %s\n", BENCH_MODEL);
+    return 1;
+  }
+  EntityDef def = {.model = model};
+  AddBenchInstances(&def, BENCH_INSTANCES);
+  // Over the middle of the grid looking along it, like the cull bench
+  CameraState camera;
+  glm_translate_make(camera.view, (vec3){790, 10, 800});
+  glm_perspective(80, 600. / 400., 0.1, 50, camera.proj);
+  vec4 boxes[] = {{280, 180, 320, 220}, {20, 20, 580, 380}};
+  Selection scalar = {0}, simd = {0};
+  for (uint32_t b = 0; b < sizeof(boxes) / sizeof(vec4); b++) {
+    SelectionView selectionView;
+    SelectionViewFromCamera(camera.view, camera.proj, (vec2){600, 400},
+                            boxes[b], &selectionView);
+    double start = BenchSeconds();
+    for (uint32_t r = 0; r < BENCH_SELECT_RUNS; r++) {
+      scalar.count = 0;
+      SelectInBoxScalar(&selectionView, &def.model, &def.instances, &scalar);
+    }
+    double scalarTime = (BenchSeconds() - start) / BENCH_SELECT_RUNS;
+    start = BenchSeconds();
+    for (uint32_t r = 0; r < BENCH_SELECT_RUNS; r++) {
+      SelectEntities(&selectionView, &def, 1, &simd);
+    }
+    double simdTime = (BenchSeconds() - start) / BENCH_SELECT_RUNS;
+    printf("select: %6d of %d selected, scalar %.1f us, simd %.1f us "
+           "(%.2fx)\n",
+           simd.count, def.instances.count, scalarTime * 1e6, simdTime * 1e6,
+           scalarTime / simdTime);
+    if (simd.count != scalar.count ||
+        memcmp(simd.ids, scalar.ids, sizeof(uint32_t) * simd.count)) {
+      fprintf(stderr, "SIMD and scalar selection disagree\n");
+      return 1;
+    }
+  }
+
+  AddBenchInstances(&def,
+                    BENCH_SELECT_MAX_INSTANCES - def.instances.count);
+  // Over the far end of the grid, where the highest ids are
+  glm_translate_make(camera.view, (vec3){790, 10, 15830});
+  SelectionView selectionView;
+  SelectionViewFromCamera(camera.view, camera.proj, (vec2){600, 400},
+                          boxes[1], &selectionView);
+  SelectEntities(&selectionView, &def, 1, &simd);
+  uint32_t wordCount = SelectionWords(instanceIdCount);
+  size_t size = SelectionBufferSize(wordCount, simd.count);
+  uint32_t *buffer = malloc(size);
+  double start = BenchSeconds();
+  for (uint32_t r = 0; r < BENCH_SELECT_RUNS; r++) {
+    WriteSelectionBuffer(&simd, wordCount, buffer);
+  }
+  double writeTime = (BenchSeconds() - start) / BENCH_SELECT_RUNS;
+  uint32_t *bits = buffer + sizeof(SelectionHeader) / sizeof(uint32_t);
+  uint32_t setBits = 0;
+  for (uint32_t w = 0; w < wordCount; w++) {
+    setBits += __builtin_popcount(bits[w]);
+  }
+  printf("select: %d of %d selected, %.1f KB selection buffer written in "
+         "%.1f us\n",
+         simd.count, def.instances.count, size / 1024., writeTime * 1e6);
+  free(buffer);
+  if (setBits != simd.count) {
+    fprintf(stderr, "Selection bitset has %d bits set for %d ids\n", setBits,
+            simd.count);
+    return 1;
+  }
+  free(scalar.ids);
+  free(simd.ids);
+  FreeInstanceStore(&def.instances);
+  FreeModel(&model);
+  return 0;
+}
+
+// Frame time without picking and then with a pick of the middle of the
+// screen asked for every frame, and how many frames the results take to
+// come back. Picking should never hold a frame up
+uint32_t BenchPick() {
+#define BENCH_PICK_FRAMES 300
+  GraphicsState graphics = InitGraphics(benchHeadless);
+  EntityDef *def = BenchScene(&graphics, BENCH_FRAME_INSTANCES);
+  if (!def) {
+    return 1;
+  }
+  glm_translate_make(graphics.camera->view, (vec3){250, 10, 300});
+  VkRect2D region = {
+      .offset = {graphics.renderArea.width / 2 - 8,
+                 graphics.renderArea.height / 2 - 8},
+      .extent = {16, 16}};
+  double frameTimes[2];
+  uint32_t tickets[BENCH_PICK_FRAMES];
+  uint64_t requestedAt[BENCH_PICK_FRAMES];
+  uint32_t received = 0, pending = 0, dropped = 0, picked = 0;
+  uint64_t latency = 0;
+  for (uint32_t picking = 0; picking < 2; picking++) {
+    DrawGraphics(&graphics);
+    WaitForFrames(&graphics);
+    double start = BenchSeconds();
+    for (uint32_t f = 0; f < BENCH_PICK_FRAMES; f++) {
+      PollWindowEvents(&graphics);
+      if (picking) {
+        tickets[f] = RequestPick(&graphics.picker, region);
+        requestedAt[f] = graphics.frameCount;
+        pending++;
+      }
+      DrawGraphics(&graphics);
+      for (uint32_t t = received; picking && t <= f; t++) {
+        if (tickets[t] == 0) {
+          continue;
+        }
+        PickResult result;
+        PickStatus status = PollPick(&graphics.picker, tickets[t], &result);
+        if (status == PICK_READY) {
+          latency += graphics.frameCount - requestedAt[t];
+          picked += result.count;
+          free(result.ids);
+        } else if (status == PICK_DROPPED) {
+          dropped++;
+        }
+        if (status != PICK_PENDING) {
+          tickets[t] = 0;
+          pending--;
+        }
+      }
+      while (received <= f && picking && tickets[received] == 0) {
+        received++;
+      }
+    }
+    frameTimes[picking] = (BenchSeconds() - start) / BENCH_PICK_FRAMES;
+  }
+  uint32_t delivered = BENCH_PICK_FRAMES - pending - dropped;
+  printf("pick: %.3f ms/frame without, %.3f ms/frame picking every frame\n",
+         frameTimes[0] * 1000, frameTimes[1] * 1000);
+  printf("pick: %d of %d results back, %d dropped, %.2f frames later on "
+         "average, %.1f instances each\n",
+         delivered, BENCH_PICK_FRAMES, dropped,
+         delivered ? (double)latency / delivered : 0.,
+         delivered ? (double)picked / delivered : 0.);
+  return 0;
+}
+
+// A whole instance to a struct, the way defs used to store them, for
+// BenchStore to compare against
+typedef struct BenchAosInstance {
+  mat4 rotation;
+  vec4 position;
+  vec4 scale;
+  uint32_t instanceId;
+  bool selected;
+} BenchAosInstance;
+
+// Nanoseconds per instance to add to, move every instance of, and remove
+// from an instance store of a million ships. Moving them is timed against
+// the same tick over an array of whole instance structs, to show what
+// streaming through positions alone saves
+uint32_t BenchStore() {
+#define BENCH_STORE_INSTANCES 1000000
+#define BENCH_STORE_TICKS 20
+  InstanceStore store = {0};
+  InstanceHandle *handles =
+      malloc(sizeof(InstanceHandle) * BENCH_STORE_INSTANCES);
+  double start = BenchSeconds();
+  for (uint32_t i = 0; i < BENCH_STORE_INSTANCES; i++) {
+    handles[i] = AddInstance(&store, (vec3){i % 1000, 0, i / 1000},
+                             (versor)GLM_QUAT_IDENTITY_INIT,
+                             (vec3){0.01, 0.01, 0.01}, i);
+  }
+  double addTime = (BenchSeconds() - start) / BENCH_STORE_INSTANCES;
+
+  vec4 velocity = {0.1, 0, 0.2, 0};
+  start = BenchSeconds();
+  for (uint32_t t = 0; t < BENCH_STORE_TICKS; t++) {
+    for (uint32_t i = 0; i < store.count; i++) {
+      glm_vec4_add(store.positions[i], velocity, store.positions[i]);
+    }
+    MarkInstancesDirty(&store, 0, store.count);
+  }
+  double tickTime = (BenchSeconds() - start) / BENCH_STORE_TICKS;
+  BenchAosInstance *aos = calloc(store.count, sizeof(BenchAosInstance));
+  start = BenchSeconds();
+  for (uint32_t t = 0; t < BENCH_STORE_TICKS; t++) {
+    for (uint32_t i = 0; i < store.count; i++) {
+      glm_vec4_add(aos[i].position, velocity, aos[i].position);
+    }
+  }
+  double aosTime = (BenchSeconds() - start) / BENCH_STORE_TICKS;
+  free(aos);
+  uint32_t first, count, ranges = 0;
+  while (NextDirtyRange(&store, INSTANCE_COALESCE_GAP, &first, &count)) {
+    ranges++;
+  }
+  if (ranges != 1) {
+    fprintf(stderr, "Moving every instance left %d dirty ranges\n", ranges);
+    return 1;
+  }
+
+  // Every other one, from a shuffled order so the swaps land all over
+  uint32_t removeCount = BENCH_STORE_INSTANCES / 2;
+  uint32_t *order = malloc(sizeof(uint32_t) * removeCount);
+  for (uint32_t i = 0; i < removeCount; i++) {
+    order[i] = i * 2;
+  }
+  srand(1);
+  for (uint32_t i = removeCount - 1; i > 0; i--) {
+    uint32_t j = rand() % (i + 1);
+    uint32_t swap = order[i];
+    order[i] = order[j];
+    order[j] = swap;
+  }
+  start = BenchSeconds();
+  for (uint32_t i = 0; i < removeCount; i++) {
+    RemoveInstance(&store, handles[order[i]]);
+  }
+  double removeTime = (BenchSeconds() - start) / removeCount;
+  free(order);
+
+  // Removed handles have to be turned away, and the rest still find their
+  // own instance wherever it was moved to
+  uint32_t wrong = 0;
+  for (uint32_t i = 0; i < BENCH_STORE_INSTANCES; i++) {
+    uint32_t index = InstanceIndex(&store, handles[i]);
+    if (i % 2 == 0 ? index != INSTANCE_NONE
+                   : index == INSTANCE_NONE || store.ids[index] != i) {
+      wrong++;
+    }
+  }
+  printf("store: add %.1f ns, remove %.1f ns per instance\n", addTime * 1e9,
+         removeTime * 1e9);
+  printf("store: moving %d instances %.3f ms/tick, %.3f ms as structs "
+         "(%.2fx)\n",
+         BENCH_STORE_INSTANCES, tickTime * 1000, aosTime * 1000,
+         aosTime / tickTime);
+  free(handles);
+  FreeInstanceStore(&store);
+  if (wrong > 0) {
+    fprintf(stderr, "%d handles reached the wrong instance\n", wrong);
+    return 1;
+  }
+  return 0;
+}
+
+// GPU milliseconds per frame drawing the ship scene at 10k instances, from
+// the timestamps around each frame's command buffer
+uint32_t BenchGpu() {
+#define BENCH_GPU_FRAMES 300
+  GraphicsState graphics = InitGraphics(benchHeadless);
+  if (graphics.timestampPeriod == 0) {
+    fprintf(stderr, "Graphics queue can't write timestamps\n");
+    return 1;
+  }
+  EntityDef *def = BenchScene(&graphics, BENCH_FRAME_INSTANCES);
+  if (!def) {
+    return 1;
+  }
+  // Above the fleet looking along it, most of it in view
+  glm_translate_make(graphics.camera->view, (vec3){250, 20, 330});
+  glm_rotate_x(graphics.camera->view, -0.3, graphics.camera->view);
+  DrawGraphics(&graphics);
+  WaitForFrames(&graphics);
+  double total = 0, fastest = INFINITY, slowest = 0;
+  uint32_t timed = 0;
+  for (uint32_t f = 0; f < BENCH_GPU_FRAMES; f++) {
+    PollWindowEvents(&graphics);
+    DrawGraphics(&graphics);
+    // Waiting leaves the CPU idle, but it's the GPU's time being measured
+    WaitForFrames(&graphics);
+    double time = FrameGpuTime(
+        &graphics,
+        &graphics.frames[(graphics.frameCount - 1) % graphics.framesInFlight]);
+    if (time < 0) {
+      continue;
+    }
+    total += time;
+    fastest = time < fastest ? time : fastest;
+    slowest = time > slowest ? time : slowest;
+    timed++;
+  }
+  if (timed == 0) {
+    fprintf(stderr, "No frame came back with timestamps\n");
+    return 1;
+  }
+  printf("gpu: %d instances, %.3f ms/frame mean, %.3f min, %.3f max over %d "
+         "frames\n",
+         def->instances.count, total / timed, fastest, slowest, timed);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || (argc > 2 && strcmp(argv[2], "--headless") != 0)) {
+    fprintf(stderr,
+            "Usage: %s "
+            "<load|vertices|staging|instances|frames|defs|cull|lod|"
+            "occlusion|select|pick|store|gpu> [--headless]\n",
+            argv[0]);
+    return 1;
+  }
+  benchHeadless = argc > 2;
+  if (strcmp(argv[1], "load") == 0) {
+    BenchLoad();
+    return 0;
+  }
+  if (strcmp(argv[1], "vertices") == 0) {
+    return BenchVertices();
+  }
+  if (strcmp(argv[1], "staging") == 0) {
+    return BenchStaging();
+  }
+  if (strcmp(argv[1], "instances") == 0) {
+    return BenchInstances();
+  }
+  if (strcmp(argv[1], "frames") == 0) {
+    return BenchFrames();
+  }
+  if (strcmp(argv[1], "defs") == 0) {
+    return BenchDefs();
+  }
+  if (strcmp(argv[1], "cull") == 0) {
+    return BenchCull();
+  }
+  if (strcmp(argv[1], "lod") == 0) {
+    return BenchLod();
+  }
+  if (strcmp(argv[1], "occlusion") == 0) {
+    return BenchOcclusion();
+  }
+  if (strcmp(argv[1], "select") == 0) {
+    return BenchSelect();
+  }
+  if (strcmp(argv[1], "pick") == 0) {
+    return BenchPick();
+  }
+  if (strcmp(argv[1], "store") == 0) {
+    return BenchStore();
+  }
+  if (strcmp(argv[1], "gpu") == 0) {
+    return BenchGpu();
+  }
+  fprintf(stderr, "Unknown benchmark %s\n", argv[1]);
+  return 1;
+}
@@ -0,0 +1,208 @@
+#ifndef OPENDOM_CULL
+#define OPENDOM_CULL
+#include <cglm/cglm.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "./model.h"
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+// CPU side of the frustum culling done by shaders/cull.comp, used as the
+// reference the GPU results are checked against. Both have to agree on the
+// maths below exactly, instances right on a plane could otherwise go either
+// way. Occlusion culling against the depth pyramid is only done on the GPU,
+// compare against this with it turned off (SetOcclusionCulling).
+
+// Plane normals point into the frustum, so a point p is inside a plane when
+// dot(plane.xyz, p) + plane.w >= 0. Normals are unit length so the distance
+// can be compared against a sphere's radius directly
+typedef struct Frustum {
+  vec4 planes[6];
+} Frustum;
+
+/**
+ * Pull the frustum planes out of the camera matrices, the same view
+ * projection the vertex shader transforms with (proj * inverse(view)) and
+ * Vulkan's 0 to w depth range.
+ */
+void FrustumFromCamera(mat4 view, mat4 proj, Frustum *frustum) {
+  mat4 inverseView, viewProj;
+  glm_mat4_inv(view, inverseView);
+  glm_mat4_mul(proj, inverseView, viewProj);
+  vec4 rows[4];
+  for (uint32_t r = 0; r < 4; r++) {
+    for (uint32_t c = 0; c < 4; c++) {
+      rows[r][c] = viewProj[c][r];
+    }
+  }
+  glm_vec4_add(rows[3], rows[0], frustum->planes[0]);
+  glm_vec4_sub(rows[3], rows[0], frustum->planes[1]);
+  glm_vec4_add(rows[3], rows[1], frustum->planes[2]);
+  glm_vec4_sub(rows[3], rows[1], frustum->planes[3]);
+  glm_vec4_copy(rows[2], frustum->planes[4]);
+  glm_vec4_sub(rows[3], rows[2], frustum->planes[5]);
+  for (uint32_t p = 0; p < 6; p++) {
+    float length = glm_vec3_norm(frustum->planes[p]);
+    glm_vec4_scale(frustum->planes[p], 1 / length, frustum->planes[p]);
+  }
+}
+
+// Rotate v by the unit quaternion q like the shaders do, as
+// v + 2 * cross(q.xyz, cross(q.xyz, v) + q.w * v). out can be v
+void RotateByQuaternion(versor q, vec3 v, vec3 out) {
+  vec3 t = {q[1] * v[2] - q[2] * v[1] + q[3] * v[0],
+            q[2] * v[0] - q[0] * v[2] + q[3] * v[1],
+            q[0] * v[1] - q[1] * v[0] + q[3] * v[2]};
+  vec3 rotated = {v[0] + 2 * (q[1] * t[2] - q[2] * t[1]),
+                  v[1] + 2 * (q[2] * t[0] - q[0] * t[2]),
+                  v[2] + 2 * (q[0] * t[1] - q[1] * t[0])};
+  glm_vec3_copy(rotated, out);
+}
+
+/**
+ * Bounding sphere of instance index of model in store, xyz centre and w
+ * radius. The model's own sphere is moved by the instance's scale, rotation
+ * and position like the vertex shader does, and grown by its largest scale
+ * axis.
+ */
+void InstanceSphere(Model *model, InstanceStore *store, uint32_t index,
+                    vec4 sphere) {
+  float *bounds = model->bounds.sphere;
+  float *scale = store->scales[index];
+  float *position = store->positions[index];
+  vec3 center = {bounds[0] * scale[0], bounds[1] * scale[1],
+                 bounds[2] * scale[2]};
+  // Rotated the way the GPU gets the orientation, so both agree
+  int16_t packed[4];
+  versor orientation;
+  PackOrientation(store->orientations[index], packed);
+  UnpackOrientation(packed, orientation);
+  RotateByQuaternion(orientation, center, center);
+  sphere[0] = center[0] + position[0];
+  sphere[1] = center[1] + position[1];
+  sphere[2] = center[2] + position[2];
+  sphere[3] = bounds[3] * glm_max(glm_max(fabsf(scale[0]), fabsf(scale[1])),
+                                  fabsf(scale[2]));
+}
+
+// A level of detail can be picked while its error comes out at no more than
+// this many pixels on screen
+#define LOD_SCREEN_PIXELS 1.f
+
+/**
+ * The level of detail of model culling draws instance index of store at,
+ * given its sphere from InstanceSphere, the camera's position eye and
+ * projection proj, and the height in pixels of what it's drawn to.
+ * That's the coarsest level whose error still projects under
+ * LOD_SCREEN_PIXELS at the point of the sphere nearest the camera.
+ */
+uint32_t SelectLod(Model *model, InstanceStore *store, uint32_t index,
+                   vec4 sphere, vec3 eye, mat4 proj, float screenHeight) {
+  float *scale = store->scales[index];
+  float distance = glm_vec3_distance(sphere, eye) - sphere[3];
+  float projected =
+      glm_max(glm_max(fabsf(scale[0]), fabsf(scale[1])), fabsf(scale[2])) *
+      fabsf(proj[1][1]);
+  // Normalised device coordinates span 2 over the height of the screen
+  float screenError = LOD_SCREEN_PIXELS * 2 / screenHeight;
+  uint32_t lod = 0;
+  for (uint32_t l = 1; l < model->lodCount; l++) {
+    if (model->lods[l].error * projected <= screenError * distance) {
+      lod = l;
+    }
+  }
+  return lod;
+}
+
+bool SphereVisible(Frustum *frustum, vec4 sphere) {
+  for (uint32_t p = 0; p < 6; p++) {
+    float *plane = frustum->planes[p];
+    if (plane[0] * sphere[0] + plane[1] * sphere[1] + plane[2] * sphere[2] +
+            plane[3] + sphere[3] <
+        0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// One instance at a time, writes the indices of the visible instances of
+// model in store to visible and returns how many there were
+uint32_t CullInstancesScalar(Frustum *frustum, Model *model,
+                             InstanceStore *store, uint32_t *visible) {
+  uint32_t visibleCount = 0;
+  for (uint32_t i = 0; i < store->count; i++) {
+    vec4 sphere;
+    InstanceSphere(model, store, i, sphere);
+    if (SphereVisible(frustum, sphere)) {
+      visible[visibleCount++] = i;
+    }
+  }
+  return visibleCount;
+}
+
+/**
+ * CullInstancesScalar testing four instances against each plane at once.
+ * The spheres are worked out a block at a time into SoA arrays the SSE loop
+ * then streams through. Falls back to the scalar version without SSE.
+ */
+uint32_t CullInstances(Frustum *frustum, Model *model, InstanceStore *store,
+                       uint32_t *visible) {
+#ifdef __SSE__
+#define CULL_BLOCK 256
+  float x[CULL_BLOCK], y[CULL_BLOCK], z[CULL_BLOCK], r[CULL_BLOCK];
+  __m128 planes[6][4];
+  for (uint32_t p = 0; p < 6; p++) {
+    for (uint32_t c = 0; c < 4; c++) {
+      planes[p][c] = _mm_set1_ps(frustum->planes[p][c]);
+    }
+  }
+  uint32_t visibleCount = 0;
+  uint32_t count = store->count;
+  for (uint32_t block = 0; block < count; block += CULL_BLOCK) {
+    uint32_t blockCount =
+        count - block < CULL_BLOCK ? count - block : CULL_BLOCK;
+    for (uint32_t i = 0; i < blockCount; i++) {
+      vec4 sphere;
+      InstanceSphere(model, store, block + i, sphere);
+      x[i] = sphere[0];
+      y[i] = sphere[1];
+      z[i] = sphere[2];
+      r[i] = sphere[3];
+    }
+    // Pad the last group of four out with spheres that never pass
+    for (uint32_t i = blockCount; i % 4 != 0; i++) {
+      x[i] = y[i] = z[i] = 0;
+      r[i] = -INFINITY;
+    }
+    for (uint32_t i = 0; i < blockCount; i += 4) {
+      __m128 sx = _mm_loadu_ps(&x[i]);
+      __m128 sy = _mm_loadu_ps(&y[i]);
+      __m128 sz = _mm_loadu_ps(&z[i]);
+      __m128 sr = _mm_loadu_ps(&r[i]);
+      __m128 inside = _mm_cmpeq_ps(sr, sr);
+      // Same order of operations as SphereVisible so both round alike
+      for (uint32_t p = 0; p < 6; p++) {
+        __m128 distance = _mm_mul_ps(planes[p][0], sx);
+        distance = _mm_add_ps(distance, _mm_mul_ps(planes[p][1], sy));
+        distance = _mm_add_ps(distance, _mm_mul_ps(planes[p][2], sz));
+        distance = _mm_add_ps(distance, planes[p][3]);
+        distance = _mm_add_ps(distance, sr);
+        inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, _mm_setzero_ps()));
+      }
+      uint32_t mask = _mm_movemask_ps(inside);
+      while (mask) {
+        uint32_t lane = __builtin_ctz(mask);
+        visible[visibleCount++] = block + i + lane;
+        mask &= mask - 1;
+      }
+    }
+  }
+  return visibleCount;
+#else
+  return CullInstancesScalar(frustum, model, store, visible);
+#endif
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef OPENDOM_FRAMETIME
+#define OPENDOM_FRAMETIME
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Frame times are bucketed at FRAME_BUCKET_MS granularity, anything past the
+// last bucket lands in it
+#define FRAME_BUCKETS 64
+#define FRAME_BUCKET_MS 0.5
+
+typedef struct FrameHistogram {
+  uint64_t buckets[FRAME_BUCKETS];
+  uint64_t frames;
+  double total;
+  double worst;
+  // When the previous frame was recorded, 0 before the first
+  double last;
+} FrameHistogram;
+
+double FrameClock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void ResetFrameHistogram(FrameHistogram *histogram) {
+  memset(histogram, 0, sizeof(FrameHistogram));
+}
+
+// Record the time since the last call as one frame
+void RecordFrame(FrameHistogram *histogram) {
+  double now = FrameClock();
+  if (histogram->last != 0) {
+    double ms = (now - histogram->last) * 1000;
+    uint32_t bucket = ms / FRAME_BUCKET_MS;
+    histogram->buckets[bucket < FRAME_BUCKETS ? bucket : FRAME_BUCKETS - 1]++;
+    histogram->frames++;
+    histogram->total += ms;
+    if (ms > histogram->worst) {
+      histogram->worst = ms;
+    }
+  }
+  histogram->last = now;
+}
+
+// Upper edge in ms of the bucket holding the given fraction of frames
+double FramePercentile(FrameHistogram *histogram, double fraction) {
+  uint64_t target = histogram->frames * fraction;
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < FRAME_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen > target) {
+      return (i + 1) * FRAME_BUCKET_MS;
+    }
+  }
+  return histogram->worst;
+}
+
+void PrintFrameHistogram(FrameHistogram *histogram) {
+  if (histogram->frames == 0) {
+    printf("No frames recorded\n");
+    return;
+  }
+  uint64_t tallest = 0;
+  for (uint32_t i = 0; i < FRAME_BUCKETS; i++) {
+    if (histogram->buckets[i] > tallest) {
+      tallest = histogram->buckets[i];
+    }
+  }
+  for (uint32_t i = 0; i < FRAME_BUCKETS; i++) {
+    if (histogram->buckets[i] == 0) {
+      continue;
+    }
+    char bar[41];
+    uint32_t length = histogram->buckets[i] * 40 / tallest;
+    memset(bar, '#', length);
+    bar[length] = 0;
+    printf("%5.1f%s ms %8" PRIu64 " %s\n", i * FRAME_BUCKET_MS,
+           i == FRAME_BUCKETS - 1 ? "+" : " ", histogram->buckets[i], bar);
+  }
+  double mean = histogram->total / histogram->frames;
+  printf("%" PRIu64 " frames, mean %.2f ms (%.1f fps), p50 %.1f ms, p99 "
+         "%.1f ms, worst %.2f ms\n",
+         histogram->frames, mean, 1000 / mean,
+         FramePercentile(histogram, 0.5), FramePercentile(histogram, 0.99),
+         histogram->worst);
+}
+#endif
@@ -0,0 +1,236 @@
+#ifndef OPENDOM_INSTANCES
+#define OPENDOM_INSTANCES
+#include <cglm/cglm.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The instances of a def, kept as a structure of arrays so a simulation tick
+// moving every ship only streams through positions, and culling and
+// selection only through what a bounding sphere needs. Instances are packed
+// to the front of the arrays in the order they sit in the def's range of the
+// instance buffer, so removing one moves the last into its place. Handles
+// stay good across that by going through a slot that follows its instance
+// around. A slot's generation goes up whenever its instance is removed, so
+// a stale handle is caught rather than reaching whatever took the slot over.
+//
+// A zeroed InstanceStore is an empty one.
+
+#define INSTANCE_NONE UINT32_MAX
+// Smallest number of instances a store grows to
+#define MIN_STORE_INSTANCES 64
+
+typedef struct InstanceHandle {
+  uint32_t slot;
+  uint32_t generation;
+} InstanceHandle;
+
+typedef struct InstanceStore {
+  // count long with room for capacity. The w of positions and scales is
+  // unused, they're vec4 to keep every element 16 byte aligned
+  vec4 *positions;
+  versor *orientations;
+  vec4 *scales;
+  // Unique across every def, what picking and selection go by
+  uint32_t *ids;
+  // Left to the game, they don't go to the GPU
+  uint32_t *flags;
+  // The slot each instance's handle goes through
+  uint32_t *slots;
+  uint32_t count;
+  uint32_t capacity;
+  // Per slot, the index of its instance while it has one. Free slots hold
+  // the next free slot plus one instead, freeSlot is the first plus one and
+  // 0 once there aren't any
+  uint32_t *slotIndices;
+  uint32_t *generations;
+  uint32_t slotCount;
+  uint32_t slotCapacity;
+  uint32_t freeSlot;
+  // A bit per instance changed since the GPU was last given a copy, all of
+  // them between dirtyFirst and dirtyEnd so a clean store costs nothing to
+  // check
+  uint64_t *dirty;
+  uint32_t dirtyFirst;
+  uint32_t dirtyEnd;
+} InstanceStore;
+
+/**
+ * Make room for at least capacity instances in store without growing again.
+ */
+void ReserveInstances(InstanceStore *store, uint32_t capacity) {
+  if (capacity <= store->capacity) {
+    return;
+  }
+  uint32_t words = (store->capacity + 63) / 64;
+  uint32_t newWords = (capacity + 63) / 64;
+  store->positions = realloc(store->positions, sizeof(vec4) * capacity);
+  store->orientations =
+      realloc(store->orientations, sizeof(versor) * capacity);
+  store->scales = realloc(store->scales, sizeof(vec4) * capacity);
+  store->ids = realloc(store->ids, sizeof(uint32_t) * capacity);
+  store->flags = realloc(store->flags, sizeof(uint32_t) * capacity);
+  store->slots = realloc(store->slots, sizeof(uint32_t) * capacity);
+  store->dirty = realloc(store->dirty, sizeof(uint64_t) * newWords);
+  memset(store->dirty + words, 0, sizeof(uint64_t) * (newWords - words));
+  store->capacity = capacity;
+}
+
+void FreeInstanceStore(InstanceStore *store) {
+  free(store->positions);
+  free(store->orientations);
+  free(store->scales);
+  free(store->ids);
+  free(store->flags);
+  free(store->slots);
+  free(store->slotIndices);
+  free(store->generations);
+  free(store->dirty);
+  *store = (InstanceStore){0};
+}
+
+// Flag count instances from first on as needing to go to the GPU
+void MarkInstancesDirty(InstanceStore *store, uint32_t first, uint32_t count) {
+  if (count == 0) {
+    return;
+  }
+  uint32_t end = first + count;
+  for (uint32_t i = first; i < end;) {
+    uint32_t bit = i % 64;
+    uint32_t bits = end - i < 64 - bit ? end - i : 64 - bit;
+    uint64_t mask = bits == 64 ? ~0ull : (1ull << bits) - 1;
+    store->dirty[i / 64] |= mask << bit;
+    i += bits;
+  }
+  if (store->dirtyFirst >= store->dirtyEnd) {
+    store->dirtyFirst = first;
+    store->dirtyEnd = end;
+  } else {
+    store->dirtyFirst = first < store->dirtyFirst ? first : store->dirtyFirst;
+    store->dirtyEnd = end > store->dirtyEnd ? end : store->dirtyEnd;
+  }
+}
+
+/**
+ * Add an instance with the given id to store and return the handle to reach
+ * it by. It goes on the end, so its index is the store's count beforehand.
+ */
+InstanceHandle AddInstance(InstanceStore *store, vec3 position,
+                           versor orientation, vec3 scale, uint32_t id) {
+  if (store->count == store->capacity) {
+    ReserveInstances(store, store->capacity ? store->capacity * 2
+                                            : MIN_STORE_INSTANCES);
+  }
+  uint32_t slot;
+  if (store->freeSlot) {
+    slot = store->freeSlot - 1;
+    store->freeSlot = store->slotIndices[slot];
+  } else {
+    if (store->slotCount == store->slotCapacity) {
+      store->slotCapacity = store->slotCapacity ? store->slotCapacity * 2
+                                                : MIN_STORE_INSTANCES;
+      store->slotIndices = realloc(store->slotIndices,
+                                   sizeof(uint32_t) * store->slotCapacity);
+      store->generations = realloc(store->generations,
+                                   sizeof(uint32_t) * store->slotCapacity);
+    }
+    slot = store->slotCount++;
+    store->generations[slot] = 0;
+  }
+  uint32_t index = store->count++;
+  store->slotIndices[slot] = index;
+  store->slots[index] = slot;
+  glm_vec4(position, 1, store->positions[index]);
+  glm_quat_copy(orientation, store->orientations[index]);
+  glm_vec4(scale, 0, store->scales[index]);
+  store->ids[index] = id;
+  store->flags[index] = 0;
+  MarkInstancesDirty(store, index, 1);
+  return (InstanceHandle){.slot = slot, .generation = store->generations[slot]};
+}
+
+// Where handle's instance is in the arrays of store, INSTANCE_NONE if it has
+// been removed
+uint32_t InstanceIndex(InstanceStore *store, InstanceHandle handle) {
+  if (handle.slot >= store->slotCount ||
+      store->generations[handle.slot] != handle.generation) {
+    return INSTANCE_NONE;
+  }
+  return store->slotIndices[handle.slot];
+}
+
+/**
+ * Remove handle's instance from store, moving the last instance into its
+ * place. Returns false if it had already been removed.
+ */
+bool RemoveInstance(InstanceStore *store, InstanceHandle handle) {
+  uint32_t index = InstanceIndex(store, handle);
+  if (index == INSTANCE_NONE) {
+    return false;
+  }
+  uint32_t last = --store->count;
+  if (index != last) {
+    glm_vec4_copy(store->positions[last], store->positions[index]);
+    glm_quat_copy(store->orientations[last], store->orientations[index]);
+    glm_vec4_copy(store->scales[last], store->scales[index]);
+    store->ids[index] = store->ids[last];
+    store->flags[index] = store->flags[last];
+    store->slots[index] = store->slots[last];
+    store->slotIndices[store->slots[index]] = index;
+    MarkInstancesDirty(store, index, 1);
+  }
+  // Past the end now, there's nothing left there to upload
+  store->dirty[last / 64] &= ~(1ull << (last % 64));
+  store->generations[handle.slot]++;
+  store->slotIndices[handle.slot] = store->freeSlot;
+  store->freeSlot = handle.slot + 1;
+  return true;
+}
+
+/**
+ * Take the next range of dirty instances out of store, first and count
+ * long, clearing them as it goes. Dirty instances no more than gap clean
+ * ones apart come out as one range, the clean ones between included.
+ * Returns false once there are none left.
+ */
+bool NextDirtyRange(InstanceStore *store, uint32_t gap, uint32_t *first,
+                    uint32_t *count) {
+  uint32_t end = store->dirtyEnd < store->count ? store->dirtyEnd
+                                                : store->count;
+  int64_t start = -1;
+  uint32_t rangeEnd = 0;
+  uint32_t i = store->dirtyFirst;
+  while (i < end) {
+    uint64_t word = store->dirty[i / 64] >> (i % 64);
+    if (word == 0) {
+      i = (i / 64 + 1) * 64;
+      continue;
+    }
+    i += __builtin_ctzll(word);
+    if (i >= end || (start != -1 && i - rangeEnd > gap)) {
+      break;
+    }
+    // The run of dirty bits from i on, within the word
+    word = store->dirty[i / 64] >> (i % 64);
+    uint32_t run = ~word ? __builtin_ctzll(~word) : 64;
+    run = run < end - i ? run : end - i;
+    uint64_t mask = run == 64 ? ~0ull : (1ull << run) - 1;
+    store->dirty[i / 64] &= ~(mask << (i % 64));
+    if (start == -1) {
+      start = i;
+    }
+    i += run;
+    rangeEnd = i;
+  }
+  if (start == -1) {
+    store->dirtyFirst = store->dirtyEnd = 0;
+    return false;
+  }
+  store->dirtyFirst = i;
+  *first = start;
+  *count = rangeEnd - start;
+  return true;
+}
+
+#endif
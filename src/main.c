@@ -1,28 +1,86 @@
+#include <ctype.h>
+#include <errno.h>
 #include "model.h"
 #include "window.c"
+#include "assetloader.h"
+
+// Frames drawn headless when --frames isn't given
+#define HEADLESS_FRAMES 100
+
+// main [--headless] [--frames n] [--dump directory]
+//
+// Headless draws n frames offscreen and exits, writing each into directory
+// if there is one
 int main(int argc, char **argv) {
-  glfwInit();
-  GraphicsState graphics = InitGraphics();
-  Model model = loadFromFile("./data/SpaceShipDetailed.obj");
-  uint32_t shipDef = CreateEntityDef(&graphics, &model);
+  bool headless = false;
+  uint32_t frames = HEADLESS_FRAMES;
+  char *dumpDirectory = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--headless") == 0) {
+      headless = true;
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      char *count = argv[++i];
+      char *end;
+      errno = 0;
+      unsigned long parsed = strtoul(count, &end, 10);
+      // strtoul would take leading space and a minus sign
+      if (!isdigit((unsigned char)count[0]) || *end != '\0' || errno ||
+          parsed == 0 || parsed > UINT32_MAX) {
+        fprintf(stderr, "--frames needs a count of at least 1, not %s\n",
+                count);
+        return 1;
+      }
+      frames = parsed;
+    } else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+      dumpDirectory = argv[++i];
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--headless] [--frames n] [--dump directory]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  GraphicsState graphics = InitGraphics(headless);
+  if (dumpDirectory && SetFrameDump(&graphics, dumpDirectory)) {
+    return 1;
+  }
+  char *modelPaths[] = {"./data/SpaceShipDetailed.obj"};
+  Model models[1];
+  LoadModels(modelPaths, 1, 0, loadFromFile, models);
+  uint32_t shipDef;
+  uint32_t failed = CreateEntityDefs(&graphics, models, 1, &shipDef);
+  FreeModel(&models[0]);
+  if (failed) {
+    return 1;
+  }
+  PrintGpuAllocatorStats(&graphics.allocator);
   vec3 pos = {0, 0, 0};
   for (uint32_t i = 0; i < 4; i++) {
     pos[0]+= 5;
 		pos[2] = 0;
     for (uint32_t k = 0; k < 4; k++) {
       pos[2]+= 5;
-      Instance inst = {.scale = {0.01, 0.01, 0.01}};
-			memcpy(&inst.position, &pos, sizeof(vec3));
-      glm_mat4_identity(inst.rotation);
-      AddEntityInstance(&graphics.entities[shipDef], inst);
+      AddEntityInstance(&graphics.entities[shipDef], pos,
+                        (versor)GLM_QUAT_IDENTITY_INIT,
+                        (vec3){0.01, 0.01, 0.01});
     }
   }
 
+  if (headless) {
+    for (uint32_t f = 0; f < frames; f++) {
+      DrawGraphics(&graphics);
+    }
+    // Writes out the frames still in flight
+    SetFrameDump(&graphics, NULL);
+    PrintFrameHistogram(&graphics.frameTimes);
+    return 0;
+  }
   while (true) {
     if (glfwWindowShouldClose(graphics.window)) {
+      PrintFrameHistogram(&graphics.frameTimes);
       return 0;
     }
-    glfwPollEvents();
+    PollWindowEvents(&graphics);
     MoveCamera(&graphics);
     DrawGraphics(&graphics);
   }
@@ -4,75 +4,472 @@
 #include <assimp/postprocess.h>
 #include <assimp/scene.h>
 #include <cglm/cglm.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <vulkan/vulkan.h>
+#include "./allocator.h"
+#include "./instances.h"
+#include "./simplify.h"
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 typedef struct Vertex {
   vec4 position;
   vec4 color;
   vec4 normal;
 } Vertex;
 
+// Build with -DPACK_VERTICES=0 to send full precision vertices instead, to
+// rule quantization out when something looks wrong
+#ifndef PACK_VERTICES
+#define PACK_VERTICES 1
+#endif
+
+#if PACK_VERTICES
+// What actually goes to the GPU, 12 bytes instead of the 48 of a Vertex.
+// Positions are snorm16 across the model's bounds and get expanded back with
+// the model's positionScale/positionBias, normals are octahedral encoded
+// into two snorm16s
+typedef struct GpuVertex {
+  int16_t position[3];
+  // RGB565, white unless the mesh came with vertex colors
+  uint16_t color;
+  int16_t normal[2];
+} GpuVertex;
+// Three component 16 bit formats aren't guaranteed vertex formats, the
+// position is read along with the color and w ignored
+#define GPU_VERTEX_POSITION_FORMAT VK_FORMAT_R16G16B16A16_SNORM
+#define GPU_VERTEX_NORMAL_FORMAT VK_FORMAT_R16G16_SNORM
+#else
+// The same as floats, 24 bytes. Positions are still relative to the model's
+// bounds and normals octahedral, so the vertex shader reads either layout
+typedef struct GpuVertex {
+  float position[3];
+  float normal[2];
+  uint16_t color;
+  uint16_t padding;
+} GpuVertex;
+#define GPU_VERTEX_POSITION_FORMAT VK_FORMAT_R32G32B32_SFLOAT
+#define GPU_VERTEX_NORMAL_FORMAT VK_FORMAT_R32G32_SFLOAT
+#endif
+
+// Most a position may move going through a GpuVertex, as a fraction of the
+// model's positionScale (half a snorm16 step), and most a unit normal may
+#define VERTEX_POSITION_TOLERANCE (0.5f / 32767.f + 1e-6f)
+#define VERTEX_NORMAL_TOLERANCE 1e-4f
+
+// Model space bounding volumes, worked out once at import
+typedef struct Bounds {
+  // Axis aligned box, w is unused
+  vec4 min;
+  vec4 max;
+  // xyz centre (the box's), w radius
+  vec4 sphere;
+} Bounds;
+
+// Part of a model that came out of its own mesh in the source asset
+typedef struct Submesh {
+  uint32_t firstIndex;
+  uint32_t indexCount;
+  Bounds bounds;
+} Submesh;
+
+// Levels of detail per model, the full mesh included. Each level aims for
+// LOD_REDUCTION of the triangles of the one before, a level that doesn't get
+// under LOD_MIN_REDUCTION of them isn't worth keeping and ends the chain
+#define MODEL_MAX_LODS 4
+#define LOD_REDUCTION 0.5f
+#define LOD_MIN_REDUCTION 0.8f
+// Not worth simplifying below this many triangles
+#define LOD_MIN_TRIANGLES 64
+
+typedef struct ModelLod {
+  // Into the model's indices, which hold every level back to back
+  uint32_t firstIndex;
+  uint32_t indexCount;
+  // How far the level can stray from the full mesh, in model space
+  float error;
+} ModelLod;
+
 typedef struct Model {
-  Vertex *vertices;
+  // Either heap allocated or pointing into cacheMapping when the model came
+  // out of the model cache
+  GpuVertex *vertices;
   uint32_t vertexCount;
+  // position = snorm position * positionScale + positionBias
+  vec4 positionScale;
+  vec4 positionBias;
+  // Either uint16_t or uint32_t depending on indexType, models with few
+  // enough vertices get the smaller index type. Every level of detail, see
+  // lods for where each is
+  void *indices;
+  uint32_t indexCount;
+  VkIndexType indexType;
   char *materialPath;
-  VkBuffer vertexBuffer;
-  VkDeviceMemory vertexMemory;
+  Bounds bounds;
+  // Ranges of the full detail level. CPU side only, they get baked into the
+  // model cache but never uploaded, and are freed with FreeModel
+  Submesh *submeshes;
+  uint32_t submeshCount;
+  ModelLod lods[MODEL_MAX_LODS];
+  uint32_t lodCount;
+  // Where the model starts in the shared vertex and index arenas once it
+  // has been uploaded, in vertices and indices
+  uint32_t firstVertex;
+  uint32_t firstIndex;
+  void *cacheMapping;
+  size_t cacheMappingSize;
 } Model;
 
+// An instance as the shaders read it (Instance in shaders/cull.comp and the
+// instance attributes of shaders/vertex.vert), packed out of the def's
+// InstanceStore on the way to the GPU. 36 bytes rather than the 112 of a
+// mat4 rotation with a position and scale, and only scalars so std430 lays
+// it out the same without padding
 typedef struct Instance {
-  mat4 rotation;
-  vec4 position;
-	vec4 scale;
-	uint32_t instanceId;
-	bool selected;
+  float position[3];
+  uint32_t instanceId;
+  float scale[3];
+  // Unit quaternion xyzw as snorm16s
+  int16_t orientation[4];
 } Instance;
+_Static_assert(sizeof(Instance) == 36,
+               "Instance has to match shaders/cull.comp");
 
 typedef struct EntityDef {
   Model model;
   bool safeToUpdate;
-  Instance *instances;
-  VkBuffer instanceBuffer;
-  uint32_t maxInstances;
-  VkDeviceMemory instanceMemory;
-  uint32_t instanceCount;
-  bool *dirtyBuffer;
+  InstanceStore instances;
+  // The def's range of the shared instance buffer, gpuInstances long and
+  // grown independently of the store
+  uint32_t firstInstance;
+  uint32_t gpuInstances;
 } EntityDef;
 
-Model loadFromFile(char *path) {
-  Model model = {.vertexCount = 0, .vertices = 0};
-  const struct aiScene *scene =
-      aiImportFile(path, aiProcess_CalcTangentSpace | aiProcess_Triangulate |
-                             aiProcess_JoinIdenticalVertices |
-                             aiProcess_PreTransformVertices |
-                             aiProcess_SortByPType | aiProcess_OptimizeGraph);
+uint32_t IndexSize(VkIndexType indexType) {
+  return indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t)
+                                           : sizeof(uint32_t);
+}
+
+int16_t PackSnorm16(float value) {
+  value = value < -1 ? -1 : value > 1 ? 1 : value;
+  return (int16_t)roundf(value * 32767.f);
+}
+
+float UnpackSnorm16(int16_t value) {
+  float unpacked = value / 32767.f;
+  return unpacked < -1 ? -1 : unpacked;
+}
+
+void PackOrientation(versor orientation, int16_t out[4]) {
+  for (uint32_t i = 0; i < 4; i++) {
+    out[i] = PackSnorm16(orientation[i]);
+  }
+}
+
+void UnpackOrientation(int16_t in[4], versor orientation) {
+  for (uint32_t i = 0; i < 4; i++) {
+    orientation[i] = UnpackSnorm16(in[i]);
+  }
+}
+
+// Octahedral encoding of normal, both components in [-1, 1]
+void OctEncode(vec3 normal, vec2 out) {
+  float length = fabsf(normal[0]) + fabsf(normal[1]) + fabsf(normal[2]);
+  if (length == 0) {
+    out[0] = out[1] = 0;
+    return;
+  }
+  float x = normal[0] / length;
+  float y = normal[1] / length;
+  // Fold the lower hemisphere over the diagonals
+  if (normal[2] < 0) {
+    float foldedX = (1 - fabsf(y)) * (x >= 0 ? 1 : -1);
+    float foldedY = (1 - fabsf(x)) * (y >= 0 ? 1 : -1);
+    x = foldedX;
+    y = foldedY;
+  }
+  out[0] = x;
+  out[1] = y;
+}
+
+void OctDecode(const vec2 in, vec3 normal) {
+  normal[0] = in[0];
+  normal[1] = in[1];
+  normal[2] = 1 - fabsf(normal[0]) - fabsf(normal[1]);
+  float t = normal[2] < 0 ? -normal[2] : 0;
+  normal[0] += normal[0] >= 0 ? -t : t;
+  normal[1] += normal[1] >= 0 ? -t : t;
+  glm_vec3_normalize(normal);
+}
+
+uint16_t PackColor565(vec4 color) {
+  uint16_t r = (uint16_t)roundf(glm_clamp(color[0], 0, 1) * 31);
+  uint16_t g = (uint16_t)roundf(glm_clamp(color[1], 0, 1) * 63);
+  uint16_t b = (uint16_t)roundf(glm_clamp(color[2], 0, 1) * 31);
+  return (r << 11) | (g << 5) | b;
+}
+
+/**
+ * Work out the bounds of count vertices. The box is a min/max reduction over
+ * the positions, the sphere is centred on the box and reaches the furthest
+ * vertex from there, four vertices at a time with SSE.
+ */
+void ComputeBounds(Vertex *vertices, uint32_t count, Bounds *bounds) {
+  if (count == 0) {
+    memset(bounds, 0, sizeof(Bounds));
+    return;
+  }
+#ifdef __SSE__
+  __m128 min = _mm_set1_ps(INFINITY);
+  __m128 max = _mm_set1_ps(-INFINITY);
+  for (uint32_t i = 0; i < count; i++) {
+    __m128 position = _mm_loadu_ps(vertices[i].position);
+    min = _mm_min_ps(min, position);
+    max = _mm_max_ps(max, position);
+  }
+  __m128 center = _mm_mul_ps(_mm_add_ps(min, max), _mm_set1_ps(0.5f));
+  _mm_storeu_ps(bounds->min, min);
+  _mm_storeu_ps(bounds->max, max);
+  _mm_storeu_ps(bounds->sphere, center);
+  __m128 centerX = _mm_set1_ps(bounds->sphere[0]);
+  __m128 centerY = _mm_set1_ps(bounds->sphere[1]);
+  __m128 centerZ = _mm_set1_ps(bounds->sphere[2]);
+  __m128 furthest = _mm_setzero_ps();
+  uint32_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    // Rows of positions into columns of x, y, z and w
+    __m128 x = _mm_loadu_ps(vertices[i].position);
+    __m128 y = _mm_loadu_ps(vertices[i + 1].position);
+    __m128 z = _mm_loadu_ps(vertices[i + 2].position);
+    __m128 w = _mm_loadu_ps(vertices[i + 3].position);
+    _MM_TRANSPOSE4_PS(x, y, z, w);
+    x = _mm_sub_ps(x, centerX);
+    y = _mm_sub_ps(y, centerY);
+    z = _mm_sub_ps(z, centerZ);
+    __m128 distance = _mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y));
+    distance = _mm_add_ps(distance, _mm_mul_ps(z, z));
+    furthest = _mm_max_ps(furthest, distance);
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, furthest);
+  float radius =
+      glm_max(glm_max(lanes[0], lanes[1]), glm_max(lanes[2], lanes[3]));
+#else
+  glm_vec4_copy(vertices[0].position, bounds->min);
+  glm_vec4_copy(vertices[0].position, bounds->max);
+  for (uint32_t i = 1; i < count; i++) {
+    glm_vec4_minv(bounds->min, vertices[i].position, bounds->min);
+    glm_vec4_maxv(bounds->max, vertices[i].position, bounds->max);
+  }
+  glm_vec4_add(bounds->min, bounds->max, bounds->sphere);
+  glm_vec4_scale(bounds->sphere, 0.5f, bounds->sphere);
+  float radius = 0;
+  uint32_t i = 0;
+#endif
+  for (; i < count; i++) {
+    radius = glm_max(radius, glm_vec3_distance2(vertices[i].position,
+                                                bounds->sphere));
+  }
+  bounds->min[3] = bounds->max[3] = 0;
+  bounds->sphere[3] = sqrtf(radius);
+}
+
+// Turn imported vertices into model->vertices, picking the model's
+// scale/bias so the snorm range covers its bounds exactly
+void PackVertices(Model *model, Vertex *vertices) {
+  ComputeBounds(vertices, model->vertexCount, &model->bounds);
+  float *min = model->bounds.min;
+  float *max = model->bounds.max;
+  for (uint32_t k = 0; k < 3; k++) {
+    model->positionBias[k] = (min[k] + max[k]) / 2;
+    model->positionScale[k] = (max[k] - min[k]) / 2;
+    // Flat along this axis, anything non zero will do
+    if (model->positionScale[k] == 0) {
+      model->positionScale[k] = 1;
+    }
+  }
+  model->positionScale[3] = 1;
+  model->positionBias[3] = 0;
+
+  model->vertices = calloc(model->vertexCount, sizeof(GpuVertex));
+  for (uint32_t i = 0; i < model->vertexCount; i++) {
+    GpuVertex *packed = &model->vertices[i];
+    vec2 normal;
+    OctEncode(vertices[i].normal, normal);
+    for (uint32_t k = 0; k < 3; k++) {
+      float position = (vertices[i].position[k] - model->positionBias[k]) /
+                       model->positionScale[k];
+#if PACK_VERTICES
+      packed->position[k] = PackSnorm16(position);
+#else
+      packed->position[k] = position;
+#endif
+    }
+    for (uint32_t k = 0; k < 2; k++) {
+#if PACK_VERTICES
+      packed->normal[k] = PackSnorm16(normal[k]);
+#else
+      packed->normal[k] = normal[k];
+#endif
+    }
+    packed->color = PackColor565(vertices[i].color);
+  }
+}
+
+// What the vertex shader makes of vertex of model, in model space
+void UnpackVertex(Model *model, GpuVertex *vertex, vec3 position,
+                  vec3 normal) {
+  vec2 encoded;
+  for (uint32_t k = 0; k < 3; k++) {
+#if PACK_VERTICES
+    float unpacked = UnpackSnorm16(vertex->position[k]);
+#else
+    float unpacked = vertex->position[k];
+#endif
+    position[k] = unpacked * model->positionScale[k] + model->positionBias[k];
+  }
+  for (uint32_t k = 0; k < 2; k++) {
+#if PACK_VERTICES
+    encoded[k] = UnpackSnorm16(vertex->normal[k]);
+#else
+    encoded[k] = vertex->normal[k];
+#endif
+  }
+  OctDecode(encoded, normal);
+}
+
+/**
+ * Fill in model's levels of detail from the full detail indices (indexCount
+ * of them, 32 bit) over vertices, simplifying each level from the one before.
+ * Stores every level back to back in model->indices as model->indexType.
+ */
+void BuildLods(Model *model, Vertex *vertices, uint32_t *indices) {
+  uint32_t fullCount = model->indexCount;
+  uint32_t *levels[MODEL_MAX_LODS] = {indices};
+  model->lods[0] = (ModelLod){.firstIndex = 0, .indexCount = fullCount};
+  model->lodCount = 1;
+  vec4 *positions = malloc(sizeof(vec4) * model->vertexCount);
+  for (uint32_t i = 0; i < model->vertexCount; i++) {
+    glm_vec4_copy(vertices[i].position, positions[i]);
+  }
+  Simplifier simplifier;
+  InitSimplifier(&simplifier, positions, model->vertexCount, indices,
+                 fullCount);
+  uint32_t total = fullCount;
+  while (model->lodCount < MODEL_MAX_LODS) {
+    uint32_t previous = model->lods[model->lodCount - 1].indexCount;
+    if (previous / 3 < LOD_MIN_TRIANGLES) {
+      break;
+    }
+    uint32_t target = (uint32_t)(previous / 3 * LOD_REDUCTION) * 3;
+    uint32_t count = SimplifyTo(&simplifier, target);
+    if (count > previous * LOD_MIN_REDUCTION) {
+      break;
+    }
+    levels[model->lodCount] = malloc(sizeof(uint32_t) * count);
+    memcpy(levels[model->lodCount], simplifier.indices,
+           sizeof(uint32_t) * count);
+    model->lods[model->lodCount++] = (ModelLod){
+        .firstIndex = total, .indexCount = count, .error = simplifier.error};
+    total += count;
+  }
+  FreeSimplifier(&simplifier);
+  free(positions);
+
+  model->indexCount = total;
+  model->indices = calloc(total, IndexSize(model->indexType));
+  for (uint32_t l = 0; l < model->lodCount; l++) {
+    ModelLod *lod = &model->lods[l];
+    for (uint32_t i = 0; i < lod->indexCount; i++) {
+      if (model->indexType == VK_INDEX_TYPE_UINT16) {
+        ((uint16_t *)model->indices)[lod->firstIndex + i] = levels[l][i];
+      } else {
+        ((uint32_t *)model->indices)[lod->firstIndex + i] = levels[l][i];
+      }
+    }
+    if (l > 0) {
+      free(levels[l]);
+    }
+  }
+}
+
+// Changing these changes what ends up in a model, so they're part of the
+// model cache key
+#define MODEL_IMPORT_FLAGS                                                     \
+  (aiProcess_CalcTangentSpace | aiProcess_Triangulate |                        \
+   aiProcess_JoinIdenticalVertices | aiProcess_PreTransformVertices |          \
+   aiProcess_SortByPType | aiProcess_OptimizeGraph)
+
+// Parse a model with assimp, see loadFromFile in modelcache.h for the cached
+// path everything else should use
+Model importFromFile(char *path) {
+  Model model = {.vertexCount = 0, .vertices = 0, .indexCount = 0};
+  const struct aiScene *scene = aiImportFile(path, MODEL_IMPORT_FLAGS);
+  if (!scene) {
+    fprintf(stderr, "Failed to import %s: %s\n", path, aiGetErrorString());
+    return model;
+  }
   uint32_t t;
+  model.submeshes = calloc(scene->mNumMeshes, sizeof(Submesh));
   for (t = 0; t < scene->mNumMeshes; t++) {
-    model.vertexCount += scene->mMeshes[t]->mNumFaces * 3;
+    struct aiMesh *mesh = scene->mMeshes[t];
+    model.vertexCount += mesh->mNumVertices;
+    // Point and line primitives are sorted into their own meshes, we only
+    // draw triangles
+    for (uint32_t i = 0; i < mesh->mNumFaces; i++) {
+      if (mesh->mFaces[i].mNumIndices == 3) {
+        model.indexCount += 3;
+      }
+    }
   }
-  model.vertices = calloc(model.vertexCount, sizeof(Vertex));
-	printf("%d vertices\n", model.vertexCount);
-  Vertex *vertices = model.vertices;
+  model.indexType = model.vertexCount <= UINT16_MAX + 1 ? VK_INDEX_TYPE_UINT16
+                                                        : VK_INDEX_TYPE_UINT32;
+  Vertex *vertices = calloc(model.vertexCount, sizeof(Vertex));
+  uint32_t *indices = calloc(model.indexCount, sizeof(uint32_t));
+  uint32_t baseVertex = 0;
+  uint32_t indexCursor = 0;
   for (t = 0; t < scene->mNumMeshes; t++) {
     struct aiMesh *mesh = scene->mMeshes[t];
+    uint32_t firstIndex = indexCursor;
     uint32_t i = 0;
+    for (i = 0; i < mesh->mNumVertices; i++) {
+      struct aiVector3D normal =
+          mesh->mNormals ? mesh->mNormals[i] : (struct aiVector3D){0, 0, 1};
+      struct aiColor4D color = mesh->mColors[0] ? mesh->mColors[0][i]
+                                                : (struct aiColor4D){1, 1, 1, 1};
+      vertices[baseVertex + i] = (Vertex){
+          .color = {color.r, color.g, color.b, color.a},
+          .position = {mesh->mVertices[i].x, mesh->mVertices[i].y,
+                       mesh->mVertices[i].z, 1},
+          .normal = {normal.x, normal.y, normal.z, 1}};
+    }
     for (i = 0; i < mesh->mNumFaces; i++) {
       struct aiFace face = mesh->mFaces[i];
-      uint32_t k = 0;
-      for (k = 0; k < face.mNumIndices; k++) {
-        uint32_t index = face.mIndices[k];
-        vertices[i * 3 + k] = (Vertex){
-            .color = {1, 1, 1, 1},
-            .position = {mesh->mVertices[index].x, mesh->mVertices[index].y,
-                         mesh->mVertices[index].z, 1},
-            .normal = {mesh->mNormals[index].x, mesh->mNormals[index].y,
-                       mesh->mNormals[index].z, 1}};
+      if (face.mNumIndices != 3) {
+        continue;
       }
+      for (uint32_t k = 0; k < 3; k++) {
+        indices[indexCursor++] = baseVertex + face.mIndices[k];
+      }
+    }
+    // Only meshes with triangles in them get drawn
+    if (indexCursor > firstIndex) {
+      Submesh *submesh = &model.submeshes[model.submeshCount++];
+      submesh->firstIndex = firstIndex;
+      submesh->indexCount = indexCursor - firstIndex;
+      ComputeBounds(&vertices[baseVertex], mesh->mNumVertices,
+                    &submesh->bounds);
     }
-		printf("Next!\n");
-    vertices = &vertices[mesh->mNumFaces * 3];
+    baseVertex += mesh->mNumVertices;
   }
-  printf("Generated\n");
   aiReleaseImport(scene);
+  BuildLods(&model, vertices, indices);
+  free(indices);
+  PackVertices(&model, vertices);
+  free(vertices);
   return model;
 }
 
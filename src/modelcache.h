@@ -0,0 +1,278 @@
+#ifndef OPENDOM_MODELCACHE
+#define OPENDOM_MODELCACHE
+#include "./model.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Models get baked into a binary file next to the source asset
+// (<path>.odm) holding the vertex and index data exactly as they get
+// uploaded, so loading is an mmap and the upload is a straight memcpy out
+// of the mapping.
+//
+// Bump the version whenever the layout of the file or of GpuVertex
+// changes, or the LOD_ settings in model.h do. The cache is rebuilt whenever
+// the version, the import flags or the source file contents don't match.
+#define MODEL_CACHE_MAGIC 0x4d444f2e // ".ODM"
+#define MODEL_CACHE_VERSION 4
+#define MODEL_CACHE_EXTENSION ".odm"
+// Blobs start on this boundary so they can be copied with aligned loads
+#define MODEL_CACHE_ALIGNMENT 64
+
+typedef struct ModelCacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t sourceHash;
+  uint32_t importFlags;
+  // sizeof(GpuVertex), which depends on PACK_VERTICES
+  uint32_t vertexStride;
+  uint32_t vertexCount;
+  uint32_t indexCount;
+  uint32_t indexType;
+  vec4 positionScale;
+  vec4 positionBias;
+  Bounds bounds;
+  uint32_t submeshCount;
+  uint32_t lodCount;
+  ModelLod lods[MODEL_MAX_LODS];
+  // From the start of the file
+  uint64_t vertexOffset;
+  uint64_t indexOffset;
+  uint64_t submeshOffset;
+} ModelCacheHeader;
+
+// FNV-1a, the cache only needs to notice the asset changed
+uint64_t HashBytes(const void *data, size_t length) {
+  const uint8_t *bytes = data;
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Returns 0 if the file could not be read
+uint64_t HashFile(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  uint64_t hash = 0;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      hash = HashBytes(data, st.st_size);
+      munmap(data, st.st_size);
+    }
+  }
+  close(fd);
+  return hash;
+}
+
+char *ModelCachePath(const char *path) {
+  char *cachePath = malloc(strlen(path) + sizeof(MODEL_CACHE_EXTENSION));
+  strcpy(cachePath, path);
+  strcat(cachePath, MODEL_CACHE_EXTENSION);
+  return cachePath;
+}
+
+size_t AlignCacheOffset(size_t offset) {
+  return (offset + MODEL_CACHE_ALIGNMENT - 1) &
+         ~(size_t)(MODEL_CACHE_ALIGNMENT - 1);
+}
+
+/**
+ * Map a baked model for the source asset at path. Fills in model and
+ * returns 0 on success, returns 1 if there's no cache or it is stale.
+ * The vertex and index pointers point into the mapping, release it with
+ * ReleaseModelData. Submeshes are copied out as they outlive the mapping.
+ */
+uint32_t ReadModelCache(char *path, uint64_t sourceHash, Model *model) {
+  char *cachePath = ModelCachePath(path);
+  int fd = open(cachePath, O_RDONLY);
+  free(cachePath);
+  if (fd < 0) {
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ModelCacheHeader)) {
+    close(fd);
+    return 1;
+  }
+  void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return 1;
+  }
+  ModelCacheHeader *header = mapping;
+  size_t vertexSize = (size_t)header->vertexCount * sizeof(GpuVertex);
+  size_t indexSize = (size_t)header->indexCount * IndexSize(header->indexType);
+  size_t submeshSize = (size_t)header->submeshCount * sizeof(Submesh);
+  if (header->magic != MODEL_CACHE_MAGIC ||
+      header->version != MODEL_CACHE_VERSION ||
+      header->sourceHash != sourceHash ||
+      header->importFlags != MODEL_IMPORT_FLAGS ||
+      header->vertexStride != sizeof(GpuVertex) ||
+      header->vertexOffset + vertexSize > (uint64_t)st.st_size ||
+      header->indexOffset + indexSize > (uint64_t)st.st_size ||
+      header->submeshOffset + submeshSize > (uint64_t)st.st_size) {
+    munmap(mapping, st.st_size);
+    return 1;
+  }
+  bool lodsValid = header->lodCount >= 1 && header->lodCount <= MODEL_MAX_LODS;
+  for (uint32_t l = 0; lodsValid && l < header->lodCount; l++) {
+    lodsValid = (uint64_t)header->lods[l].firstIndex +
+                    header->lods[l].indexCount <=
+                header->indexCount;
+  }
+  if (!lodsValid) {
+    munmap(mapping, st.st_size);
+    return 1;
+  }
+  *model = (Model){
+      .vertices = (GpuVertex *)((char *)mapping + header->vertexOffset),
+      .vertexCount = header->vertexCount,
+      .indices = (char *)mapping + header->indexOffset,
+      .indexCount = header->indexCount,
+      .indexType = header->indexType,
+      .bounds = header->bounds,
+      .submeshes = malloc(submeshSize),
+      .submeshCount = header->submeshCount,
+      .lodCount = header->lodCount,
+      .cacheMapping = mapping,
+      .cacheMappingSize = st.st_size};
+  memcpy(model->submeshes, (char *)mapping + header->submeshOffset,
+         submeshSize);
+  memcpy(model->lods, header->lods, sizeof(model->lods));
+  glm_vec4_copy(header->positionScale, model->positionScale);
+  glm_vec4_copy(header->positionBias, model->positionBias);
+  return 0;
+}
+
+/**
+ * Bake model next to the source asset at path. Written to a temporary file
+ * and renamed into place so a half written cache is never picked up.
+ * Returns 0 on success.
+ */
+uint32_t WriteModelCache(char *path, uint64_t sourceHash, Model *model) {
+  ModelCacheHeader header = {
+      .magic = MODEL_CACHE_MAGIC,
+      .version = MODEL_CACHE_VERSION,
+      .sourceHash = sourceHash,
+      .importFlags = MODEL_IMPORT_FLAGS,
+      .vertexStride = sizeof(GpuVertex),
+      .vertexCount = model->vertexCount,
+      .indexCount = model->indexCount,
+      .indexType = model->indexType,
+      .bounds = model->bounds,
+      .submeshCount = model->submeshCount,
+      .lodCount = model->lodCount};
+  memcpy(header.lods, model->lods, sizeof(header.lods));
+  glm_vec4_copy(model->positionScale, header.positionScale);
+  glm_vec4_copy(model->positionBias, header.positionBias);
+  size_t vertexSize = (size_t)model->vertexCount * sizeof(GpuVertex);
+  size_t indexSize = (size_t)model->indexCount * IndexSize(model->indexType);
+  size_t submeshSize = (size_t)model->submeshCount * sizeof(Submesh);
+  header.vertexOffset = AlignCacheOffset(sizeof(ModelCacheHeader));
+  header.indexOffset = AlignCacheOffset(header.vertexOffset + vertexSize);
+  header.submeshOffset = AlignCacheOffset(header.indexOffset + indexSize);
+
+  // Unique temporary name, two loaders may bake the same asset at once
+  char *cachePath = ModelCachePath(path);
+  char *tempPath = malloc(strlen(cachePath) + sizeof(".XXXXXX"));
+  strcpy(tempPath, cachePath);
+  strcat(tempPath, ".XXXXXX");
+  int fd = mkstemp(tempPath);
+  if (fd >= 0) {
+    fchmod(fd, 0644);
+  }
+  FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (!file) {
+    fprintf(stderr, "Unable to write model cache %s\n", cachePath);
+    if (fd >= 0) {
+      close(fd);
+      remove(tempPath);
+    }
+    free(tempPath);
+    free(cachePath);
+    return 1;
+  }
+  static const char padding[MODEL_CACHE_ALIGNMENT];
+  size_t vertexPadding = header.vertexOffset - sizeof(header);
+  size_t indexPadding = header.indexOffset - header.vertexOffset - vertexSize;
+  size_t submeshPadding =
+      header.submeshOffset - header.indexOffset - indexSize;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok && fwrite(padding, 1, vertexPadding, file) == vertexPadding;
+  ok = ok && fwrite(model->vertices, 1, vertexSize, file) == vertexSize;
+  ok = ok && fwrite(padding, 1, indexPadding, file) == indexPadding;
+  ok = ok && fwrite(model->indices, 1, indexSize, file) == indexSize;
+  ok = ok && fwrite(padding, 1, submeshPadding, file) == submeshPadding;
+  ok = ok && fwrite(model->submeshes, 1, submeshSize, file) == submeshSize;
+  ok = fclose(file) == 0 && ok;
+  if (ok) {
+    ok = rename(tempPath, cachePath) == 0;
+  }
+  if (!ok) {
+    fprintf(stderr, "Failed writing model cache %s\n", cachePath);
+    remove(tempPath);
+  }
+  free(tempPath);
+  free(cachePath);
+  return ok ? 0 : 1;
+}
+
+// Free the CPU side vertex and index data once it has been uploaded, the
+// bounds and submeshes are kept
+void ReleaseModelData(Model *model) {
+  if (model->cacheMapping) {
+    munmap(model->cacheMapping, model->cacheMappingSize);
+  } else {
+    free(model->vertices);
+    free(model->indices);
+  }
+  model->cacheMapping = NULL;
+  model->vertices = NULL;
+  model->indices = NULL;
+}
+
+// Free everything the model holds on the CPU, once its EntityDefs have been
+// created nothing reads it anymore
+void FreeModel(Model *model) {
+  ReleaseModelData(model);
+  free(model->submeshes);
+  model->submeshes = NULL;
+  model->submeshCount = 0;
+}
+
+/**
+ * Load a model, out of the model cache when there's an up to date one and
+ * through assimp otherwise, in which case the cache gets (re)baked.
+ */
+Model loadFromFile(char *path) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  Model model;
+  uint64_t sourceHash = HashFile(path);
+  bool cached = sourceHash && ReadModelCache(path, sourceHash, &model) == 0;
+  if (!cached) {
+    model = importFromFile(path);
+    if (sourceHash && model.vertices) {
+      WriteModelCache(path, sourceHash, &model);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("Loaded %s%s in %.2fms\n", path, cached ? " from cache" : "",
+         (end.tv_sec - start.tv_sec) * 1e3 +
+             (end.tv_nsec - start.tv_nsec) / 1e6);
+  return model;
+}
+
+#endif
@@ -0,0 +1,266 @@
+#ifndef OPENDOM_PICKING
+#define OPENDOM_PICKING
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+#include "./allocator.h"
+#include "./sync.h"
+
+// Picking reads instance ids back out of the id attachment every frame
+// renders alongside its colour, each pixel the id of the instance drawn
+// there or PICK_NONE. A request is copied out by the next frame submitted
+// after it, into that frame's readback buffer, and the result is there to
+// be polled for once the GPU has got through the frame. Nothing ever waits
+// on the GPU.
+#define PICK_NONE UINT32_MAX
+// Largest region a single request can read back, 256x256 pixels
+#define PICK_MAX_PIXELS (256 * 256)
+// Finished results kept around for polling, oldest dropped first
+#define PICK_MAX_RESULTS 8
+
+// Where a request is at, see PollPick
+typedef enum PickStatus {
+  // Still waiting for a frame, or for the GPU to get through it
+  PICK_PENDING,
+  // Handed over to the caller
+  PICK_READY,
+  // Never coming. Replaced by a later request before a frame read it back,
+  // pushed out of the results by newer ones, or already polled for
+  PICK_DROPPED,
+} PickStatus;
+
+typedef struct PickResult {
+  uint32_t ticket;
+  // Distinct instance ids under the region in increasing order, owned by
+  // whoever polled for them
+  uint32_t *ids;
+  uint32_t count;
+} PickResult;
+
+// A frame's readback, persistently mapped
+typedef struct PickFrame {
+  VkBuffer buffer;
+  GpuAllocation memory;
+  VkCommandBuffer commandBuffer;
+  // The request the frame is copying out, 0 when there isn't one
+  uint32_t ticket;
+  VkRect2D region;
+  // Timeline value the copy is done at
+  uint64_t value;
+} PickFrame;
+
+typedef struct Picker {
+  Timeline *timeline;
+  GpuAllocator *allocator;
+  PickFrame *frames;
+  uint32_t frameCount;
+  // Waiting for the next frame, 0 when there isn't one
+  uint32_t queuedTicket;
+  VkRect2D queuedRegion;
+  uint32_t nextTicket;
+  PickResult results[PICK_MAX_RESULTS];
+  uint32_t resultCount;
+} Picker;
+
+/**
+ * Set picker up to read back for frameCount frames, submitted to the queue
+ * of timeline. commandPool has to be for that queue's family. Returns 0 on
+ * success.
+ */
+uint32_t InitPicker(Picker *picker, GpuAllocator *allocator,
+                    Timeline *timeline, VkCommandPool commandPool,
+                    uint32_t frameCount) {
+  *picker = (Picker){.timeline = timeline,
+                     .allocator = allocator,
+                     .frames = calloc(frameCount, sizeof(PickFrame)),
+                     .frameCount = frameCount,
+                     .nextTicket = 1};
+  for (uint32_t i = 0; i < frameCount; i++) {
+    PickFrame *frame = &picker->frames[i];
+    if (CreateBuffer(allocator, sizeof(uint32_t) * PICK_MAX_PIXELS,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT, &frame->buffer,
+                     &frame->memory)) {
+      fprintf(stderr, "Failed to create pick readback buffer\n");
+      return 1;
+    }
+    vkAllocateCommandBuffers(
+        timeline->device,
+        &(VkCommandBufferAllocateInfo){
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = commandPool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1},
+        &frame->commandBuffer);
+  }
+  return 0;
+}
+
+/**
+ * Ask for the instances under region of the id attachment, in pixels from
+ * the top left. Only the latest request before a frame is submitted gets
+ * read back, an earlier one still waiting is dropped. Returns the ticket to
+ * poll for the result with, or 0 if region is empty or too large.
+ */
+uint32_t RequestPick(Picker *picker, VkRect2D region) {
+  uint64_t pixels = (uint64_t)region.extent.width * region.extent.height;
+  if (pixels == 0 || pixels > PICK_MAX_PIXELS) {
+    fprintf(stderr, "Can't pick a %dx%d region\n", region.extent.width,
+            region.extent.height);
+    return 0;
+  }
+  picker->queuedTicket = picker->nextTicket++;
+  picker->queuedRegion = region;
+  return picker->queuedTicket;
+}
+
+int ComparePickIds(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Turn a frame's finished readback into a result, the frame's free for the
+// next request after
+PickResult DecodePick(PickFrame *frame) {
+  uint32_t pixels = frame->region.extent.width * frame->region.extent.height;
+  PickResult result = {.ticket = frame->ticket,
+                       .ids = malloc(sizeof(uint32_t) * pixels)};
+  memcpy(result.ids, frame->memory.mapped, sizeof(uint32_t) * pixels);
+  qsort(result.ids, pixels, sizeof(uint32_t), ComparePickIds);
+  for (uint32_t i = 0; i < pixels; i++) {
+    if (result.ids[i] != PICK_NONE &&
+        (result.count == 0 || result.ids[result.count - 1] != result.ids[i])) {
+      result.ids[result.count++] = result.ids[i];
+    }
+  }
+  frame->ticket = 0;
+  return result;
+}
+
+// Keep the result of frame's request for polling, its readback buffer is
+// about to be reused. Frame has to have finished on the GPU
+void RetirePickFrame(Picker *picker, uint32_t frameIndex) {
+  PickFrame *frame = &picker->frames[frameIndex];
+  if (frame->ticket == 0) {
+    return;
+  }
+  if (picker->resultCount == PICK_MAX_RESULTS) {
+    free(picker->results[0].ids);
+    memmove(picker->results, picker->results + 1,
+            sizeof(PickResult) * (PICK_MAX_RESULTS - 1));
+    picker->resultCount--;
+  }
+  picker->results[picker->resultCount++] = DecodePick(frame);
+}
+
+/**
+ * Record copying the queued request out of idImage (left in
+ * TRANSFER_SRC_OPTIMAL by the frame, extent big) into the frame's readback
+ * buffer. Returns the command buffer to submit straight after the frame's,
+ * or VK_NULL_HANDLE if nothing was asked for. The frame has to have been
+ * retired with RetirePickFrame.
+ */
+VkCommandBuffer RecordPick(Picker *picker, uint32_t frameIndex,
+                           VkImage idImage, VkExtent2D extent) {
+  if (picker->queuedTicket == 0) {
+    return VK_NULL_HANDLE;
+  }
+  PickFrame *frame = &picker->frames[frameIndex];
+  // Clamped to the attachment
+  VkRect2D region = picker->queuedRegion;
+  int64_t left = region.offset.x > 0 ? region.offset.x : 0;
+  int64_t top = region.offset.y > 0 ? region.offset.y : 0;
+  int64_t right = (int64_t)region.offset.x + region.extent.width;
+  int64_t bottom = (int64_t)region.offset.y + region.extent.height;
+  right = right < extent.width ? right : extent.width;
+  bottom = bottom < extent.height ? bottom : extent.height;
+  frame->ticket = picker->queuedTicket;
+  frame->region = (VkRect2D){0};
+  frame->value = 0;
+  picker->queuedTicket = 0;
+  if (right <= left || bottom <= top) {
+    // Nothing under it, the empty result comes back with the frame
+    return VK_NULL_HANDLE;
+  }
+  region = (VkRect2D){.offset = {left, top},
+                      .extent = {right - left, bottom - top}};
+  frame->region = region;
+  VkCommandBuffer commandBuffer = frame->commandBuffer;
+  vkResetCommandBuffer(commandBuffer, 0);
+  vkBeginCommandBuffer(
+      commandBuffer,
+      &(VkCommandBufferBeginInfo){
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+          .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT});
+  // The render pass's dependency already covers the attachment writes
+  vkCmdCopyImageToBuffer(
+      commandBuffer, idImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+      frame->buffer, 1,
+      &(VkBufferImageCopy){
+          .bufferOffset = 0,
+          .bufferRowLength = 0,
+          .bufferImageHeight = 0,
+          .imageSubresource = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                               .mipLevel = 0,
+                               .baseArrayLayer = 0,
+                               .layerCount = 1},
+          .imageOffset = {region.offset.x, region.offset.y, 0},
+          .imageExtent = {region.extent.width, region.extent.height, 1}});
+  vkCmdPipelineBarrier(
+      commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_HOST_BIT, 0, 1,
+      &(VkMemoryBarrier){.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                         .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                         .dstAccessMask = VK_ACCESS_HOST_READ_BIT},
+      0, NULL, 0, NULL);
+  vkEndCommandBuffer(commandBuffer);
+  return commandBuffer;
+}
+
+// The frame carrying its pick finishes at value
+void PickSubmitted(Picker *picker, uint32_t frameIndex, uint64_t value) {
+  PickFrame *frame = &picker->frames[frameIndex];
+  if (frame->ticket && frame->value == 0) {
+    frame->value = value;
+  }
+}
+
+/**
+ * Check without blocking whether ticket's result is in. Returns PICK_READY
+ * and hands the result over to the caller (who frees result->ids) if it is,
+ * PICK_PENDING while it's still on its way and PICK_DROPPED once it won't
+ * ever be.
+ */
+PickStatus PollPick(Picker *picker, uint32_t ticket, PickResult *result) {
+  for (uint32_t i = 0; i < picker->frameCount; i++) {
+    PickFrame *frame = &picker->frames[i];
+    if (frame->ticket == ticket && frame->value &&
+        TimelineReached(picker->timeline, frame->value)) {
+      RetirePickFrame(picker, i);
+    }
+  }
+  for (uint32_t i = 0; i < picker->resultCount; i++) {
+    if (picker->results[i].ticket == ticket) {
+      *result = picker->results[i];
+      memmove(&picker->results[i], &picker->results[i + 1],
+              sizeof(PickResult) * (picker->resultCount - i - 1));
+      picker->resultCount--;
+      return PICK_READY;
+    }
+  }
+  if (ticket && ticket == picker->queuedTicket) {
+    return PICK_PENDING;
+  }
+  for (uint32_t i = 0; ticket && i < picker->frameCount; i++) {
+    if (picker->frames[i].ticket == ticket) {
+      return PICK_PENDING;
+    }
+  }
+  return PICK_DROPPED;
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef OPENDOM_PIPELINES
+#define OPENDOM_PIPELINES
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+// Pipelines are created through a VkPipelineCache kept on disk between runs,
+// so past the first run building one is mostly a lookup. The cache is only
+// handed back to the driver if its header says the same driver on the same
+// device wrote it.
+//
+// A PipelineCompiler builds the variants of a pipeline on a thread of its
+// own, so asking for one never holds a frame up. Whoever asked polls for it
+// and carries on with what they had until it's there.
+#define PIPELINE_CACHE_PATH "./pipeline.cache"
+#define MAX_PIPELINE_VARIANTS 8
+
+// What Vulkan puts at the start of the cache data (version one)
+typedef struct PipelineCacheHeader {
+  uint32_t headerSize;
+  uint32_t headerVersion;
+  uint32_t vendorID;
+  uint32_t deviceID;
+  uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+} PipelineCacheHeader;
+
+/**
+ * Create a pipeline cache seeded from the file at path, if there is one
+ * and it was written for physicalDevice. The size of the data it started
+ * out with goes in loadedSize, 0 when it starts empty.
+ */
+VkPipelineCache LoadPipelineCache(VkPhysicalDevice physicalDevice,
+                                  VkDevice device, char *path,
+                                  size_t *loadedSize) {
+  void *data = NULL;
+  size_t size = 0;
+  FILE *file = fopen(path, "rb");
+  if (file) {
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data = malloc(size);
+    if (fread(data, 1, size, file) != size) {
+      size = 0;
+    }
+    fclose(file);
+  }
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+  PipelineCacheHeader *header = data;
+  if (size > 0 &&
+      (size < sizeof(PipelineCacheHeader) ||
+       header->headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+       header->vendorID != properties.vendorID ||
+       header->deviceID != properties.deviceID ||
+       memcmp(header->pipelineCacheUUID, properties.pipelineCacheUUID,
+              VK_UUID_SIZE) != 0)) {
+    printf("Pipeline cache %s is for another device or driver, starting "
+           "over\n",
+           path);
+    size = 0;
+  }
+  VkPipelineCache cache;
+  if (vkCreatePipelineCache(
+          device,
+          &(VkPipelineCacheCreateInfo){
+              .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+              .initialDataSize = size,
+              .pInitialData = data},
+          NULL, &cache) != VK_SUCCESS) {
+    fprintf(stderr, "Failed to create pipeline cache\n");
+    cache = VK_NULL_HANDLE;
+    size = 0;
+  }
+  free(data);
+  *loadedSize = size;
+  return cache;
+}
+
+/**
+ * Write cache out to path if it has grown past savedSize, which is updated
+ * to what was written. Goes through a temporary file so a cache cut short
+ * never replaces a good one.
+ */
+void SavePipelineCache(VkDevice device, VkPipelineCache cache, char *path,
+                       size_t *savedSize) {
+  size_t size;
+  if (cache == VK_NULL_HANDLE ||
+      vkGetPipelineCacheData(device, cache, &size, NULL) != VK_SUCCESS ||
+      size <= *savedSize) {
+    return;
+  }
+  void *data = malloc(size);
+  vkGetPipelineCacheData(device, cache, &size, data);
+  char temporary[256];
+  snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+  FILE *file = fopen(temporary, "wb");
+  if (!file) {
+    fprintf(stderr, "Failed to write pipeline cache %s\n", temporary);
+    free(data);
+    return;
+  }
+  bool written = fwrite(data, 1, size, file) == size;
+  written = fclose(file) == 0 && written;
+  if (written && rename(temporary, path) == 0) {
+    *savedSize = size;
+  } else {
+    fprintf(stderr, "Failed to write pipeline cache %s\n", path);
+    remove(temporary);
+  }
+  free(data);
+}
+
+// Builds a variant of a pipeline, on the compiler's thread
+typedef VkPipeline (*PipelineBuilder)(void *context, uint32_t variant);
+
+typedef enum PipelineStatus {
+  PIPELINE_IDLE,
+  PIPELINE_QUEUED,
+  PIPELINE_COMPILING,
+  PIPELINE_READY,
+  // The builder gave up, it isn't tried again until DiscardPipelines
+  PIPELINE_FAILED,
+} PipelineStatus;
+
+typedef struct PipelineCompiler {
+  PipelineBuilder build;
+  void *context;
+  pthread_t thread;
+  // Everything below is guarded by lock, changed is signalled whenever any
+  // of it changes
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  PipelineStatus status[MAX_PIPELINE_VARIANTS];
+  VkPipeline pipelines[MAX_PIPELINE_VARIANTS];
+} PipelineCompiler;
+
+void *PipelineCompileWorker(void *arg) {
+  PipelineCompiler *compiler = arg;
+  pthread_mutex_lock(&compiler->lock);
+  while (true) {
+    uint32_t variant = 0;
+    while (variant < MAX_PIPELINE_VARIANTS &&
+           compiler->status[variant] != PIPELINE_QUEUED) {
+      variant++;
+    }
+    if (variant == MAX_PIPELINE_VARIANTS) {
+      pthread_cond_wait(&compiler->changed, &compiler->lock);
+      continue;
+    }
+    compiler->status[variant] = PIPELINE_COMPILING;
+    pthread_mutex_unlock(&compiler->lock);
+    VkPipeline pipeline = compiler->build(compiler->context, variant);
+    pthread_mutex_lock(&compiler->lock);
+    compiler->pipelines[variant] = pipeline;
+    compiler->status[variant] = pipeline ? PIPELINE_READY : PIPELINE_FAILED;
+    pthread_cond_broadcast(&compiler->changed);
+  }
+  return NULL;
+}
+
+/**
+ * Start compiler's thread building variants with build, which gets context
+ * passed along. Nothing is built until it's asked for. Returns 0 on
+ * success.
+ */
+uint32_t StartPipelineCompiler(PipelineCompiler *compiler,
+                               PipelineBuilder build, void *context) {
+  *compiler = (PipelineCompiler){.build = build, .context = context};
+  pthread_mutex_init(&compiler->lock, NULL);
+  pthread_cond_init(&compiler->changed, NULL);
+  if (pthread_create(&compiler->thread, NULL, PipelineCompileWorker,
+                     compiler) != 0) {
+    fprintf(stderr, "Failed to start pipeline compiler thread\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Queue variant up to be built, unless it already has been or is on its way
+void RequestPipeline(PipelineCompiler *compiler, uint32_t variant) {
+  pthread_mutex_lock(&compiler->lock);
+  if (compiler->status[variant] == PIPELINE_IDLE) {
+    compiler->status[variant] = PIPELINE_QUEUED;
+    pthread_cond_broadcast(&compiler->changed);
+  }
+  pthread_mutex_unlock(&compiler->lock);
+}
+
+// variant if it's been built, VK_NULL_HANDLE while it's still on its way,
+// if it was never asked for or if it failed. Doesn't block
+VkPipeline PollPipeline(PipelineCompiler *compiler, uint32_t variant) {
+  pthread_mutex_lock(&compiler->lock);
+  VkPipeline pipeline = compiler->status[variant] == PIPELINE_READY
+                            ? compiler->pipelines[variant]
+                            : VK_NULL_HANDLE;
+  pthread_mutex_unlock(&compiler->lock);
+  return pipeline;
+}
+
+// Where variant is at. Doesn't block
+PipelineStatus GetPipelineStatus(PipelineCompiler *compiler,
+                                 uint32_t variant) {
+  pthread_mutex_lock(&compiler->lock);
+  PipelineStatus status = compiler->status[variant];
+  pthread_mutex_unlock(&compiler->lock);
+  return status;
+}
+
+// Ask for variant and block until it's built, VK_NULL_HANDLE if it failed
+VkPipeline WaitForPipeline(PipelineCompiler *compiler, uint32_t variant) {
+  RequestPipeline(compiler, variant);
+  pthread_mutex_lock(&compiler->lock);
+  while (compiler->status[variant] != PIPELINE_READY &&
+         compiler->status[variant] != PIPELINE_FAILED) {
+    pthread_cond_wait(&compiler->changed, &compiler->lock);
+  }
+  VkPipeline pipeline = compiler->pipelines[variant];
+  pthread_mutex_unlock(&compiler->lock);
+  return pipeline;
+}
+
+/**
+ * Destroy every variant built so far and forget any still queued, waiting
+ * out one being built. Once this returns the builder's context isn't in use
+ * until the next request, so it can be changed. Nothing the GPU may still
+ * be running can use the pipelines.
+ */
+void DiscardPipelines(PipelineCompiler *compiler, VkDevice device) {
+  pthread_mutex_lock(&compiler->lock);
+  for (uint32_t i = 0; i < MAX_PIPELINE_VARIANTS; i++) {
+    if (compiler->status[i] == PIPELINE_QUEUED) {
+      compiler->status[i] = PIPELINE_IDLE;
+    }
+  }
+  for (uint32_t i = 0; i < MAX_PIPELINE_VARIANTS; i++) {
+    while (compiler->status[i] == PIPELINE_COMPILING) {
+      pthread_cond_wait(&compiler->changed, &compiler->lock);
+    }
+    if (compiler->status[i] == PIPELINE_READY) {
+      vkDestroyPipeline(device, compiler->pipelines[i], NULL);
+    }
+    compiler->pipelines[i] = VK_NULL_HANDLE;
+    compiler->status[i] = PIPELINE_IDLE;
+  }
+  pthread_mutex_unlock(&compiler->lock);
+}
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef OPENDOM_SELECTION
+#define OPENDOM_SELECTION
+#include <cglm/cglm.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./cull.h"
+#include "./model.h"
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+// Box selection, done on the CPU against the camera the frame is drawn with.
+// An instance is selected when the screen space square around its bounding
+// sphere overlaps the box dragged out with the mouse. Screen coordinates are
+// in pixels from the top left, like gl_FragCoord and the cursor.
+
+// Growable list of selected instance ids
+typedef struct Selection {
+  uint32_t *ids;
+  uint32_t count;
+  uint32_t capacity;
+} Selection;
+
+// Everything selecting needs from the camera, worked out once per selection
+typedef struct SelectionView {
+  mat4 viewProj;
+  // Pixels per unit of radius at w = 1, along x and y
+  float radiusScale[2];
+  vec2 screenSize;
+  // Smallest x and y then largest x and y of the box
+  vec4 box;
+} SelectionView;
+
+/**
+ * Set up selecting inside the box between the two corners in mouse (xy and
+ * zw, either way round) on a screen of screenSize pixels, seen with the
+ * camera matrices view and proj.
+ */
+void SelectionViewFromCamera(mat4 view, mat4 proj, vec2 screenSize,
+                             vec4 mouse, SelectionView *selectionView) {
+  mat4 inverseView;
+  glm_mat4_inv(view, inverseView);
+  glm_mat4_mul(proj, inverseView, selectionView->viewProj);
+  selectionView->radiusScale[0] = fabsf(proj[0][0]) * 0.5f * screenSize[0];
+  selectionView->radiusScale[1] = fabsf(proj[1][1]) * 0.5f * screenSize[1];
+  glm_vec2_copy(screenSize, selectionView->screenSize);
+  selectionView->box[0] = glm_min(mouse[0], mouse[2]);
+  selectionView->box[1] = glm_min(mouse[1], mouse[3]);
+  selectionView->box[2] = glm_max(mouse[0], mouse[2]);
+  selectionView->box[3] = glm_max(mouse[1], mouse[3]);
+}
+
+void AppendSelection(Selection *selection, uint32_t id) {
+  if (selection->count == selection->capacity) {
+    selection->capacity = selection->capacity ? selection->capacity * 2 : 256;
+    selection->ids =
+        realloc(selection->ids, sizeof(uint32_t) * selection->capacity);
+  }
+  selection->ids[selection->count++] = id;
+}
+
+// Whether sphere's square on screen overlaps the box. Spheres with their
+// centre behind the camera never do
+bool SphereInBox(SelectionView *selectionView, vec4 sphere) {
+  float *m = selectionView->viewProj[0];
+  float x = m[0] * sphere[0] + m[4] * sphere[1] + m[8] * sphere[2] + m[12];
+  float y = m[1] * sphere[0] + m[5] * sphere[1] + m[9] * sphere[2] + m[13];
+  float w = m[3] * sphere[0] + m[7] * sphere[1] + m[11] * sphere[2] + m[15];
+  if (!(w > 0)) {
+    return false;
+  }
+  float inverseW = 1 / w;
+  float sx = (x * inverseW * 0.5f + 0.5f) * selectionView->screenSize[0];
+  float sy = (y * inverseW * 0.5f + 0.5f) * selectionView->screenSize[1];
+  float rx = sphere[3] * inverseW * selectionView->radiusScale[0];
+  float ry = sphere[3] * inverseW * selectionView->radiusScale[1];
+  return sx + rx >= selectionView->box[0] &&
+         sy + ry >= selectionView->box[1] &&
+         sx - rx <= selectionView->box[2] && sy - ry <= selectionView->box[3];
+}
+
+// One instance at a time, appends the ids of the instances of model in store
+// that are in the box to selection and returns how many there were
+uint32_t SelectInBoxScalar(SelectionView *selectionView, Model *model,
+                           InstanceStore *store, Selection *selection) {
+  uint32_t before = selection->count;
+  for (uint32_t i = 0; i < store->count; i++) {
+    vec4 sphere;
+    InstanceSphere(model, store, i, sphere);
+    if (SphereInBox(selectionView, sphere)) {
+      AppendSelection(selection, store->ids[i]);
+    }
+  }
+  return selection->count - before;
+}
+
+/**
+ * SelectInBoxScalar projecting four instances at once. Spheres are gathered
+ * a block at a time into SoA arrays like CullInstances does. Falls back to
+ * the scalar version without SSE.
+ */
+uint32_t SelectInBox(SelectionView *selectionView, Model *model,
+                     InstanceStore *store, Selection *selection) {
+#ifdef __SSE__
+#define SELECT_BLOCK 256
+  float x[SELECT_BLOCK], y[SELECT_BLOCK], z[SELECT_BLOCK], r[SELECT_BLOCK];
+  __m128 m[16];
+  for (uint32_t i = 0; i < 16; i++) {
+    m[i] = _mm_set1_ps(selectionView->viewProj[0][i]);
+  }
+  __m128 half = _mm_set1_ps(0.5f);
+  __m128 one = _mm_set1_ps(1);
+  __m128 width = _mm_set1_ps(selectionView->screenSize[0]);
+  __m128 height = _mm_set1_ps(selectionView->screenSize[1]);
+  __m128 radiusX = _mm_set1_ps(selectionView->radiusScale[0]);
+  __m128 radiusY = _mm_set1_ps(selectionView->radiusScale[1]);
+  __m128 box[4];
+  for (uint32_t i = 0; i < 4; i++) {
+    box[i] = _mm_set1_ps(selectionView->box[i]);
+  }
+  uint32_t before = selection->count;
+  uint32_t count = store->count;
+  for (uint32_t block = 0; block < count; block += SELECT_BLOCK) {
+    uint32_t blockCount =
+        count - block < SELECT_BLOCK ? count - block : SELECT_BLOCK;
+    for (uint32_t i = 0; i < blockCount; i++) {
+      vec4 sphere;
+      InstanceSphere(model, store, block + i, sphere);
+      x[i] = sphere[0];
+      y[i] = sphere[1];
+      z[i] = sphere[2];
+      r[i] = sphere[3];
+    }
+    // Pad the last group of four out with spheres that never pass
+    for (uint32_t i = blockCount; i % 4 != 0; i++) {
+      x[i] = y[i] = z[i] = 0;
+      r[i] = -INFINITY;
+    }
+    for (uint32_t i = 0; i < blockCount; i += 4) {
+      __m128 px = _mm_loadu_ps(&x[i]);
+      __m128 py = _mm_loadu_ps(&y[i]);
+      __m128 pz = _mm_loadu_ps(&z[i]);
+      __m128 pr = _mm_loadu_ps(&r[i]);
+      // Same order of operations as SphereInBox so both round alike
+      __m128 cx = _mm_add_ps(
+          _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0], px), _mm_mul_ps(m[4], py)),
+                     _mm_mul_ps(m[8], pz)),
+          m[12]);
+      __m128 cy = _mm_add_ps(
+          _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[1], px), _mm_mul_ps(m[5], py)),
+                     _mm_mul_ps(m[9], pz)),
+          m[13]);
+      __m128 cw = _mm_add_ps(
+          _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[3], px), _mm_mul_ps(m[7], py)),
+                     _mm_mul_ps(m[11], pz)),
+          m[15]);
+      __m128 inFront = _mm_cmpgt_ps(cw, _mm_setzero_ps());
+      // A real divide rather than _mm_rcp_ps, to agree with the scalar path
+      __m128 inverseW = _mm_div_ps(one, cw);
+      __m128 sx = _mm_mul_ps(
+          _mm_add_ps(_mm_mul_ps(_mm_mul_ps(cx, inverseW), half), half), width);
+      __m128 sy = _mm_mul_ps(
+          _mm_add_ps(_mm_mul_ps(_mm_mul_ps(cy, inverseW), half), half),
+          height);
+      __m128 rx = _mm_mul_ps(_mm_mul_ps(pr, inverseW), radiusX);
+      __m128 ry = _mm_mul_ps(_mm_mul_ps(pr, inverseW), radiusY);
+      __m128 inside = _mm_and_ps(
+          _mm_and_ps(_mm_cmpge_ps(_mm_add_ps(sx, rx), box[0]),
+                     _mm_cmpge_ps(_mm_add_ps(sy, ry), box[1])),
+          _mm_and_ps(_mm_cmple_ps(_mm_sub_ps(sx, rx), box[2]),
+                     _mm_cmple_ps(_mm_sub_ps(sy, ry), box[3])));
+      uint32_t mask = _mm_movemask_ps(_mm_and_ps(inFront, inside));
+      while (mask) {
+        uint32_t lane = __builtin_ctz(mask);
+        AppendSelection(selection, store->ids[block + i + lane]);
+        mask &= mask - 1;
+      }
+    }
+  }
+  return selection->count - before;
+#else
+  return SelectInBoxScalar(selectionView, model, store, selection);
+#endif
+}
+
+// The selection as the fragment shader reads it (Selection in
+// shaders/fragment.frag, std430). After the header come wordCount words of
+// one bit per instance id, then the selectedCount selected ids, so a
+// million instances cost 125 KB of bits rather than a word each
+typedef struct SelectionHeader {
+  uint32_t selectedCount;
+  uint32_t wordCount;
+  uint32_t padding[2];
+} SelectionHeader;
+_Static_assert(offsetof(SelectionHeader, selectedCount) == 0,
+               "SelectionHeader has to match shaders/fragment.frag");
+_Static_assert(offsetof(SelectionHeader, wordCount) == 4,
+               "SelectionHeader has to match shaders/fragment.frag");
+_Static_assert(sizeof(SelectionHeader) == 16,
+               "Selection bits start 16 bytes in, shaders/fragment.frag");
+
+// Bitset words covering ids 0 to idCount - 1. Sized from every id there is
+// rather than the selected ones, so it only grows as instances are added
+uint32_t SelectionWords(uint32_t idCount) {
+  return (idCount + 31) / 32;
+}
+
+// Bytes of the selection buffer for wordCount words of bits and count ids
+size_t SelectionBufferSize(uint32_t wordCount, uint32_t count) {
+  return sizeof(SelectionHeader) +
+         sizeof(uint32_t) * ((size_t)wordCount + count);
+}
+
+/**
+ * Lay selection out for the shaders at mapped, which has to have room for
+ * SelectionBufferSize(wordCount, selection->count) with wordCount covering
+ * every id in selection.
+ */
+void WriteSelectionBuffer(Selection *selection, uint32_t wordCount,
+                          void *mapped) {
+  SelectionHeader *header = mapped;
+  uint32_t *bits = (uint32_t *)(header + 1);
+  *header = (SelectionHeader){.selectedCount = selection->count,
+                              .wordCount = wordCount};
+  memset(bits, 0, sizeof(uint32_t) * wordCount);
+  for (uint32_t i = 0; i < selection->count; i++) {
+    uint32_t id = selection->ids[i];
+    bits[id / 32] |= 1u << (id % 32);
+  }
+  memcpy(bits + wordCount, selection->ids,
+         sizeof(uint32_t) * selection->count);
+}
+
+/**
+ * Replace selection with every instance of the count defs in entities
+ * inside the box of selectionView.
+ */
+void SelectEntities(SelectionView *selectionView, EntityDef *entities,
+                    uint32_t count, Selection *selection) {
+  selection->count = 0;
+  for (uint32_t t = 0; t < count; t++) {
+    SelectInBox(selectionView, &entities[t].model, &entities[t].instances,
+                selection);
+  }
+}
+
+#endif
@@ -0,0 +1,312 @@
+#ifndef OPENDOM_SIMPLIFY
+#define OPENDOM_SIMPLIFY
+#include <cglm/cglm.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Quadric error metric simplification (Garland and Heckbert) for building the
+// coarser levels of detail of a model at import. Every vertex carries the sum
+// of the squared distance to the planes of the triangles around it, and edges
+// are collapsed cheapest first. Collapses move one end of an edge onto the
+// other rather than to a new position, so every level keeps using the model's
+// own vertices and only needs indices of its own.
+
+// Symmetric 4x4 matrix, upper triangle row by row
+typedef struct Quadric {
+  double a[10];
+} Quadric;
+
+// Edge collapse candidate, moving vertex from onto vertex to
+typedef struct Collapse {
+  uint32_t from;
+  uint32_t to;
+  double cost;
+} Collapse;
+
+typedef struct Simplifier {
+  float (*positions)[4];
+  uint32_t vertexCount;
+  // Vertices sharing a position (split for their normals or colours) are
+  // welded together, this is the vertex each one is welded to. Quadrics and
+  // collapses only ever deal in welded vertices
+  uint32_t *weld;
+  Quadric *quadrics;
+  // The mesh as simplified so far
+  uint32_t *indices;
+  uint32_t indexCount;
+  // Worst cost of any collapse so far, as a distance
+  float error;
+} Simplifier;
+
+void QuadricFromPlane(double x, double y, double z, double w,
+                      Quadric *quadric) {
+  double plane[4] = {x, y, z, w};
+  uint32_t k = 0;
+  for (uint32_t r = 0; r < 4; r++) {
+    for (uint32_t c = r; c < 4; c++) {
+      quadric->a[k++] = plane[r] * plane[c];
+    }
+  }
+}
+
+void QuadricAdd(Quadric *quadric, Quadric *other) {
+  for (uint32_t k = 0; k < 10; k++) {
+    quadric->a[k] += other->a[k];
+  }
+}
+
+// Sum of squared distances from p to the quadric's planes
+double QuadricError(Quadric *quadric, float *p) {
+  double *a = quadric->a;
+  double x = p[0], y = p[1], z = p[2];
+  return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x +
+         a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y + a[7] * z * z +
+         2 * a[8] * z + a[9];
+}
+
+// A vertex's position next to its index, sorted to find the ones to weld
+typedef struct WeldKey {
+  float position[3];
+  uint32_t vertex;
+} WeldKey;
+
+int CompareWeldKeys(const void *a, const void *b) {
+  const WeldKey *p = a, *q = b;
+  for (uint32_t k = 0; k < 3; k++) {
+    if (p->position[k] != q->position[k]) {
+      return p->position[k] < q->position[k] ? -1 : 1;
+    }
+  }
+  return p->vertex < q->vertex ? -1 : p->vertex > q->vertex;
+}
+
+int CompareCollapses(const void *a, const void *b) {
+  double p = ((const Collapse *)a)->cost;
+  double q = ((const Collapse *)b)->cost;
+  return p < q ? -1 : p > q;
+}
+
+/**
+ * Get ready to simplify the indexCount indices of a mesh over positions
+ * (xyz of each, vertexCount long). The indices are copied, positions have to
+ * outlive the simplifier.
+ */
+void InitSimplifier(Simplifier *simplifier, float (*positions)[4],
+                    uint32_t vertexCount, uint32_t *indices,
+                    uint32_t indexCount) {
+  *simplifier = (Simplifier){.positions = positions,
+                             .vertexCount = vertexCount,
+                             .weld = malloc(sizeof(uint32_t) * vertexCount),
+                             .quadrics = calloc(vertexCount, sizeof(Quadric)),
+                             .indices = malloc(sizeof(uint32_t) * indexCount),
+                             .indexCount = indexCount};
+  memcpy(simplifier->indices, indices, sizeof(uint32_t) * indexCount);
+  // Models get imported on several threads at once, so sort keys rather
+  // than indices to keep the comparison free of any global state
+  WeldKey *keys = malloc(sizeof(WeldKey) * vertexCount);
+  for (uint32_t i = 0; i < vertexCount; i++) {
+    keys[i] = (WeldKey){{positions[i][0], positions[i][1], positions[i][2]},
+                        i};
+  }
+  qsort(keys, vertexCount, sizeof(WeldKey), CompareWeldKeys);
+  for (uint32_t i = 0; i < vertexCount; i++) {
+    bool same =
+        i > 0 && glm_vec3_eqv(keys[i].position, keys[i - 1].position);
+    simplifier->weld[keys[i].vertex] =
+        same ? simplifier->weld[keys[i - 1].vertex] : keys[i].vertex;
+  }
+  free(keys);
+  for (uint32_t i = 0; i < indexCount; i += 3) {
+    float *p0 = positions[indices[i]];
+    float *p1 = positions[indices[i + 1]];
+    float *p2 = positions[indices[i + 2]];
+    vec3 e1, e2, normal;
+    glm_vec3_sub(p1, p0, e1);
+    glm_vec3_sub(p2, p0, e2);
+    glm_vec3_cross(e1, e2, normal);
+    float length = glm_vec3_norm(normal);
+    if (length == 0) {
+      continue;
+    }
+    glm_vec3_scale(normal, 1 / length, normal);
+    Quadric plane;
+    QuadricFromPlane(normal[0], normal[1], normal[2],
+                     -glm_vec3_dot(normal, p0), &plane);
+    for (uint32_t k = 0; k < 3; k++) {
+      QuadricAdd(&simplifier->quadrics[simplifier->weld[indices[i + k]]],
+                 &plane);
+    }
+  }
+}
+
+// Would moving from onto to turn any of from's triangles (listed in
+// triangles) over, or most of the way over
+bool CollapseFlips(Simplifier *simplifier, uint32_t *triangles,
+                   uint32_t triangleCount, uint32_t from, uint32_t to) {
+  for (uint32_t t = 0; t < triangleCount; t++) {
+    uint32_t *corners = &simplifier->indices[triangles[t] * 3];
+    float *before[3], *after[3];
+    bool collapsing = false;
+    for (uint32_t k = 0; k < 3; k++) {
+      uint32_t welded = simplifier->weld[corners[k]];
+      collapsing |= welded == to;
+      before[k] = simplifier->positions[welded];
+      after[k] = welded == from ? simplifier->positions[to] : before[k];
+    }
+    // Triangles along the edge itself just disappear
+    if (collapsing) {
+      continue;
+    }
+    vec3 e1, e2, normalBefore, normalAfter;
+    glm_vec3_sub(before[1], before[0], e1);
+    glm_vec3_sub(before[2], before[0], e2);
+    glm_vec3_cross(e1, e2, normalBefore);
+    glm_vec3_sub(after[1], after[0], e1);
+    glm_vec3_sub(after[2], after[0], e2);
+    glm_vec3_cross(e1, e2, normalAfter);
+    // Turning a long way is as bad as flipping, thin triangles that swing
+    // right round on a small move are where flips sneak through
+    if (glm_vec3_dot(normalBefore, normalAfter) <=
+        0.25f * glm_vec3_norm(normalBefore) * glm_vec3_norm(normalAfter)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Collapse edges until the mesh is down to targetIndexCount indices or no
+ * edge can go without folding the mesh over. Works in passes, each pass
+ * sorts every edge by cost and collapses the cheapest ones that don't touch
+ * a part of the mesh already changed in that pass. Returns the new index
+ * count.
+ */
+uint32_t SimplifyTo(Simplifier *simplifier, uint32_t targetIndexCount) {
+  uint32_t vertexCount = simplifier->vertexCount;
+  uint32_t *firstTriangle = malloc(sizeof(uint32_t) * (vertexCount + 1));
+  uint32_t *triangles = malloc(sizeof(uint32_t) * simplifier->indexCount);
+  Collapse *collapses = malloc(sizeof(Collapse) * simplifier->indexCount);
+  uint32_t *collapseTo = malloc(sizeof(uint32_t) * vertexCount);
+  bool *locked = malloc(sizeof(bool) * vertexCount);
+  while (simplifier->indexCount > targetIndexCount) {
+    uint32_t *indices = simplifier->indices;
+    uint32_t indexCount = simplifier->indexCount;
+    // Triangles around each welded vertex, firstTriangle[v] up to
+    // firstTriangle[v + 1] in triangles
+    memset(firstTriangle, 0, sizeof(uint32_t) * (vertexCount + 1));
+    for (uint32_t i = 0; i < indexCount; i++) {
+      firstTriangle[simplifier->weld[indices[i]] + 1]++;
+    }
+    for (uint32_t v = 0; v < vertexCount; v++) {
+      firstTriangle[v + 1] += firstTriangle[v];
+    }
+    // collapseTo isn't needed yet, so doubles as each vertex's fill cursor
+    memcpy(collapseTo, firstTriangle, sizeof(uint32_t) * vertexCount);
+    for (uint32_t i = 0; i < indexCount; i++) {
+      triangles[collapseTo[simplifier->weld[indices[i]]]++] = i / 3;
+    }
+    // Every edge of every triangle, shared edges turn up twice but the
+    // second is skipped once the first has locked its ends
+    uint32_t collapseCount = 0;
+    for (uint32_t i = 0; i < indexCount; i++) {
+      uint32_t a = simplifier->weld[indices[i]];
+      uint32_t b = simplifier->weld[indices[i - i % 3 + (i + 1) % 3]];
+      if (a == b) {
+        continue;
+      }
+      Quadric quadric = simplifier->quadrics[a];
+      QuadricAdd(&quadric, &simplifier->quadrics[b]);
+      double toB = QuadricError(&quadric, simplifier->positions[b]);
+      double toA = QuadricError(&quadric, simplifier->positions[a]);
+      collapses[collapseCount++] = toB <= toA
+                                       ? (Collapse){a, b, toB}
+                                       : (Collapse){b, a, toA};
+    }
+    qsort(collapses, collapseCount, sizeof(Collapse), CompareCollapses);
+
+    for (uint32_t v = 0; v < vertexCount; v++) {
+      collapseTo[v] = v;
+      locked[v] = false;
+    }
+    uint32_t removed = 0;
+    uint32_t needed = (indexCount - targetIndexCount) / 3;
+    // Leave the more expensive edges to later passes, their costs will have
+    // changed by then
+    uint32_t considered = collapseCount / 3 + 1;
+    for (uint32_t c = 0; c < collapseCount && c < considered; c++) {
+      if (removed >= needed) {
+        break;
+      }
+      Collapse *collapse = &collapses[c];
+      uint32_t from = collapse->from, to = collapse->to;
+      if (locked[from] || locked[to]) {
+        continue;
+      }
+      uint32_t *around = &triangles[firstTriangle[from]];
+      uint32_t aroundCount = firstTriangle[from + 1] - firstTriangle[from];
+      if (CollapseFlips(simplifier, around, aroundCount, from, to)) {
+        continue;
+      }
+      collapseTo[from] = to;
+      QuadricAdd(&simplifier->quadrics[to], &simplifier->quadrics[from]);
+      simplifier->error =
+          glm_max(simplifier->error, sqrtf(glm_max(collapse->cost, 0)));
+      // Nothing around either end can move again this pass, the flip test
+      // above relies on the triangles it looks at being current
+      uint32_t ends[2] = {from, to};
+      for (uint32_t e = 0; e < 2; e++) {
+        for (uint32_t t = firstTriangle[ends[e]];
+             t < firstTriangle[ends[e] + 1]; t++) {
+          uint32_t *corners = &indices[triangles[t] * 3];
+          bool collapsing = false;
+          for (uint32_t k = 0; k < 3; k++) {
+            uint32_t welded = simplifier->weld[corners[k]];
+            locked[welded] = true;
+            collapsing |= e == 0 && welded == to;
+          }
+          removed += collapsing;
+        }
+      }
+    }
+    if (removed == 0) {
+      break;
+    }
+    // Move the collapsed corners and drop the triangles that have lost an
+    // edge
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < indexCount; i += 3) {
+      uint32_t corners[3];
+      for (uint32_t k = 0; k < 3; k++) {
+        uint32_t welded = simplifier->weld[indices[i + k]];
+        corners[k] = collapseTo[welded] != welded ? collapseTo[welded]
+                                                  : indices[i + k];
+      }
+      uint32_t w0 = simplifier->weld[corners[0]];
+      uint32_t w1 = simplifier->weld[corners[1]];
+      uint32_t w2 = simplifier->weld[corners[2]];
+      if (w0 == w1 || w1 == w2 || w2 == w0) {
+        continue;
+      }
+      memcpy(&indices[kept], corners, sizeof(corners));
+      kept += 3;
+    }
+    simplifier->indexCount = kept;
+  }
+  free(firstTriangle);
+  free(triangles);
+  free(collapses);
+  free(collapseTo);
+  free(locked);
+  return simplifier->indexCount;
+}
+
+void FreeSimplifier(Simplifier *simplifier) {
+  free(simplifier->weld);
+  free(simplifier->quadrics);
+  free(simplifier->indices);
+}
+
+#endif
@@ -0,0 +1,244 @@
+#ifndef OPENDOM_STAGING
+#define OPENDOM_STAGING
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+#include "./sync.h"
+
+// Uploads stream through a persistently mapped ring buffer in chunks. While
+// the GPU copies one chunk out of the ring the CPU fills the next, and only
+// blocks once it catches up with a chunk the GPU hasn't finished with.
+#define STAGING_RING_SIZE (32 * 1024 * 1024)
+#define STAGING_MAX_CHUNKS 8
+
+typedef struct StagingChunk {
+  VkCommandBuffer commandBuffer;
+  // Timeline value the chunk's copies are done at
+  uint64_t value;
+  // Ring position (see StagingRing) just past the last byte this chunk uses
+  uint64_t end;
+  // Bytes copied by this chunk so far
+  VkDeviceSize size;
+} StagingChunk;
+
+typedef struct StagingRing {
+  Timeline *timeline;
+  VkBuffer buffer;
+  char *mapped;
+  VkDeviceSize size;
+  // Maximum bytes in a single submission, a quarter of the ring. Large
+  // uploads get split at this
+  VkDeviceSize chunkSize;
+  // head and tail only ever grow, the offset into the buffer is them modulo
+  // size. Everything between tail and head is still in use
+  uint64_t head;
+  uint64_t tail;
+  StagingChunk chunks[STAGING_MAX_CHUNKS];
+  // Chunks are used in order, chunks from oldestChunk up to currentChunk
+  // have been submitted and not yet retired
+  uint32_t currentChunk;
+  uint32_t oldestChunk;
+  uint32_t pendingChunks;
+  bool recording;
+  // A chunk failed to submit since the last FinishStaging, its copies never
+  // happened
+  bool failed;
+} StagingRing;
+
+/**
+ * Take over buffer (host visible and coherent, at least size bytes, mapped
+ * at mapped) to stream uploads through, submitting the copies to the queue
+ * of timeline. commandPool has to be for that queue's family. size is
+ * STAGING_RING_SIZE outside of testing the ring, and a multiple of 64.
+ */
+void InitStagingRing(StagingRing *ring, Timeline *timeline,
+                     VkCommandPool commandPool, VkBuffer buffer, void *mapped,
+                     VkDeviceSize size) {
+  *ring = (StagingRing){.timeline = timeline,
+                        .buffer = buffer,
+                        .mapped = mapped,
+                        .size = size,
+                        .chunkSize = size / 4};
+  VkCommandBuffer commandBuffers[STAGING_MAX_CHUNKS];
+  vkAllocateCommandBuffers(
+      timeline->device,
+      &(VkCommandBufferAllocateInfo){
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+          .commandPool = commandPool,
+          .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+          .commandBufferCount = STAGING_MAX_CHUNKS},
+      commandBuffers);
+  for (uint32_t i = 0; i < STAGING_MAX_CHUNKS; i++) {
+    ring->chunks[i].commandBuffer = commandBuffers[i];
+  }
+}
+
+// Block until the oldest submitted chunk has been copied out and release
+// its part of the ring
+void RetireStagingChunk(StagingRing *ring) {
+  StagingChunk *chunk = &ring->chunks[ring->oldestChunk];
+  WaitTimeline(ring->timeline, chunk->value);
+  ring->tail = chunk->end;
+  ring->oldestChunk = (ring->oldestChunk + 1) % STAGING_MAX_CHUNKS;
+  ring->pendingChunks--;
+}
+
+/**
+ * Submit the chunk currently being recorded, if it has anything in it.
+ * Returns 0 on success. A chunk that fails to submit is dropped, the GPU
+ * never uses its part of the ring, and FinishStaging reports the failure.
+ */
+uint32_t SubmitStaging(StagingRing *ring) {
+  if (!ring->recording) {
+    return 0;
+  }
+  StagingChunk *chunk = &ring->chunks[ring->currentChunk];
+  vkEndCommandBuffer(chunk->commandBuffer);
+  ring->recording = false;
+  uint64_t value = SubmitTimeline(ring->timeline, &chunk->commandBuffer, 1,
+                                  NULL, 0, VK_NULL_HANDLE);
+  if (!value) {
+    // Its space goes back with the next chunk that retires, or once nothing
+    // is left in flight
+    ring->failed = true;
+    return 1;
+  }
+  chunk->end = ring->head;
+  chunk->value = value;
+  ring->pendingChunks++;
+  ring->currentChunk = (ring->currentChunk + 1) % STAGING_MAX_CHUNKS;
+  return 0;
+}
+
+// Make sure there's a chunk to record copies into
+void BeginStagingChunk(StagingRing *ring) {
+  if (ring->recording) {
+    return;
+  }
+  if (ring->pendingChunks == STAGING_MAX_CHUNKS) {
+    RetireStagingChunk(ring);
+  }
+  StagingChunk *chunk = &ring->chunks[ring->currentChunk];
+  chunk->size = 0;
+  vkResetCommandBuffer(chunk->commandBuffer, 0);
+  vkBeginCommandBuffer(
+      chunk->commandBuffer,
+      &(VkCommandBufferBeginInfo){
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+          .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT});
+  ring->recording = true;
+}
+
+// Reserve size (at most the ring's chunkSize) contiguous bytes of the ring,
+// waiting on the GPU if they're still in use. Returns the buffer offset
+VkDeviceSize AllocateStaging(StagingRing *ring, VkDeviceSize size) {
+  // Keep copies 16 byte aligned so memcpy can use wide loads and stores
+  ring->head = (ring->head + 15) & ~(uint64_t)15;
+  // Allocations never straddle the end of the buffer
+  VkDeviceSize offset = ring->head % ring->size;
+  if (offset + size > ring->size) {
+    ring->head += ring->size - offset;
+    offset = 0;
+  }
+  while (ring->head + size - ring->tail > ring->size) {
+    if (ring->pendingChunks == 0) {
+      // The space is held by the chunk we're still recording
+      SubmitStaging(ring);
+      BeginStagingChunk(ring);
+      if (ring->pendingChunks == 0) {
+        // Or by chunks that failed to submit, which the GPU never got
+        ring->tail = ring->head;
+        continue;
+      }
+    }
+    RetireStagingChunk(ring);
+  }
+  ring->head += size;
+  return offset;
+}
+
+/**
+ * Copy size bytes from data to dst at dstOffset. Large uploads are split
+ * over several chunks, each chunk is submitted as soon as it is full so the
+ * GPU starts copying while the rest is still being written. Nothing is
+ * guaranteed to have been submitted until SubmitStaging or FinishStaging.
+ * Returns 0 unless a chunk failed to submit since the last FinishStaging,
+ * giving up on the rest of the upload if one does.
+ */
+uint32_t StagingUpload(StagingRing *ring, VkBuffer dst,
+                       VkDeviceSize dstOffset, const void *data,
+                       VkDeviceSize size) {
+  while (size > 0 && !ring->failed) {
+    BeginStagingChunk(ring);
+    StagingChunk *chunk = &ring->chunks[ring->currentChunk];
+    VkDeviceSize pieceSize = ring->chunkSize - chunk->size;
+    if (pieceSize > size) {
+      pieceSize = size;
+    }
+    VkDeviceSize offset = AllocateStaging(ring, pieceSize);
+    // Allocating may have had to submit the chunk to make space
+    chunk = &ring->chunks[ring->currentChunk];
+    memcpy(ring->mapped + offset, data, pieceSize);
+    vkCmdCopyBuffer(chunk->commandBuffer, ring->buffer, dst, 1,
+                    &(VkBufferCopy){.srcOffset = offset,
+                                    .dstOffset = dstOffset,
+                                    .size = pieceSize});
+    chunk->size += pieceSize;
+    if (chunk->size >= ring->chunkSize) {
+      SubmitStaging(ring);
+    }
+    data = (const char *)data + pieceSize;
+    dstOffset += pieceSize;
+    size -= pieceSize;
+  }
+  return ring->failed;
+}
+
+/**
+ * Copy the first size bytes of src over to dst on the GPU, after every
+ * upload recorded so far has landed. For moving the contents of a buffer
+ * that is being replaced by a larger one.
+ */
+void StagingCopy(StagingRing *ring, VkBuffer src, VkBuffer dst,
+                 VkDeviceSize size) {
+  BeginStagingChunk(ring);
+  StagingChunk *chunk = &ring->chunks[ring->currentChunk];
+  vkCmdPipelineBarrier(
+      chunk->commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1,
+      &(VkMemoryBarrier){.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                         .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                         .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT},
+      0, NULL, 0, NULL);
+  vkCmdCopyBuffer(
+      chunk->commandBuffer, src, dst, 1,
+      &(VkBufferCopy){.srcOffset = 0, .dstOffset = 0, .size = size});
+}
+
+// Release the space of every chunk the GPU is already done with
+void ReclaimStaging(StagingRing *ring) {
+  while (ring->pendingChunks > 0 &&
+         TimelineReached(ring->timeline,
+                         ring->chunks[ring->oldestChunk].value)) {
+    RetireStagingChunk(ring);
+  }
+}
+
+/**
+ * Submit anything outstanding without waiting on it. Writes the timeline
+ * value every upload that was submitted has landed at to landed, for the
+ * work using them to wait on. Returns 0 if every upload since the last
+ * FinishStaging was submitted.
+ */
+uint32_t FinishStaging(StagingRing *ring, uint64_t *landed) {
+  SubmitStaging(ring);
+  ReclaimStaging(ring);
+  *landed = ring->timeline->submitted;
+  uint32_t failed = ring->failed;
+  ring->failed = false;
+  return failed;
+}
+
+#endif
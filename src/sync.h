@@ -0,0 +1,147 @@
+#ifndef OPENDOM_SYNC
+#define OPENDOM_SYNC
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vulkan/vulkan.h>
+
+// Each queue gets a timeline semaphore whose value only ever goes up, every
+// submission to the queue signals the next value. Whether some work has
+// finished is then a comparison, and submissions depend on each other by
+// waiting on values rather than the CPU waiting in between them.
+#define TIMELINE_MAX_WAITS 8
+
+typedef struct Timeline {
+  VkDevice device;
+  VkQueue queue;
+  VkSemaphore semaphore;
+  // Value the latest submission will signal
+  uint64_t submitted;
+  // Highest value the GPU is known to have reached
+  uint64_t completed;
+} Timeline;
+
+// Something a submission has to wait for, either a timeline reaching value
+// or a binary semaphore (value is ignored)
+typedef struct TimelineWait {
+  VkSemaphore semaphore;
+  uint64_t value;
+  VkPipelineStageFlags stage;
+} TimelineWait;
+
+uint32_t InitTimeline(Timeline *timeline, VkDevice device, VkQueue queue) {
+  *timeline = (Timeline){.device = device, .queue = queue};
+  VkResult res = vkCreateSemaphore(
+      device,
+      &(VkSemaphoreCreateInfo){
+          .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+          .pNext =
+              &(VkSemaphoreTypeCreateInfo){
+                  .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+                  .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+                  .initialValue = 0}},
+      NULL, &timeline->semaphore);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "Failed to create timeline semaphore: %d\n", res);
+    return 1;
+  }
+  return 0;
+}
+
+// Wait on timeline reaching value before stage
+TimelineWait TimelineDependency(Timeline *timeline, uint64_t value,
+                                VkPipelineStageFlags stage) {
+  return (TimelineWait){
+      .semaphore = timeline->semaphore, .value = value, .stage = stage};
+}
+
+/**
+ * Submit commandBuffers to the timeline's queue once all of waits are met.
+ * Also signals the binary semaphore signal if it isn't VK_NULL_HANDLE.
+ * Returns the timeline value that marks the submission as finished, or 0 if
+ * it couldn't be submitted.
+ */
+uint64_t SubmitTimeline(Timeline *timeline, VkCommandBuffer *commandBuffers,
+                        uint32_t commandBufferCount, TimelineWait *waits,
+                        uint32_t waitCount, VkSemaphore signal) {
+  if (waitCount > TIMELINE_MAX_WAITS) {
+    fprintf(stderr, "Too many waits for one submission: %d\n", waitCount);
+    return 0;
+  }
+  VkSemaphore waitSemaphores[TIMELINE_MAX_WAITS];
+  uint64_t waitValues[TIMELINE_MAX_WAITS];
+  VkPipelineStageFlags waitStages[TIMELINE_MAX_WAITS];
+  for (uint32_t i = 0; i < waitCount; i++) {
+    waitSemaphores[i] = waits[i].semaphore;
+    waitValues[i] = waits[i].value;
+    waitStages[i] = waits[i].stage;
+  }
+  uint64_t value = timeline->submitted + 1;
+  VkResult res = vkQueueSubmit(
+      timeline->queue, 1,
+      &(VkSubmitInfo){
+          .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+          .pNext =
+              &(VkTimelineSemaphoreSubmitInfo){
+                  .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+                  .waitSemaphoreValueCount = waitCount,
+                  .pWaitSemaphoreValues = waitValues,
+                  .signalSemaphoreValueCount = signal ? 2 : 1,
+                  .pSignalSemaphoreValues = (uint64_t[2]){value, 0}},
+          .waitSemaphoreCount = waitCount,
+          .pWaitSemaphores = waitSemaphores,
+          .pWaitDstStageMask = waitStages,
+          .commandBufferCount = commandBufferCount,
+          .pCommandBuffers = commandBuffers,
+          .signalSemaphoreCount = signal ? 2 : 1,
+          .pSignalSemaphores =
+              (VkSemaphore[2]){timeline->semaphore, signal}},
+      VK_NULL_HANDLE);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "Queue submission failed: %d\n", res);
+    return 0;
+  }
+  timeline->submitted = value;
+  return value;
+}
+
+// Check without blocking whether the GPU has got to value yet
+bool TimelineReached(Timeline *timeline, uint64_t value) {
+  if (value <= timeline->completed) {
+    return true;
+  }
+  vkGetSemaphoreCounterValue(timeline->device, timeline->semaphore,
+                             &timeline->completed);
+  return value <= timeline->completed;
+}
+
+/**
+ * Block until the GPU has got to value. Only for the few places the CPU
+ * really has nothing better to do, everything else should wait on the
+ * GPU with TimelineDependency. Returns 0 once reached.
+ */
+uint32_t WaitTimeline(Timeline *timeline, uint64_t value) {
+  if (TimelineReached(timeline, value)) {
+    return 0;
+  }
+  VkResult res = vkWaitSemaphores(
+      timeline->device,
+      &(VkSemaphoreWaitInfo){.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+                             .semaphoreCount = 1,
+                             .pSemaphores = &timeline->semaphore,
+                             .pValues = &value},
+      UINT64_MAX);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "Waiting on timeline failed: %d\n", res);
+    return 1;
+  }
+  timeline->completed = value;
+  return 0;
+}
+
+// Block until everything submitted so far has finished
+uint32_t DrainTimeline(Timeline *timeline) {
+  return WaitTimeline(timeline, timeline->submitted);
+}
+
+#endif
@@ -1,4 +1,6 @@
 #include <cglm/cam.h>
+#include <float.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -7,7 +9,14 @@
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_core.h>
 #define GLFW_INCLUDE_VULKAN
-#include "./model.h"
+#include "./allocator.h"
+#include "./frametime.h"
+#include "./modelcache.h"
+#include "./picking.h"
+#include "./pipelines.h"
+#include "./selection.h"
+#include "./staging.h"
+#include "./sync.h"
 #include <GLFW/glfw3.h>
 
 // We'll make constant sized arrays and put them on the stack when we can
@@ -16,33 +25,210 @@
 // length of those arrays
 #define MAX_SWAPCHAIN_IMAGES 8
 
+// Each def's range of the instance buffer starts out with room for this many
+// instances and doubles whenever it runs out
+#define MIN_GPU_INSTANCES 64
+// Starting size in bytes of the vertex and index arenas, they double whenever
+// a model doesn't fit
+#define MIN_ARENA_SIZE (1024 * 1024)
+// Models' indices go in an arena per index size, see IndexArena. Each arena
+// is bound and drawn on its own
+#define INDEX_ARENAS 2
+// Starting size in bytes of the selection buffer, doubles the same way
+#define MIN_SELECTION_SIZE 4096
+// Dirty instances separated by no more than this many clean ones are copied
+// over in a single range
+#define INSTANCE_COALESCE_GAP 8
+// Number of frames the CPU may run ahead of the GPU, framesInFlight in
+// GraphicsState picks how many of these are actually used
+#define MAX_FRAMES_IN_FLIGHT 4
+#define DEFAULT_FRAMES_IN_FLIGHT 2
+// Most levels the depth pyramid can have, enough for an 8k swapchain
+#define HIZ_MAX_LEVELS 14
+// Without a window frames are drawn into images of this size and format,
+// one per frame in flight, see InitGraphics
+#define HEADLESS_WIDTH 600
+#define HEADLESS_HEIGHT 400
+#define HEADLESS_FORMAT VK_FORMAT_R8G8B8A8_UNORM
+
 typedef struct CameraState {
   // Loaded onto GPU
   mat4 model;
   mat4 view;
   mat4 proj;
+  // proj * inverse(view) and its inverse, see UpdateCameraMatrices
+  mat4 viewProj;
+  mat4 inverseViewProj;
   // Doesn't go to GPU
   vec3 cameraVelocity;
   bool cameraTurning; // True = Holding down camera turn modifier
 } CameraState;
 
+// The mouse and window as of the frame, for picking and selection
 typedef struct InputState {
   vec4 mouse;
   vec2 windowSize;
   uint32_t mouseButtons;
-  uint32_t selectionBufferLength;
-  uint32_t frameId; // Rolling frame timestamp for determining how recently a
-                    // selection occurred
-  char selectionMap[4096];
-  char selectionBuffer[256];
 } InputState;
 
-typedef struct GraphicsState {
+
+// Per def data the vertex shader looks up with the index of its draw
+typedef struct DrawInfo {
+  vec4 positionScale;
+  vec4 positionBias;
+  // Model space bounding sphere, xyz centre and w radius
+  vec4 sphere;
+  // The error of each of the model's levels of detail, FLT_MAX past the
+  // last so culling never picks them
+  vec4 lodError;
+  // Which index arena the model is in, and so which draws culling fills in
+  uint32_t indexArena;
+  uint32_t padding[3];
+} DrawInfo;
+
+// Push constants of shaders/cull.comp
+typedef struct CullConstants {
+  // The render area, in pixels
+  vec2 depthSize;
+  // Zero for the early pass, one for the late
+  uint32_t late;
+  // Zero to skip testing against the depth pyramid
+  uint32_t occlusion;
+  // Per level draws of each index arena, drawCapacity * MODEL_MAX_LODS
+  uint32_t arenaDraws;
+  // Zero for the pass's counting dispatch, one for the one packing the
+  // instances it counted
+  uint32_t scatter;
+} CullConstants;
+
+// The geometry of every model packed back to back into one buffer, so defs
+// can be drawn together without rebinding anything between them
+typedef struct GeometryArena {
+  VkBuffer buffer;
+  GpuAllocation memory;
+  VkBufferUsageFlags usage;
+  VkDeviceSize size;
+  VkDeviceSize used;
+} GeometryArena;
+
+// A buffer that has been replaced but may still be bound by a command buffer
+// the GPU hasn't finished with yet
+typedef struct RetiredBuffer {
+  VkBuffer buffer;
+  GpuAllocation memory;
+  uint64_t frame; // Last frame that could have used the buffer
+} RetiredBuffer;
+
+// Everything a frame owns until the GPU is done with its submission
+typedef struct FrameResources {
+  // Graphics timeline value the frame's last submission finishes at
+  uint64_t submitted;
+  // Copies the frame's instance changes over on the transfer queue, the draw
+  // waits on it. Only submitted if there was anything to copy
+  VkCommandBuffer uploadCommandBuffer;
+  bool uploading;
+  // Host visible region the CPU writes dirty instances into
+  VkBuffer uploadBuffer;
+  GpuAllocation uploadMemory;
+  VkDeviceSize uploadSize;
+  // The frame's own copy of the instances of every def, each in its own
+  // range. Only the frame's upload writes it, so the transfer queue never
+  // waits on another frame still drawing. instanceCapacity instances long
+  VkBuffer instanceBuffer;
+  GpuAllocation instanceMemory;
+  uint32_t instanceCapacity;
+  // The GraphicsState instanceVersion the copy is up to date with
+  uint64_t instanceVersion;
+  // This frame's copy of the camera, persistently mapped
+  VkBuffer cameraBuffer;
+  GpuAllocation cameraMemory;
+  VkDescriptorSet descriptorSet;
+  VkDescriptorSet cullDescriptorSet;
+  // One indexed indirect draw per def covering all of its instances,
+  // drawCapacity long with the unused ones left at zero instances. Then for
+  // each index arena one draw per level of detail of each def with no
+  // instances yet, which culledDrawBuffer starts out as every frame, and the
+  // culling dispatch. A def's draws in the arena it isn't in have no indices.
+  // Persistently mapped
+  VkBuffer drawBuffer;
+  GpuAllocation drawMemory;
+  uint32_t drawCapacity;
+  // Culling's output, the per level draws with only the visible instances
+  // that picked that level, for each of culling's passes. A def's drawn
+  // instances are packed into its range of instanceBuffer's layout, by pass
+  // and then level, culledCapacity instances long
+  VkBuffer culledDrawBuffer;
+  GpuAllocation culledDrawMemory;
+  VkBuffer lateDrawBuffer;
+  GpuAllocation lateDrawMemory;
+  VkBuffer culledBuffer;
+  GpuAllocation culledMemory;
+  uint32_t culledCapacity;
+  // Where culling's counting dispatch put each instance in its draw, for
+  // the packing one. culledCapacity long
+  VkBuffer slotBuffer;
+  GpuAllocation slotMemory;
+  // The selection laid out for the fragment shader to highlight, see
+  // WriteFrameSelection. Persistently mapped
+  VkBuffer selectionBuffer;
+  GpuAllocation selectionMemory;
+  size_t selectionSize;
+  // GraphicsState's selectionVersion when it was last written
+  uint64_t selectionVersion;
+  // Instances the early culling pass found behind the depth pyramid, for the
+  // late pass to test again. Starts with the late pass's dispatch and a
+  // count, then a def and instance index each, culledCapacity long
+  VkBuffer retestBuffer;
+  GpuAllocation retestMemory;
+  // One per swapchain image, all binding this frame's descriptor set
   VkCommandBuffer commandbuffers[MAX_SWAPCHAIN_IMAGES];
+  // Set when the command buffers need re-recording before the next use
+  bool commandBufferDirty;
+  VkSemaphore imageReadySemaphore;
+  // Written at the start and end of the frame's command buffers, see
+  // FrameGpuTime
+  VkQueryPool timestampPool;
+  // What the frame drew copied out for SetFrameDump, persistently mapped.
+  // dumpNumber is the frame number plus one while it's waiting to be
+  // written, 0 otherwise
+  VkBuffer dumpBuffer;
+  GpuAllocation dumpMemory;
+  uint64_t dumpNumber;
+} FrameResources;
+
+// Variants of the scene pipeline
+#define SCENE_PIPELINE_FILL 0
+#define SCENE_PIPELINE_WIREFRAME 1
+
+// What BuildScenePipeline builds from. On the heap, the compiler's thread
+// holds on to it and GraphicsState is passed around by value
+typedef struct ScenePipelineContext {
+  VkDevice device;
+  VkPipelineCache cache;
+  // Bytes of the cache on disk
+  size_t cacheSize;
+  VkPipelineLayout layout;
+  // Any render pass compatible with the scene's, only changed while the
+  // compiler has nothing queued
+  VkRenderPass renderPass;
+} ScenePipelineContext;
+
+typedef struct GraphicsState {
   VkCommandPool commandPool;
+  // Same as commandPool unless there's a separate transfer queue family
+  VkCommandPool transferCommandPool;
+  // Nothing is handed between the two with queue family ownership
+  // transfers. Every buffer both queues touch is created concurrent across
+  // them with CreateSharedBuffer, and the timelines order the accesses
+  uint32_t graphicsFamily;
+  uint32_t transferFamily;
   VkInstance instance;
   VkPhysicalDevice physicalDevice;
   VkDevice device;
+  GpuAllocator allocator;
+  // Both null when headless, frames are drawn into swapchainImages then
+  // with nothing to present them to
+  bool headless;
   GLFWwindow *window;
   VkSurfaceKHR surface;
   VkFramebuffer framebuffers[MAX_SWAPCHAIN_IMAGES];
@@ -50,71 +236,124 @@ typedef struct GraphicsState {
   VkExtent2D renderArea;
   VkRenderPass renderPass;
   uint32_t imageCount;
-  // Indexed by imageId (incrementing index) divorced from actual
-  // image id
-  VkSemaphore imageReadySemaphores[MAX_SWAPCHAIN_IMAGES];
+  // Indexed by the acquired image
   VkSemaphore renderFinishedSemaphores[MAX_SWAPCHAIN_IMAGES];
-  VkFence imageReadyFences[MAX_SWAPCHAIN_IMAGES];
-  // Incrementing counter for next to render image
-  uint32_t imageId;
   VkImage swapchainImages[MAX_SWAPCHAIN_IMAGES];
+  VkImageView swapchainViews[MAX_SWAPCHAIN_IMAGES];
+  // Only when headless, swapchainImages are ours
+  GpuAllocation headlessImageMemories[MAX_SWAPCHAIN_IMAGES];
   VkImage depthImages[MAX_SWAPCHAIN_IMAGES];
-  VkDeviceMemory depthImageMemories[MAX_SWAPCHAIN_IMAGES];
-  // Pipeline
-  VkPipeline graphicsPipelines[2];
+  GpuAllocation depthImageMemories[MAX_SWAPCHAIN_IMAGES];
+  // The instance id drawn to each pixel, for picking to read back
+  VkImage idImages[MAX_SWAPCHAIN_IMAGES];
+  GpuAllocation idImageMemories[MAX_SWAPCHAIN_IMAGES];
+  VkImageView idViews[MAX_SWAPCHAIN_IMAGES];
+  Picker picker;
+  // Pipelines, built through pipelineCache which is saved back to disk as
+  // it grows. The scene's variants are built by compiler, see
+  // BuildScenePipeline. Only the render passes tie them to the swapchain,
+  // through its format
+  VkPipelineCache pipelineCache;
+  PipelineCompiler *compiler;
+  ScenePipelineContext *sceneContext;
+  VkFormat surfaceFormat;
   VkPipelineLayout layout;
+  // Draw with the wireframe variant once it has been built, if the device
+  // can draw lines. Pending until then
+  bool wireframe;
+  bool wireframePending;
+  bool wireframeSupported;
+  // Culling, see shaders/cull.comp
+  VkPipeline cullPipeline;
+  VkPipelineLayout cullLayout;
+  VkDescriptorSetLayout cullSetLayout;
+  // Occlusion culling against a depth pyramid, see BuildDepthPyramid.
+  // Culling only tests against it while occlusionCulling is set
+  bool occlusionCulling;
+  // Carries on drawing into what renderPass left, for culling's late pass
+  VkRenderPass loadRenderPass;
+  VkPipeline reducePipeline;
+  VkPipelineLayout reduceLayout;
+  VkDescriptorSetLayout reduceSetLayout;
+  VkSampler depthSampler;
+  VkImageView depthViews[MAX_SWAPCHAIN_IMAGES];
+  // Shared by every frame, each builds it out of its own depth and the next
+  // frame's early pass tests against that
+  VkImage depthPyramid;
+  GpuAllocation depthPyramidMemory;
+  VkImageView depthPyramidView;
+  VkImageView depthPyramidLevels[HIZ_MAX_LEVELS];
+  VkExtent2D depthPyramidExtents[HIZ_MAX_LEVELS];
+  uint32_t depthPyramidLevelCount;
+  // Level 0 is reduced from depthViews[i] with reduceSets[i], level l > 0
+  // from the level before with reduceSets[MAX_SWAPCHAIN_IMAGES + l]
+  VkDescriptorSet reduceSets[MAX_SWAPCHAIN_IMAGES + HIZ_MAX_LEVELS];
   VkDescriptorPool descriptorPool;
-  VkDescriptorSet descriptorSets[MAX_SWAPCHAIN_IMAGES];
   VkDescriptorSetLayout descriptorSetLayout;
-  VkBuffer cameraBuffer;
-  VkDeviceMemory cameraMemory;
-  VkBuffer inputBuffer;
-  VkDeviceMemory inputMemory;
-  VkFence inputReadFence;
-  VkBuffer stagingInputBuffer;
-  VkDeviceMemory stagingInputMemory;
+  // One timeline per queue, see sync.h. On the heap as the staging ring
+  // holds on to one and GraphicsState gets passed around by value
+  Timeline *graphicsTimeline;
+  Timeline *transferTimeline;
   // Model loading stuff
-  VkDeviceMemory stagingMemory;
-  VkBuffer stagingBuffer;
-  VkFence stagingFence;
+  StagingRing staging;
+  // Holds the graphics queue back until uploaded models have landed
+  VkCommandBuffer uploadWaitCommandBuffer;
+  uint64_t uploadWaitSubmitted;
+  // Every model's vertices, and its indices in the arena for their size
+  GeometryArena vertexArena;
+  GeometryArena indexArenas[INDEX_ARENAS];
   // Entities
   EntityDef *entities;
   size_t entityCount;
   size_t maxEntities;
-  VkFence entitySyncFence;
-  VkCommandBuffer entitySyncCommandBuffer;
-  VkCommandBuffer inputReadCommandBuffer;
+  // Instances the def ranges add up to, every frame's instance buffer is
+  // laid out the same way
+  uint32_t instanceCapacity;
+  // Bumped whenever the instances on the GPU change, the frame that changed
+  // them last holds the latest copy, UINT32_MAX before there is one
+  uint64_t instanceVersion;
+  uint32_t latestInstances;
+  // One DrawInfo per def, persistently mapped and maxEntities long
+  VkBuffer drawInfoBuffer;
+  GpuAllocation drawInfoMemory;
   bool commandBufferDirty;
+  // Buffers waiting for the frames that used them to retire
+  RetiredBuffer *retiredBuffers;
+  uint32_t retiredCount;
+  uint32_t maxRetired;
+  // Number of frames submitted so far
+  uint64_t frameCount;
+  uint32_t framesInFlight;
+  FrameResources frames[MAX_FRAMES_IN_FLIGHT];
+  FrameHistogram frameTimes;
+  // Scratch space for building up instance copies
+  VkBufferCopy *instanceCopies;
+  uint32_t maxInstanceCopies;
+  // CPU side camera, copied into the frame's buffer as each frame is
+  // submitted, and the input picking and selection go by
   CameraState *camera;
   InputState *input;
+  // Every instance id in the box, see selection.h
+  Selection selected;
+  // Bumped whenever selected changes, for frames to tell theirs is stale
+  uint64_t selectionVersion;
+  // Nanoseconds per timestamp tick, 0 if the graphics queue can't write
+  // timestamps
+  float timestampPeriod;
+  // Where each frame is written out to, see SetFrameDump. Null when frames
+  // aren't being dumped
+  char *dumpDirectory;
 } GraphicsState;
 
-uint32_t *getMemoryTypeMatching(VkPhysicalDevice physicalDevice,
-                                VkMemoryPropertyFlags flags,
-                                uint32_t *memoryTypeCount) {
-  VkPhysicalDeviceMemoryProperties memoryProperties;
-  static uint32_t memoryTypes[128];
-  vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
-  uint32_t i = 0;
-  uint32_t count = 0;
-  for (i = 0; i < memoryProperties.memoryTypeCount; i++) {
-    if ((flags & memoryProperties.memoryTypes[i].propertyFlags) == flags) {
-      memoryTypes[count++] = i;
-    }
-  }
-  if (memoryTypeCount) {
-    *memoryTypeCount = count;
-  }
-  return memoryTypes;
-}
-
 uint32_t *getQueuesMatching(VkPhysicalDevice physicalDevice, VkQueueFlags flags,
                             uint32_t *queueCount) {
   static uint32_t queueIds[128];
-  static uint32_t count = 0;
   static VkQueueFamilyProperties properties[128];
-  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &count, properties);
-  for (uint32_t i = 0; i < count; i++) {
+  uint32_t familyCount = 128;
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount,
+                                           properties);
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < familyCount; i++) {
     if ((properties[i].queueFlags & flags) == flags) {
       queueIds[count] = i;
       count++;
@@ -126,47 +365,308 @@ uint32_t *getQueuesMatching(VkPhysicalDevice physicalDevice, VkQueueFlags flags,
   return queueIds;
 }
 
-void SetupCommandBuffer(GraphicsState *state, int frameNumber,
-                        EntityDef *entities, uint32_t entityCount) {
-  vkBeginCommandBuffer(state->commandbuffers[frameNumber],
-                       &(VkCommandBufferBeginInfo){
-                           .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-                       });
-  vkCmdBindPipeline(state->commandbuffers[frameNumber],
-                    VK_PIPELINE_BIND_POINT_GRAPHICS,
-                    state->graphicsPipelines[0]);
+/**
+ * Find a queue family for uploads that can run alongside the graphics queue.
+ * Prefers transfer only families (usually a dedicated DMA engine) over ones
+ * that can also do compute, falls back to graphicsFamily if there is neither.
+ */
+uint32_t getTransferFamily(VkPhysicalDevice physicalDevice,
+                           uint32_t graphicsFamily) {
+  static VkQueueFamilyProperties properties[128];
+  uint32_t familyCount = 128;
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount,
+                                           properties);
+  uint32_t family = graphicsFamily;
+  for (uint32_t i = 0; i < familyCount; i++) {
+    VkQueueFlags flags = properties[i].queueFlags;
+    if (!(flags & VK_QUEUE_TRANSFER_BIT) || (flags & VK_QUEUE_GRAPHICS_BIT)) {
+      continue;
+    }
+    if (!(flags & VK_QUEUE_COMPUTE_BIT)) {
+      return i;
+    }
+    if (family == graphicsFamily) {
+      family = i;
+    }
+  }
+  return family;
+}
+
+/**
+ * Record reducing image's depth buffer, as the draws so far have left it,
+ * into the depth pyramid. Each level holds the furthest depth of the 2x2
+ * texels under it in the level before, so culling can tell whether anything
+ * drawn over part of the screen is nearer than an instance in a few reads.
+ */
+void BuildDepthPyramid(GraphicsState *state, VkCommandBuffer commandBuffer,
+                       uint32_t image) {
+  // renderPass leaves the depth in GENERAL. The last culling pass to read
+  // the pyramid has to be done before it's written over too
+  vkCmdPipelineBarrier(
+      commandBuffer,
+      VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+      &(VkMemoryBarrier){.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                         .srcAccessMask =
+                             VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                         .dstAccessMask = VK_ACCESS_SHADER_READ_BIT},
+      0, NULL, 0, NULL);
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    state->reducePipeline);
+  for (uint32_t l = 0; l < state->depthPyramidLevelCount; l++) {
+    VkDescriptorSet set = l == 0 ? state->reduceSets[image]
+                                 : state->reduceSets[MAX_SWAPCHAIN_IMAGES + l];
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            state->reduceLayout, 0, 1, &set, 0,
+                            VK_NULL_HANDLE);
+    VkExtent2D extent = state->depthPyramidExtents[l];
+    vkCmdDispatch(commandBuffer, (extent.width + 7) / 8,
+                  (extent.height + 7) / 8, 1);
+    vkCmdPipelineBarrier(
+        commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+        &(VkMemoryBarrier){.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                           .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+                           .dstAccessMask = VK_ACCESS_SHADER_READ_BIT},
+        0, NULL, 0, NULL);
+  }
+}
+
+// Run one of culling's passes, and make its draws visible to drawing
+void RecordCullPass(GraphicsState *state, FrameResources *frame,
+                    VkCommandBuffer commandBuffer, bool late) {
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    state->cullPipeline);
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          state->cullLayout, 0, 1, &frame->cullDescriptorSet,
+                          0, VK_NULL_HANDLE);
+  CullConstants constants = {
+      .depthSize = {state->renderArea.width, state->renderArea.height},
+      .late = late,
+      .occlusion = state->occlusionCulling,
+      .arenaDraws = frame->drawCapacity * MODEL_MAX_LODS};
+  // Count, then pack once every level's count is known
+  for (uint32_t scatter = 0; scatter < 2; scatter++) {
+    constants.scatter = scatter;
+    vkCmdPushConstants(commandBuffer, state->cullLayout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullConstants),
+                       &constants);
+    if (late) {
+      vkCmdDispatchIndirect(commandBuffer, frame->retestBuffer, 0);
+    } else {
+      vkCmdDispatchIndirect(
+          commandBuffer, frame->drawBuffer,
+          sizeof(VkDrawIndexedIndirectCommand) * frame->drawCapacity *
+              (1 + MODEL_MAX_LODS * INDEX_ARENAS));
+    }
+    if (!scatter) {
+      vkCmdPipelineBarrier(
+          commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+          &(VkMemoryBarrier){.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                             .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+                             .dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                                              VK_ACCESS_SHADER_WRITE_BIT},
+          0, NULL, 0, NULL);
+    }
+  }
+  // The late pass's draws also write the depth the pyramid was just read
+  // out of
+  vkCmdPipelineBarrier(
+      commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+          VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+          VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+          VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+      0, 1,
+      &(VkMemoryBarrier){.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                         .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+                         .dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+                                          VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT},
+      0, NULL, 0, NULL);
+}
+
+// Begin renderPass (clearing) or loadRenderPass (carrying on) on image
+void BeginScenePass(GraphicsState *state, VkCommandBuffer commandBuffer,
+                    VkRenderPass renderPass, uint32_t image) {
   vkCmdBeginRenderPass(
-      state->commandbuffers[frameNumber],
+      commandBuffer,
       &(VkRenderPassBeginInfo){
           .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-          .renderPass = state->renderPass,
-          .framebuffer = state->framebuffers[frameNumber],
+          .renderPass = renderPass,
+          .framebuffer = state->framebuffers[image],
           .renderArea = {.offset = {0., 0.}, .extent = state->renderArea},
-          .clearValueCount = 2,
+          .clearValueCount = 3,
           .pClearValues =
-              (VkClearValue[2]){{.color = {.float32 = {0., 0., 0., 255.}}},
+              (VkClearValue[3]){{.color = {.float32 = {0., 0., 0., 255.}}},
                                 {.depthStencil =
                                      {
                                          .depth = 1.,
-                                     }}}},
+                                     }},
+                                {.color = {.uint32 = {PICK_NONE}}}}},
       VK_SUBPASS_CONTENTS_INLINE);
-  vkCmdBindDescriptorSets(state->commandbuffers[frameNumber],
-                          VK_PIPELINE_BIND_POINT_GRAPHICS, state->layout, 0, 1,
-                          &state->descriptorSets[frameNumber], 0,
-                          VK_NULL_HANDLE);
-  for (uint32_t i = 0; i < entityCount; i++) {
-    if (entities[i].instanceCount == 0) {
+}
+
+// Draw each index arena's share of draws, the ones culling filled in for
+// one of its passes
+void RecordSceneDraws(GraphicsState *state, FrameResources *frame,
+                      VkCommandBuffer commandBuffer, VkBuffer draws) {
+  uint32_t arenaDraws = frame->drawCapacity * MODEL_MAX_LODS;
+  for (uint32_t a = 0; a < INDEX_ARENAS; a++) {
+    if (!state->indexArenas[a].buffer) {
       continue;
     }
-    vkCmdBindVertexBuffers(state->commandbuffers[frameNumber], 0, 2,
-                           (VkBuffer[2]){entities[i].model.vertexBuffer,
-                                         entities[i].instanceBuffer},
-                           (VkDeviceSize[2]){0, 0});
-    vkCmdDraw(state->commandbuffers[frameNumber], entities[i].model.vertexCount,
-              entities[i].instanceCount, 0, 0);
-  }
-  vkCmdEndRenderPass(state->commandbuffers[frameNumber]);
-  vkEndCommandBuffer(state->commandbuffers[frameNumber]);
+    vkCmdBindIndexBuffer(commandBuffer, state->indexArenas[a].buffer, 0,
+                         a == 0 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32);
+    // gl_DrawID counts from zero again, so it's still the def's draw
+    vkCmdDrawIndexedIndirect(
+        commandBuffer, draws,
+        sizeof(VkDrawIndexedIndirectCommand) * arenaDraws * a, arenaDraws,
+        sizeof(VkDrawIndexedIndirectCommand));
+  }
+}
+
+// The scene pipeline to draw with, waiting for the plain one if it isn't
+// built yet. Wireframe is drawn once it's been built, until then it's the
+// plain one. VK_NULL_HANDLE if even that failed, nothing gets drawn then
+VkPipeline ScenePipeline(GraphicsState *state) {
+  if (state->wireframe) {
+    VkPipeline pipeline =
+        PollPipeline(state->compiler, SCENE_PIPELINE_WIREFRAME);
+    if (pipeline) {
+      return pipeline;
+    }
+  }
+  return WaitForPipeline(state->compiler, SCENE_PIPELINE_FILL);
+}
+
+/**
+ * Record culling and then drawing every def into the frame's command buffer
+ * for image. All defs share the same vertex and instance buffers and are
+ * drawn by one indirect draw per index arena per culling pass, culling fills
+ * in their instance counts from the draws the CPU rewrites every frame. So
+ * this only has to happen again once one of those buffers is replaced.
+ *
+ * Culling's early pass draws what last frame's depth pyramid doesn't hide,
+ * then the pyramid is rebuilt from that and the late pass draws whatever
+ * else turns out not to be hidden after all, see shaders/cull.comp.
+ */
+void SetupCommandBuffer(GraphicsState *state, FrameResources *frame,
+                        uint32_t image) {
+  VkCommandBuffer commandBuffer = frame->commandbuffers[image];
+  vkBeginCommandBuffer(commandBuffer,
+                       &(VkCommandBufferBeginInfo){
+                           .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                       });
+  if (state->timestampPeriod) {
+    vkCmdResetQueryPool(commandBuffer, frame->timestampPool, 0, 2);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        frame->timestampPool, 0);
+  }
+  VkPipeline pipeline = ScenePipeline(state);
+  bool drawing = state->vertexArena.buffer && frame->instanceBuffer &&
+                 frame->drawBuffer && frame->culledBuffer && pipeline;
+  VkDeviceSize drawSize =
+      sizeof(VkDrawIndexedIndirectCommand) * frame->drawCapacity;
+  if (drawing) {
+    VkBufferCopy draws = {.srcOffset = drawSize,
+                          .dstOffset = 0,
+                          .size = drawSize * MODEL_MAX_LODS * INDEX_ARENAS};
+    vkCmdCopyBuffer(commandBuffer, frame->drawBuffer, frame->culledDrawBuffer,
+                    1, &draws);
+    vkCmdCopyBuffer(commandBuffer, frame->drawBuffer, frame->lateDrawBuffer, 1,
+                    &draws);
+    // No late workgroups and nothing to retest yet
+    vkCmdUpdateBuffer(commandBuffer, frame->retestBuffer, 0,
+                      sizeof(uint32_t) * 4, (uint32_t[4]){0, 1, 1, 0});
+    // Also keeps the early pass's reads of the depth pyramid behind the last
+    // frame building it
+    vkCmdPipelineBarrier(
+        commandBuffer,
+        VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+        &(VkMemoryBarrier){.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                           .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT |
+                                            VK_ACCESS_SHADER_WRITE_BIT,
+                           .dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                                            VK_ACCESS_SHADER_WRITE_BIT},
+        0, NULL, 0, NULL);
+    RecordCullPass(state, frame, commandBuffer, false);
+  }
+  if (pipeline) {
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      pipeline);
+  }
+  vkCmdSetViewport(commandBuffer, 0, 1,
+                   &(VkViewport){.width = state->renderArea.width,
+                                 .height = state->renderArea.height,
+                                 .minDepth = 0,
+                                 .maxDepth = 1});
+  vkCmdSetScissor(commandBuffer, 0, 1,
+                  &(VkRect2D){.extent = state->renderArea});
+  BeginScenePass(state, commandBuffer, state->renderPass, image);
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          state->layout, 0, 1, &frame->descriptorSet, 0,
+                          VK_NULL_HANDLE);
+  if (drawing) {
+    vkCmdBindVertexBuffers(
+        commandBuffer, 0, 2,
+        (VkBuffer[2]){state->vertexArena.buffer, frame->culledBuffer},
+        (VkDeviceSize[2]){0, 0});
+    RecordSceneDraws(state, frame, commandBuffer, frame->culledDrawBuffer);
+  }
+  vkCmdEndRenderPass(commandBuffer);
+  if (drawing) {
+    BuildDepthPyramid(state, commandBuffer, image);
+    RecordCullPass(state, frame, commandBuffer, true);
+  }
+  BeginScenePass(state, commandBuffer, state->loadRenderPass, image);
+  if (drawing) {
+    RecordSceneDraws(state, frame, commandBuffer, frame->lateDrawBuffer);
+  }
+  vkCmdEndRenderPass(commandBuffer);
+  if (state->dumpDirectory) {
+    // loadRenderPass left the colour for copying out, behind its writes
+    vkCmdCopyImageToBuffer(
+        commandBuffer, state->swapchainImages[image],
+        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, frame->dumpBuffer, 1,
+        &(VkBufferImageCopy){
+            .imageSubresource = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                 .mipLevel = 0,
+                                 .baseArrayLayer = 0,
+                                 .layerCount = 1},
+            .imageExtent = {state->renderArea.width, state->renderArea.height,
+                            1}});
+    vkCmdPipelineBarrier(
+        commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_HOST_BIT, 0, 1,
+        &(VkMemoryBarrier){.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                           .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                           .dstAccessMask = VK_ACCESS_HOST_READ_BIT},
+        0, NULL, 0, NULL);
+  }
+  if (state->timestampPeriod) {
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        frame->timestampPool, 1);
+  }
+  vkEndCommandBuffer(commandBuffer);
+}
+
+/**
+ * Milliseconds the GPU took over the frame's last command buffer, from its
+ * timestamps. The frame has to have been waited on. Returns a negative time
+ * if the queue can't write timestamps or the frame hasn't drawn yet.
+ */
+double FrameGpuTime(GraphicsState *state, FrameResources *frame) {
+  uint64_t timestamps[2];
+  if (state->timestampPeriod == 0 ||
+      vkGetQueryPoolResults(state->device, frame->timestampPool, 0, 2,
+                            sizeof(timestamps), timestamps, sizeof(uint64_t),
+                            VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+    return -1;
+  }
+  return (timestamps[1] - timestamps[0]) * state->timestampPeriod / 1e6;
 }
 
 VkShaderModule LoadShaderFromFile(VkDevice device, char *filepath) {
@@ -191,47 +691,13 @@ VkShaderModule LoadShaderFromFile(VkDevice device, char *filepath) {
   return module;
 }
 
-void CreateBuffer(VkDevice device, VkPhysicalDevice physical, size_t size,
-                  VkMemoryPropertyFlagBits memoryFlags,
-                  VkBufferUsageFlagBits usageFlags, VkBuffer *buffer,
-                  VkDeviceMemory *memory) {
-  VkPhysicalDeviceMemoryProperties properties;
-  vkGetPhysicalDeviceMemoryProperties(physical, &properties);
-  uint32_t memoryIndex = 0;
-  for (memoryIndex = 0; memoryIndex < properties.memoryTypeCount;
-       memoryIndex++) {
-    if ((properties.memoryTypes[memoryIndex].propertyFlags & memoryFlags) ==
-        memoryFlags) {
-      break;
-    }
-  }
-  vkAllocateMemory(
-      device,
-      &(VkMemoryAllocateInfo){.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-                              .allocationSize = size,
-                              .memoryTypeIndex = memoryIndex},
-      NULL, memory);
-  vkCreateBuffer(device,
-                 &(VkBufferCreateInfo){
-                     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-                     .size = size,
-                     .usage = usageFlags,
-                     .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-                     .queueFamilyIndexCount = 1,
-                     .pQueueFamilyIndices =
-                         getQueuesMatching(physical, VK_QUEUE_TRANSFER_BIT, 0)},
-                 NULL, buffer);
-  vkBindBufferMemory(device, *buffer, *memory, 0);
-}
-
 void UpdateInputState(GraphicsState *state) {
 
   state->input->windowSize[0] = state->renderArea.width;
   state->input->windowSize[1] = state->renderArea.height;
-  if (state->input->frameId == 15) {
-    state->input->frameId = 1;
-  } else {
-    state->input->frameId++;
+  if (!state->window) {
+    // Headless, the mouse stays where it started
+    return;
   }
 
   // Buttons
@@ -258,111 +724,103 @@ void UpdateInputState(GraphicsState *state) {
 }
 
 /**
- * Upload a correctly formed Model to the graphics card.
- * Will create a buffer, and load vertices onto it, success
- * will return code 0.
- *
- * Only one model may be loaded at a time, attempting to load two models
- * syncronously will attempt to block for 1000 milliseconds and then return
- * the code 1.
+ * Hand a buffer over to be destroyed once every frame that might have bound
+ * it has made its way through the GPU.
  */
-uint32_t UploadModel(GraphicsState *state, Model *model) {
-  VkCommandBuffer commandBuffer;
-  vkAllocateCommandBuffers(
-      state->device,
-      &(VkCommandBufferAllocateInfo){
-          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-          .commandPool = state->commandPool,
-          .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-          .commandBufferCount = 1},
-      &commandBuffer);
-  VkQueue queue;
-  vkGetDeviceQueue(
-      state->device,
-      getQueuesMatching(state->physicalDevice, VK_QUEUE_TRANSFER_BIT, 0)[0], 0,
-      &queue);
-  CreateBuffer(
-      state->device, state->physicalDevice, model->vertexCount * sizeof(Vertex),
-      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-      VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-      &model->vertexBuffer, &model->vertexMemory);
-
-  void *pp;
-  vkMapMemory(state->device, state->stagingMemory, 0, VK_WHOLE_SIZE, 0, &pp);
-  memcpy(pp, model->vertices, sizeof(Vertex) * model->vertexCount);
-  vkUnmapMemory(state->device, state->stagingMemory);
-  vkBeginCommandBuffer(
-      commandBuffer, &(VkCommandBufferBeginInfo){
-                         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO});
-  vkCmdCopyBuffer(commandBuffer, state->stagingBuffer, model->vertexBuffer, 1,
-                  &(VkBufferCopy){.srcOffset = 0,
-                                  .dstOffset = 0,
-                                  .size = sizeof(Vertex) * model->vertexCount});
-  vkEndCommandBuffer(commandBuffer);
-  vkQueueSubmit(queue, 1,
-                &(VkSubmitInfo){.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-                                .waitSemaphoreCount = 0,
-                                .commandBufferCount = 1,
-                                .pCommandBuffers = &commandBuffer,
-                                .signalSemaphoreCount = 0},
-                state->stagingFence);
-  uint32_t res = vkGetFenceStatus(state->device, state->stagingFence);
-  res = vkWaitForFences(state->device, 1, &state->stagingFence, 1, 1000000);
-  if (res == VK_TIMEOUT) {
-    printf("Timed out waiting for model loading fence to signal\n");
-    return 1;
+void RetireBuffer(GraphicsState *state, VkBuffer buffer,
+                  GpuAllocation *memory) {
+  if (state->retiredCount == state->maxRetired) {
+    state->maxRetired = state->maxRetired ? state->maxRetired * 2 : 16;
+    state->retiredBuffers = realloc(state->retiredBuffers,
+                                    sizeof(RetiredBuffer) * state->maxRetired);
   }
-  vkResetFences(state->device, 1, &state->stagingFence);
-  return 0;
+  state->retiredBuffers[state->retiredCount++] = (RetiredBuffer){
+      .buffer = buffer, .memory = *memory, .frame = state->frameCount};
 }
 
-uint32_t CreateEntityDef(GraphicsState *state, Model *model) {
-  if (state->maxEntities < state->entityCount + 1) {
-    state->maxEntities = state->maxEntities + 512;
-    // TODO: Hm this looks very thread safe
-    state->entities =
-        realloc(state->entities, sizeof(EntityDef) * state->maxEntities);
-  }
-  state->entities[state->entityCount] = (EntityDef){
-      .model = *model,
-      .instances = calloc(64, sizeof(Instance)),
-      .dirtyBuffer = calloc(64, sizeof(bool)),
-      .maxInstances = 64,
-  };
-  UploadModel(state, &state->entities[state->entityCount].model);
-  return state->entityCount++;
+// Destroy retired buffers no frame in flight can still be reading from
+void ReleaseRetiredBuffers(GraphicsState *state) {
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < state->retiredCount; i++) {
+    RetiredBuffer *retired = &state->retiredBuffers[i];
+    // The frame that last used it has been waited on
+    if (state->frameCount >= retired->frame + MAX_FRAMES_IN_FLIGHT) {
+      DestroyBuffer(&state->allocator, retired->buffer, &retired->memory);
+    } else {
+      state->retiredBuffers[kept++] = *retired;
+    }
+  }
+  state->retiredCount = kept;
 }
 
-uint32_t AddEntityInstance(EntityDef *entity, Instance instance) {
-  static uint32_t instanceId = 0;
-  instance.instanceId = instanceId++;
+// Instance ids handed out so far, every instance's id is below this
+uint32_t instanceIdCount = 0;
 
-  if (entity->maxInstances > entity->instanceCount) {
-    entity->maxInstances = entity->maxInstances + 64;
-    entity->instances =
-        realloc(entity->instances, sizeof(Instance) * entity->maxInstances);
-    entity->dirtyBuffer =
-        realloc(entity->dirtyBuffer, sizeof(Instance) * entity->maxInstances);
+/**
+ * Select every instance in the box being dragged out with the left button,
+ * the selection stays as it was once the button is let go. Each frame picks
+ * the change up in WriteFrameSelection.
+ */
+void UpdateSelection(GraphicsState *state) {
+  if ((state->input->mouseButtons & 2) == 0) {
+    return;
   }
-  entity->instances[entity->instanceCount] = instance;
-  entity->dirtyBuffer[entity->instanceCount] = true;
-  return entity->instanceCount++;
+  SelectionView selectionView;
+  SelectionViewFromCamera(state->camera->view, state->camera->proj,
+                          state->input->windowSize, state->input->mouse,
+                          &selectionView);
+  SelectEntities(&selectionView, state->entities, state->entityCount,
+                 &state->selected);
+  state->selectionVersion++;
 }
 
-// Allocate and update all the instance data for all entities
-// Also update uniform buffer for camera data
-// Returns 1 if still syncing, 0 if success
-// TODO: This is kinda shitty and looks nothing like I envisioned it to
-uint32_t UpdateGraphicsMemory(GraphicsState *state) {
-  // Wait for (potential) last update to finis
-  if (!state->entitySyncFence) {
-    vkCreateFence(
-        state->device,
-        &(VkFenceCreateInfo){.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO},
-        NULL, &state->entitySyncFence);
+/**
+ * Lay the selection out in the frame's own selection buffer, if it has
+ * changed since the frame last did. The bits cover every instance id, so
+ * the buffer only outgrows itself as instances are added or more of them
+ * get selected than ever before. It's then replaced by one twice the size,
+ * which leaves the frame's command buffers needing re-recording. The frame
+ * must have been waited on.
+ */
+void WriteFrameSelection(GraphicsState *state, FrameResources *frame) {
+  if (frame->selectionVersion == state->selectionVersion) {
+    return;
+  }
+  uint32_t wordCount = SelectionWords(instanceIdCount);
+  size_t size = SelectionBufferSize(wordCount, state->selected.count);
+  if (size > frame->selectionSize) {
+    size_t capacity = frame->selectionSize;
+    while (capacity < size) {
+      capacity *= 2;
+    }
+    VkBuffer buffer;
+    GpuAllocation memory;
+    if (CreateBuffer(&state->allocator, capacity,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &buffer, &memory)) {
+      fprintf(stderr, "Failed to grow selection buffer to %zu bytes\n",
+              capacity);
+      return;
+    }
+    DestroyBuffer(&state->allocator, frame->selectionBuffer,
+                  &frame->selectionMemory);
+    frame->selectionBuffer = buffer;
+    frame->selectionMemory = memory;
+    frame->selectionSize = capacity;
+    frame->commandBufferDirty = true;
   }
-  // Reset command buffer/create new command buffer
-  if (!state->entitySyncCommandBuffer) {
+  WriteSelectionBuffer(&state->selected, wordCount,
+                       frame->selectionMemory.mapped);
+  frame->selectionVersion = state->selectionVersion;
+}
+
+/**
+ * Make the graphics queue wait for the transfer queue to reach landed before
+ * it draws anything else.
+ */
+void AwaitUploads(GraphicsState *state, uint64_t landed) {
+  if (!state->uploadWaitCommandBuffer) {
     vkAllocateCommandBuffers(
         state->device,
         &(VkCommandBufferAllocateInfo){
@@ -370,136 +828,1198 @@ uint32_t UpdateGraphicsMemory(GraphicsState *state) {
             .commandPool = state->commandPool,
             .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
             .commandBufferCount = 1},
-        &state->entitySyncCommandBuffer);
-  } else {
-    vkResetCommandBuffer(state->entitySyncCommandBuffer, 0);
+        &state->uploadWaitCommandBuffer);
   }
+  // Models are uploaded rarely enough that waiting on the last one of these
+  // is fine
+  WaitTimeline(state->graphicsTimeline, state->uploadWaitSubmitted);
+  VkCommandBuffer commandBuffer = state->uploadWaitCommandBuffer;
+  vkResetCommandBuffer(commandBuffer, 0);
   vkBeginCommandBuffer(
-      state->entitySyncCommandBuffer,
+      commandBuffer,
       &(VkCommandBufferBeginInfo){
-          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO});
-  // Iterate over entity defs
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+          .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT});
+  // Chains onto the semaphore wait so every later submission on the queue
+  // sees the uploads too
+  vkCmdPipelineBarrier(
+      commandBuffer, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+      VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1,
+      &(VkMemoryBarrier){.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                         .dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+                                          VK_ACCESS_INDEX_READ_BIT},
+      0, NULL, 0, NULL);
+  vkEndCommandBuffer(commandBuffer);
+  TimelineWait uploads = TimelineDependency(
+      state->transferTimeline, landed, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT);
+  uint64_t submitted = SubmitTimeline(state->graphicsTimeline, &commandBuffer,
+                                      1, &uploads, 1, VK_NULL_HANDLE);
+  if (submitted) {
+    state->uploadWaitSubmitted = submitted;
+  }
+}
+
+/**
+ * Reserve size bytes at the end of arena, writing their offset to offset.
+ * A full arena is replaced by one twice the size and its contents copied
+ * over on the transfer queue ahead of the uploads that follow. Returns 0 on
+ * success.
+ */
+uint32_t ReserveArena(GraphicsState *state, GeometryArena *arena,
+                      VkDeviceSize size, VkDeviceSize *offset) {
+  if (arena->used + size > arena->size) {
+    VkDeviceSize capacity = arena->size ? arena->size : MIN_ARENA_SIZE;
+    while (capacity < arena->used + size) {
+      capacity *= 2;
+    }
+    VkBuffer buffer;
+    GpuAllocation memory;
+    // Written on the transfer queue while the graphics queue draws from the
+    // parts already filled, so shared rather than owned by either
+    if (CreateSharedBuffer(&state->allocator, capacity,
+                           VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                           arena->usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                               VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                           2,
+                           (uint32_t[2]){state->graphicsFamily,
+                                         state->transferFamily},
+                           &buffer, &memory)) {
+      fprintf(stderr, "Failed to grow geometry arena to %" PRIu64 " bytes\n",
+              capacity);
+      return 1;
+    }
+    if (arena->buffer) {
+      StagingCopy(&state->staging, arena->buffer, buffer, arena->used);
+      RetireBuffer(state, arena->buffer, &arena->memory);
+    }
+    arena->buffer = buffer;
+    arena->memory = memory;
+    arena->size = capacity;
+    state->commandBufferDirty = true;
+  }
+  *offset = arena->used;
+  arena->used += size;
+  return 0;
+}
+
+// Which of the index arenas indices of indexType go in
+uint32_t IndexArena(VkIndexType indexType) {
+  return indexType == VK_INDEX_TYPE_UINT16 ? 0 : 1;
+}
+
+/**
+ * Upload correctly formed Models to the graphics card.
+ * Each is appended to the shared vertex arena and the index arena for its
+ * index type and streamed onto them through the staging ring, success will
+ * return code 0.
+ *
+ * Doesn't block, the copies run on the transfer queue batched into as few
+ * submissions as the staging ring allows, and the graphics queue waits for
+ * them before drawing.
+ */
+uint32_t UploadModels(GraphicsState *state, Model *models, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    Model *model = &models[i];
+    GeometryArena *indexArena =
+        &state->indexArenas[IndexArena(model->indexType)];
+    size_t vertexSize = sizeof(GpuVertex) * model->vertexCount;
+    size_t indexSize = IndexSize(model->indexType) * model->indexCount;
+    VkDeviceSize vertexOffset, indexOffset;
+    if (ReserveArena(state, &state->vertexArena, vertexSize, &vertexOffset) ||
+        ReserveArena(state, indexArena, indexSize, &indexOffset)) {
+      // The models staged so far still have to be seen through
+      uint64_t landed;
+      FinishStaging(&state->staging, &landed);
+      AwaitUploads(state, landed);
+      return 1;
+    }
+    model->firstVertex = vertexOffset / sizeof(GpuVertex);
+    model->firstIndex = indexOffset / IndexSize(model->indexType);
+    // Indices stay relative to the model's first vertex
+    if (StagingUpload(&state->staging, state->vertexArena.buffer,
+                      vertexOffset, model->vertices, vertexSize) ||
+        StagingUpload(&state->staging, indexArena->buffer, indexOffset,
+                      model->indices, indexSize)) {
+      break;
+    }
+  }
+  uint64_t landed;
+  uint32_t failed = FinishStaging(&state->staging, &landed);
+  AwaitUploads(state, landed);
+  if (failed) {
+    fprintf(stderr, "Failed to submit model uploads\n");
+  }
+  return failed;
+}
+
+uint32_t UploadModel(GraphicsState *state, Model *model) {
+  return UploadModels(state, model, 1);
+}
+
+/**
+ * Create an EntityDef for each of models, uploading them all in as few
+ * transfers as possible. The ids of the new EntityDefs are written to ids.
+ * The models stay with the caller, free them with FreeModel afterwards.
+ * Returns 0 on success. On failure no def is created and every id is
+ * UINT32_MAX.
+ */
+uint32_t CreateEntityDefs(GraphicsState *state, Model *models, uint32_t count,
+                          uint32_t *ids) {
+  for (uint32_t i = 0; i < count; i++) {
+    ids[i] = UINT32_MAX;
+  }
+  if (state->maxEntities < state->entityCount + count) {
+    size_t maxEntities = state->entityCount + count + 512;
+    VkBuffer buffer;
+    GpuAllocation memory;
+    if (CreateBuffer(&state->allocator, sizeof(DrawInfo) * maxEntities,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &buffer, &memory)) {
+      fprintf(stderr, "Failed to grow draw info to %zu defs\n", maxEntities);
+      return 1;
+    }
+    // TODO: Hm this looks very thread safe
+    state->entities = realloc(state->entities, sizeof(EntityDef) * maxEntities);
+    state->maxEntities = maxEntities;
+    memcpy(memory.mapped, state->drawInfoMemory.mapped,
+           sizeof(DrawInfo) * state->entityCount);
+    RetireBuffer(state, state->drawInfoBuffer, &state->drawInfoMemory);
+    state->drawInfoBuffer = buffer;
+    state->drawInfoMemory = memory;
+    state->commandBufferDirty = true;
+  }
+  // Their place in the arenas would be garbage
+  if (UploadModels(state, models, count)) {
+    fprintf(stderr, "Failed to upload %d models\n", count);
+    return 1;
+  }
+  DrawInfo *drawInfo = state->drawInfoMemory.mapped;
+  for (uint32_t i = 0; i < count; i++) {
+    // Frames in flight never draw past their entityCount, so appending
+    // doesn't race them
+    glm_vec4_copy(models[i].positionScale,
+                  drawInfo[state->entityCount].positionScale);
+    glm_vec4_copy(models[i].positionBias,
+                  drawInfo[state->entityCount].positionBias);
+    glm_vec4_copy(models[i].bounds.sphere,
+                  drawInfo[state->entityCount].sphere);
+    for (uint32_t l = 0; l < MODEL_MAX_LODS; l++) {
+      drawInfo[state->entityCount].lodError[l] =
+          l < models[i].lodCount ? models[i].lods[l].error : FLT_MAX;
+    }
+    drawInfo[state->entityCount].indexArena =
+        IndexArena(models[i].indexType);
+    // The def only keeps the description of the model, not its CPU data
+    state->entities[state->entityCount] = (EntityDef){.model = models[i]};
+    Model *model = &state->entities[state->entityCount].model;
+    model->vertices = NULL;
+    model->indices = NULL;
+    model->submeshes = NULL;
+    model->submeshCount = 0;
+    model->cacheMapping = NULL;
+    ids[i] = state->entityCount++;
+  }
+  return 0;
+}
+
+// The id of a new EntityDef for model, UINT32_MAX if it couldn't be created
+uint32_t CreateEntityDef(GraphicsState *state, Model *model) {
+  uint32_t id;
+  CreateEntityDefs(state, model, 1, &id);
+  return id;
+}
+
+/**
+ * Add an instance of entity, giving it the next instance id. Remove it again
+ * with RemoveInstance on the entity's instances.
+ */
+InstanceHandle AddEntityInstance(EntityDef *entity, vec3 position,
+                                 versor orientation, vec3 scale) {
+  return AddInstance(&entity->instances, position, orientation, scale,
+                     instanceIdCount++);
+}
+
+// Create a device local instance buffer count instances long
+uint32_t CreateInstanceBuffer(GraphicsState *state, uint32_t count,
+                              VkBuffer *buffer, GpuAllocation *memory) {
+  // Written on the transfer queue and read on the graphics queue, cheaper to
+  // share than to transfer ownership back and forth
+  if (CreateSharedBuffer(&state->allocator, sizeof(Instance) * count,
+                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                         VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                             VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                             VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                         2,
+                         (uint32_t[2]){state->graphicsFamily,
+                                       state->transferFamily},
+                         buffer, memory)) {
+    fprintf(stderr, "Failed to create instance buffer of %d instances\n",
+            count);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Make sure the range of every def in the instance buffers can hold all of
+ * its instances. If any has been outrun the ranges are laid out again,
+ * doubling the ones that ran out, in a new buffer for frame the instances in
+ * source are copied across to on the device, and the frame's old buffer is
+ * retired. The other frames pick the new layout up once they come around.
+ * Returns true if the frame's buffer was replaced.
+ */
+bool LayoutInstances(GraphicsState *state, FrameResources *frame,
+                     VkCommandBuffer commandBuffer, VkBuffer source) {
+  bool outrun = false;
+  for (uint32_t t = 0; t < state->entityCount; t++) {
+    if (state->entities[t].instances.count > state->entities[t].gpuInstances) {
+      outrun = true;
+    }
+  }
+  if (!outrun) {
+    return false;
+  }
+  uint32_t total = 0;
+  uint32_t *capacities = malloc(sizeof(uint32_t) * state->entityCount);
+  for (uint32_t t = 0; t < state->entityCount; t++) {
+    EntityDef *def = &state->entities[t];
+    uint32_t capacity = def->gpuInstances;
+    if (def->instances.count > capacity) {
+      capacity = capacity ? capacity : MIN_GPU_INSTANCES;
+      while (capacity < def->instances.count) {
+        capacity *= 2;
+      }
+    }
+    capacities[t] = capacity;
+    total += capacity;
+  }
+  VkBuffer buffer;
+  GpuAllocation memory;
+  if (CreateInstanceBuffer(state, total, &buffer, &memory)) {
+    free(capacities);
+    return false;
+  }
+  uint32_t first = 0;
   for (uint32_t t = 0; t < state->entityCount; t++) {
     EntityDef *def = &state->entities[t];
-    // Setup entity def's instance buffer if necessary
-    if (!def->instanceBuffer) {
-      CreateBuffer(state->device, state->physicalDevice, sizeof(Instance) * 64,
-                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                   VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-                       VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-                   &def->instanceBuffer, &def->instanceMemory);
+    if (source && def->gpuInstances > 0) {
+      vkCmdCopyBuffer(
+          commandBuffer, source, buffer, 1,
+          &(VkBufferCopy){.srcOffset = sizeof(Instance) * def->firstInstance,
+                          .dstOffset = sizeof(Instance) * first,
+                          .size = sizeof(Instance) * def->gpuInstances});
+    }
+    def->firstInstance = first;
+    def->gpuInstances = capacities[t];
+    first += capacities[t];
+  }
+  free(capacities);
+  // Another frame's upload may still be reading it
+  if (frame->instanceBuffer) {
+    RetireBuffer(state, frame->instanceBuffer, &frame->instanceMemory);
+  }
+  frame->instanceBuffer = buffer;
+  frame->instanceMemory = memory;
+  frame->instanceCapacity = total;
+  state->instanceCapacity = total;
+  return true;
+}
+
+// Write count instances of store from first on out to packed, the way the
+// shaders read them
+void PackInstances(InstanceStore *store, uint32_t first, uint32_t count,
+                   Instance *packed) {
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t index = first + i;
+    Instance *instance = &packed[i];
+    memcpy(instance->position, store->positions[index], sizeof(float) * 3);
+    instance->instanceId = store->ids[index];
+    memcpy(instance->scale, store->scales[index], sizeof(float) * 3);
+    PackOrientation(store->orientations[index], instance->orientation);
+  }
+}
+
+// Queue up a copy of count instances starting at first in the instance
+// buffer, out of the upload region at uploadOffset
+void AddInstanceCopy(GraphicsState *state, uint32_t *copyCount,
+                     VkDeviceSize uploadOffset, uint32_t first,
+                     uint32_t count) {
+  if (*copyCount == state->maxInstanceCopies) {
+    state->maxInstanceCopies =
+        state->maxInstanceCopies ? state->maxInstanceCopies * 2 : 64;
+    state->instanceCopies =
+        realloc(state->instanceCopies,
+                sizeof(VkBufferCopy) * state->maxInstanceCopies);
+  }
+  state->instanceCopies[(*copyCount)++] =
+      (VkBufferCopy){.srcOffset = uploadOffset,
+                     .dstOffset = sizeof(Instance) * first,
+                     .size = sizeof(Instance) * count};
+}
+
+/**
+ * Write the dirty instance data of all entities into the frame's upload
+ * region and record the copies onto the frame's instance buffer into its
+ * upload command buffer, which goes to the transfer queue ahead of the draw.
+ * A frame that fell behind the others first copies the latest instances over
+ * on the device, and the ranges are laid out again on the way if any def has
+ * outrun its range. Sets frame->uploading if anything was recorded.
+ *
+ * The frame must have been waited on, returns 0 on success.
+ */
+uint32_t UpdateGraphicsMemory(GraphicsState *state, FrameResources *frame) {
+  // Whatever was recorded last time has been submitted already, and may read
+  // an upload region that's about to be destroyed
+  frame->uploading = false;
+  // Size the upload region to fit every instance so it can never overflow
+  VkDeviceSize uploadSize = 0;
+  for (uint32_t t = 0; t < state->entityCount; t++) {
+    uploadSize += sizeof(Instance) * state->entities[t].instances.count;
+  }
+  if (uploadSize > frame->uploadSize) {
+    VkDeviceSize size = frame->uploadSize;
+    if (size == 0) {
+      size = sizeof(Instance) * MIN_GPU_INSTANCES;
     }
-    int32_t start = -1;
-    for (uint32_t i = 0; i < def->instanceCount; i++) {
-      if (def->dirtyBuffer[i] && start == -1) {
-        start = i;
+    while (size < uploadSize) {
+      size *= 2;
+    }
+    if (frame->uploadBuffer) {
+      DestroyBuffer(&state->allocator, frame->uploadBuffer,
+                    &frame->uploadMemory);
+    }
+    if (CreateBuffer(&state->allocator, size,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT, &frame->uploadBuffer,
+                     &frame->uploadMemory)) {
+      fprintf(stderr, "Failed to create instance upload region\n");
+      frame->uploadBuffer = VK_NULL_HANDLE;
+      frame->uploadSize = 0;
+      return 1;
+    }
+    frame->uploadSize = size;
+  }
+  // A frame that fell behind has to catch up on a buffer of the current
+  // layout, unless it's about to get a new one anyway
+  bool stale = frame->instanceVersion != state->instanceVersion;
+  bool outrun = false;
+  for (uint32_t t = 0; t < state->entityCount; t++) {
+    if (state->entities[t].instances.count > state->entities[t].gpuInstances) {
+      outrun = true;
+    }
+  }
+  if (stale && !outrun && frame->instanceCapacity < state->instanceCapacity) {
+    if (frame->instanceBuffer) {
+      RetireBuffer(state, frame->instanceBuffer, &frame->instanceMemory);
+    }
+    frame->instanceBuffer = VK_NULL_HANDLE;
+    frame->instanceCapacity = 0;
+    frame->commandBufferDirty = true;
+    // Left without instances, the frame draws nothing until it has some
+    if (CreateInstanceBuffer(state, state->instanceCapacity,
+                             &frame->instanceBuffer, &frame->instanceMemory)) {
+      frame->instanceBuffer = VK_NULL_HANDLE;
+      return 1;
+    }
+    frame->instanceCapacity = state->instanceCapacity;
+  }
+  uint32_t frameIndex = frame - state->frames;
+  VkBuffer source = VK_NULL_HANDLE;
+  if (state->latestInstances != UINT32_MAX) {
+    source = state->frames[state->latestInstances].instanceBuffer;
+  }
+
+  VkCommandBuffer commandBuffer = frame->uploadCommandBuffer;
+  vkResetCommandBuffer(commandBuffer, 0);
+  vkBeginCommandBuffer(
+      commandBuffer,
+      &(VkCommandBufferBeginInfo){
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+          .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT});
+  // The latest copy was written by an earlier upload on this same queue
+  VkMemoryBarrier copied = {.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                            .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT |
+                                             VK_ACCESS_TRANSFER_WRITE_BIT};
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &copied, 0, NULL,
+                       0, NULL);
+  // Move the instances into bigger ranges first, or bring a frame that fell
+  // behind up to date. The copies have to land before the updates below
+  // write over them
+  bool changed = false;
+  if (LayoutInstances(state, frame, commandBuffer, source)) {
+    state->commandBufferDirty = true;
+    frame->uploading = true;
+    changed = true;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &copied, 0,
+                         NULL, 0, NULL);
+  } else if (stale && source && source != frame->instanceBuffer &&
+             state->instanceCapacity > 0) {
+    vkCmdCopyBuffer(
+        commandBuffer, source, frame->instanceBuffer, 1,
+        &(VkBufferCopy){.size = sizeof(Instance) * state->instanceCapacity});
+    frame->uploading = true;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &copied, 0,
+                         NULL, 0, NULL);
+  }
+  char *mapped = frame->uploadMemory.mapped;
+  VkDeviceSize offset = 0;
+  for (uint32_t t = 0; t < state->entityCount; t++) {
+    EntityDef *def = &state->entities[t];
+    uint32_t copyCount = 0;
+    uint32_t first, count;
+    // Instances past the def's range, if growing it failed, are marked dirty
+    // again once the ranges are through so they go up after a grow succeeds
+    uint32_t cutFirst = UINT32_MAX, cutEnd = 0;
+    while (NextDirtyRange(&def->instances, INSTANCE_COALESCE_GAP, &first,
+                          &count)) {
+      if (first + count > def->gpuInstances) {
+        uint32_t fits = first < def->gpuInstances ? def->gpuInstances - first
+                                                  : 0;
+        cutFirst = first + fits < cutFirst ? first + fits : cutFirst;
+        cutEnd = first + count;
+        count = fits;
       }
-      if ((i == (def->instanceCount - 1) || !def->dirtyBuffer[i]) &&
-          start != -1) {
-        vkCmdUpdateBuffer(state->entitySyncCommandBuffer, def->instanceBuffer,
-                          sizeof(Instance) * start,
-                          (i + 1 - start) * sizeof(Instance),
-                          &def->instances[start]);
-        start = -1;
+      if (count == 0) {
+        continue;
       }
-      def->dirtyBuffer[i] = false;
+      PackInstances(&def->instances, first, count,
+                    (Instance *)(mapped + offset));
+      AddInstanceCopy(state, &copyCount, offset, def->firstInstance + first,
+                      count);
+      offset += sizeof(Instance) * count;
+    }
+    if (cutFirst < cutEnd) {
+      MarkInstancesDirty(&def->instances, cutFirst, cutEnd - cutFirst);
+    }
+    if (copyCount > 0) {
+      vkCmdCopyBuffer(commandBuffer, frame->uploadBuffer, frame->instanceBuffer,
+                      copyCount, state->instanceCopies);
+      frame->uploading = true;
+      changed = true;
     }
   }
-  vkEndCommandBuffer(state->entitySyncCommandBuffer);
-  VkQueue queue;
-  // TODO: We're probably doubling up our transfers on the graphics queue
-  vkGetDeviceQueue(
-      state->device,
-      getQueuesMatching(state->physicalDevice, VK_QUEUE_TRANSFER_BIT, 0)[0], 0,
-      &queue);
-  // Submit updates
-  vkQueueSubmit(
-      queue, 1,
-      &(VkSubmitInfo){.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-                      .commandBufferCount = 1,
-                      .pCommandBuffers = &state->entitySyncCommandBuffer},
-      state->entitySyncFence);
-  VkResult res = vkWaitForFences(state->device, 1, &state->entitySyncFence,
-                                 VK_TRUE, 10000000);
-  if (res == VK_TIMEOUT) {
-    printf("Timed out waiting for graphics update fence\n");
-    return 1;
+  // Every other frame catches up off this one's copy when it comes around
+  if (changed) {
+    state->instanceVersion++;
+    state->latestInstances = frameIndex;
   }
-  vkResetFences(state->device, 1, &state->entitySyncFence);
+  frame->instanceVersion = state->instanceVersion;
+  // The draw reading the buffer waits on the submission, and the draw that
+  // read it last was waited on before the frame came around
+  vkEndCommandBuffer(commandBuffer);
   return 0;
 }
 
-void CreateRenderState(GraphicsState *state) {
+/**
+ * Forget which frame holds the latest instances after an upload didn't make
+ * it to the GPU, every instance goes up again with the next frame's upload.
+ */
+void ResendInstances(GraphicsState *state) {
+  for (uint32_t t = 0; t < state->entityCount; t++) {
+    InstanceStore *instances = &state->entities[t].instances;
+    MarkInstancesDirty(instances, 0, instances->count);
+  }
+  state->latestInstances = UINT32_MAX;
+  state->instanceVersion++;
+}
 
-  VkSurfaceCapabilitiesKHR capabilites;
-  vkGetPhysicalDeviceSurfaceCapabilitiesKHR(state->physicalDevice,
-                                            state->surface, &capabilites);
-  state->renderArea = capabilites.maxImageExtent;
-  uint32_t count;
-  vkGetPhysicalDeviceSurfaceFormatsKHR(state->physicalDevice, state->surface,
-                                       &count, 0);
-  VkSurfaceFormatKHR *formats = calloc(count, sizeof(VkSurfaceFormatKHR));
-  vkGetPhysicalDeviceSurfaceFormatsKHR(state->physicalDevice, state->surface,
-                                       &count, formats);
-  vkGetPhysicalDeviceSurfacePresentModesKHR(state->physicalDevice,
-                                            state->surface, &count, 0);
-  VkBool32 supported;
-  vkGetPhysicalDeviceSurfaceSupportKHR(
-      state->physicalDevice,
-      *getQueuesMatching(state->physicalDevice, VK_QUEUE_GRAPHICS_BIT, 0),
-      state->surface, &supported);
-  if (!supported) {
-    fprintf(stderr, "Surface does not support swapchain! I dont know why :(\n");
-    exit(1);
+// Block until no frame is left in flight
+void WaitForFrames(GraphicsState *state) {
+  DrainTimeline(state->graphicsTimeline);
+}
+
+// Destroy whichever of the frame's draw buffers exist
+void DestroyDrawBuffers(GraphicsState *state, FrameResources *frame) {
+  VkBuffer *buffers[3] = {&frame->drawBuffer, &frame->culledDrawBuffer,
+                          &frame->lateDrawBuffer};
+  GpuAllocation *memories[3] = {&frame->drawMemory, &frame->culledDrawMemory,
+                                &frame->lateDrawMemory};
+  for (uint32_t i = 0; i < 3; i++) {
+    if (*buffers[i]) {
+      DestroyBuffer(&state->allocator, *buffers[i], memories[i]);
+      *buffers[i] = VK_NULL_HANDLE;
+    }
   }
-  vkCreateSwapchainKHR(
-      state->device,
-      &(VkSwapchainCreateInfoKHR){
-          .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
-          .surface = state->surface,
-          .minImageCount = capabilites.minImageCount,
-          .imageFormat = formats[0].format,
-          .imageColorSpace = formats[0].colorSpace,
-          .imageExtent = capabilites.currentExtent,
-          .imageArrayLayers = 1,
-          .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-          .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
-          .queueFamilyIndexCount = 1,
-          .pQueueFamilyIndices = getQueuesMatching(state->physicalDevice,
-                                                   VK_QUEUE_GRAPHICS_BIT, 0),
-          .preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
-          .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
-          .presentMode = VK_PRESENT_MODE_IMMEDIATE_KHR,
-          .clipped = VK_TRUE},
-      0, &state->swapchain);
+  frame->drawCapacity = 0;
+}
+
+// Destroy whichever of the frame's culled instance buffers exist
+void DestroyCulledBuffers(GraphicsState *state, FrameResources *frame) {
+  VkBuffer *buffers[3] = {&frame->culledBuffer, &frame->slotBuffer,
+                          &frame->retestBuffer};
+  GpuAllocation *memories[3] = {&frame->culledMemory, &frame->slotMemory,
+                                &frame->retestMemory};
+  for (uint32_t i = 0; i < 3; i++) {
+    if (*buffers[i]) {
+      DestroyBuffer(&state->allocator, *buffers[i], memories[i]);
+      *buffers[i] = VK_NULL_HANDLE;
+    }
+  }
+  frame->culledCapacity = 0;
+}
+
+/**
+ * Write the frame's indirect draws, one per def and one per level of detail
+ * of each in each index arena for culling to fill in, and the dispatch
+ * culling them. The frame's draw and culling buffers are replaced once defs
+ * or instances have been added past their capacity, which leaves its command
+ * buffers needing re-recording. The frame must have been waited on.
+ */
+void WriteDraws(GraphicsState *state, FrameResources *frame) {
+  if (frame->drawCapacity < state->maxEntities) {
+    // Even if the new ones can't be made, the old ones are gone
+    DestroyDrawBuffers(state, frame);
+    frame->commandBufferDirty = true;
+    size_t size = sizeof(VkDrawIndexedIndirectCommand) * state->maxEntities;
+    size_t lodSize = size * MODEL_MAX_LODS * INDEX_ARENAS;
+    if (CreateBuffer(&state->allocator,
+                     size + lodSize + sizeof(VkDispatchIndirectCommand),
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                         VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     &frame->drawBuffer, &frame->drawMemory) ||
+        CreateBuffer(&state->allocator, lodSize,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     &frame->culledDrawBuffer, &frame->culledDrawMemory) ||
+        CreateBuffer(&state->allocator, lodSize,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     &frame->lateDrawBuffer, &frame->lateDrawMemory)) {
+      fprintf(stderr, "Failed to create draw buffers\n");
+      DestroyDrawBuffers(state, frame);
+      return;
+    }
+    // Draws past entityCount stay at zero instances
+    memset(frame->drawMemory.mapped, 0, size + lodSize);
+    frame->drawCapacity = state->maxEntities;
+  }
+  if (frame->culledCapacity < state->instanceCapacity) {
+    DestroyCulledBuffers(state, frame);
+    frame->commandBufferDirty = true;
+    if (CreateBuffer(&state->allocator,
+                     sizeof(Instance) * state->instanceCapacity,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     &frame->culledBuffer, &frame->culledMemory) ||
+        CreateBuffer(&state->allocator,
+                     sizeof(uint32_t) * state->instanceCapacity,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &frame->slotBuffer,
+                     &frame->slotMemory) ||
+        CreateBuffer(&state->allocator,
+                     sizeof(uint32_t) * 4 +
+                         sizeof(uint32_t) * 2 * state->instanceCapacity,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     &frame->retestBuffer, &frame->retestMemory)) {
+      fprintf(stderr, "Failed to create culled instance buffer\n");
+      DestroyCulledBuffers(state, frame);
+      return;
+    }
+    frame->culledCapacity = state->instanceCapacity;
+  }
+  VkDrawIndexedIndirectCommand *draws = frame->drawMemory.mapped;
+  VkDrawIndexedIndirectCommand *lodDraws = &draws[frame->drawCapacity];
+  uint32_t mostInstances = 0;
+  for (uint32_t t = 0; t < state->entityCount; t++) {
+    EntityDef *def = &state->entities[t];
+    // Only what made it into the def's range, if growing it failed
+    uint32_t instanceCount = def->instances.count < def->gpuInstances
+                                 ? def->instances.count
+                                 : def->gpuInstances;
+    draws[t] = (VkDrawIndexedIndirectCommand){
+        .indexCount = def->model.lods[0].indexCount,
+        .instanceCount = instanceCount,
+        .firstIndex = def->model.firstIndex,
+        .vertexOffset = def->model.firstVertex,
+        .firstInstance = def->firstInstance};
+    uint32_t arena = IndexArena(def->model.indexType);
+    for (uint32_t a = 0; a < INDEX_ARENAS; a++) {
+      for (uint32_t l = 0; l < MODEL_MAX_LODS; l++) {
+        ModelLod *lod = &def->model.lods[l];
+        bool used = a == arena && l < def->model.lodCount;
+        // Culling moves firstInstance to where it packs the level
+        lodDraws[(a * frame->drawCapacity + t) * MODEL_MAX_LODS + l] =
+            (VkDrawIndexedIndirectCommand){
+                .indexCount = used ? lod->indexCount : 0,
+                .instanceCount = 0,
+                .firstIndex = def->model.firstIndex + lod->firstIndex,
+                .vertexOffset = def->model.firstVertex,
+                .firstInstance = def->firstInstance};
+      }
+    }
+    if (instanceCount > mostInstances) {
+      mostInstances = instanceCount;
+    }
+  }
+  // A row of 64 wide workgroups per def, long enough for the biggest
+  *(VkDispatchIndirectCommand *)&lodDraws[frame->drawCapacity *
+                                          MODEL_MAX_LODS * INDEX_ARENAS] =
+      (VkDispatchIndirectCommand){
+          .x = (mostInstances + 63) / 64, .y = state->entityCount, .z = 1};
+}
+
+/**
+ * Point the frame's descriptor sets at the buffers that get replaced as they
+ * grow, for re-recording its command buffers against.
+ */
+void WriteFrameDescriptors(GraphicsState *state, FrameResources *frame) {
+  VkDescriptorBufferInfo drawInfo = {.buffer = state->drawInfoBuffer,
+                                     .offset = 0,
+                                     .range = sizeof(DrawInfo) *
+                                              state->maxEntities};
+  VkDescriptorBufferInfo selection = {.buffer = frame->selectionBuffer,
+                                      .offset = 0,
+                                      .range = VK_WHOLE_SIZE};
+  vkUpdateDescriptorSets(
+      state->device, 2,
+      (VkWriteDescriptorSet[2]){
+          {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+           .dstSet = frame->descriptorSet,
+           .dstArrayElement = 0,
+           .descriptorCount = 1,
+           .dstBinding = 1,
+           .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+           .pBufferInfo = &selection},
+          {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+           .dstSet = frame->descriptorSet,
+           .dstArrayElement = 0,
+           .descriptorCount = 1,
+           .dstBinding = 3,
+           .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+           .pBufferInfo = &drawInfo}},
+      0, VK_NULL_HANDLE);
+  if (!frame->instanceBuffer || !frame->drawBuffer || !frame->culledBuffer) {
+    // Nothing to cull yet, SetupCommandBuffer skips it
+    return;
+  }
+  VkDescriptorBufferInfo buffers[9] = {
+      {.buffer = frame->cameraBuffer, .range = sizeof(CameraState)},
+      {.buffer = frame->instanceBuffer, .range = VK_WHOLE_SIZE},
+      {.buffer = frame->drawBuffer,
+       .range = sizeof(VkDrawIndexedIndirectCommand) * frame->drawCapacity},
+      drawInfo,
+      {.buffer = frame->culledBuffer, .range = VK_WHOLE_SIZE},
+      {.buffer = frame->culledDrawBuffer, .range = VK_WHOLE_SIZE},
+      {.buffer = frame->lateDrawBuffer, .range = VK_WHOLE_SIZE},
+      {.buffer = frame->retestBuffer, .range = VK_WHOLE_SIZE},
+      {.buffer = frame->slotBuffer, .range = VK_WHOLE_SIZE}};
+  VkWriteDescriptorSet writes[10];
+  for (uint32_t i = 0; i < 9; i++) {
+    writes[i] = (VkWriteDescriptorSet){
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = frame->cullDescriptorSet,
+        .dstArrayElement = 0,
+        .descriptorCount = 1,
+        .dstBinding = i,
+        .descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER
+                                 : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pBufferInfo = &buffers[i]};
+  }
+  writes[9] = (VkWriteDescriptorSet){
+      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+      .dstSet = frame->cullDescriptorSet,
+      .dstArrayElement = 0,
+      .descriptorCount = 1,
+      .dstBinding = 9,
+      .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+      .pImageInfo = &(VkDescriptorImageInfo){
+          .sampler = state->depthSampler,
+          .imageView = state->depthPyramidView,
+          .imageLayout = VK_IMAGE_LAYOUT_GENERAL}};
+  vkUpdateDescriptorSets(state->device, 10, writes, 0, VK_NULL_HANDLE);
+}
+
+/**
+ * Create the culling and depth pyramid compute pipelines, which don't depend
+ * on the swapchain so live as long as the device.
+ */
+void CreateCullPipeline(GraphicsState *state) {
+  VkDescriptorSetLayoutBinding bindings[10];
+  for (uint32_t i = 0; i < 10; i++) {
+    bindings[i] = (VkDescriptorSetLayoutBinding){
+        .binding = i,
+        .descriptorType = i == 0   ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER
+                          : i == 9 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
+                                   : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT};
+  }
+  vkCreateDescriptorSetLayout(
+      state->device,
+      &(VkDescriptorSetLayoutCreateInfo){
+          .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+          .bindingCount = 10,
+          .pBindings = bindings},
+      NULL, &state->cullSetLayout);
+  vkCreatePipelineLayout(
+      state->device,
+      &(VkPipelineLayoutCreateInfo){
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+          .setLayoutCount = 1,
+          .pSetLayouts = &state->cullSetLayout,
+          .pushConstantRangeCount = 1,
+          .pPushConstantRanges =
+              &(VkPushConstantRange){.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                                     .offset = 0,
+                                     .size = sizeof(CullConstants)}},
+      NULL, &state->cullLayout);
+  VkShaderModule module =
+      LoadShaderFromFile(state->device, "./shaders/cull.spv");
+  vkCreateComputePipelines(
+      state->device, state->pipelineCache, 1,
+      &(VkComputePipelineCreateInfo){
+          .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+          .stage = {.sType =
+                        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                    .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+                    .module = module,
+                    .pName = "main"},
+          .layout = state->cullLayout},
+      NULL, &state->cullPipeline);
+  vkDestroyShaderModule(state->device, module, NULL);
+
+  vkCreateDescriptorSetLayout(
+      state->device,
+      &(VkDescriptorSetLayoutCreateInfo){
+          .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+          .bindingCount = 2,
+          .pBindings =
+              (VkDescriptorSetLayoutBinding[2]){
+                  {.binding = 0,
+                   .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                   .descriptorCount = 1,
+                   .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT},
+                  {.binding = 1,
+                   .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                   .descriptorCount = 1,
+                   .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT}}},
+      NULL, &state->reduceSetLayout);
+  vkCreatePipelineLayout(
+      state->device,
+      &(VkPipelineLayoutCreateInfo){
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+          .setLayoutCount = 1,
+          .pSetLayouts = &state->reduceSetLayout},
+      NULL, &state->reduceLayout);
+  module = LoadShaderFromFile(state->device, "./shaders/depthreduce.spv");
+  vkCreateComputePipelines(
+      state->device, state->pipelineCache, 1,
+      &(VkComputePipelineCreateInfo){
+          .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+          .stage = {.sType =
+                        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                    .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+                    .module = module,
+                    .pName = "main"},
+          .layout = state->reduceLayout},
+      NULL, &state->reducePipeline);
+  vkDestroyShaderModule(state->device, module, NULL);
+  // Both shaders read exact texels with texelFetch
+  vkCreateSampler(
+      state->device,
+      &(VkSamplerCreateInfo){
+          .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+          .magFilter = VK_FILTER_NEAREST,
+          .minFilter = VK_FILTER_NEAREST,
+          .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+          .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+          .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+          .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+          .maxLod = HIZ_MAX_LEVELS},
+      NULL, &state->depthSampler);
+}
+
+/**
+ * Create the depth pyramid for a depth buffer of extent, level 0 half its
+ * size rounded up and halving down to 1x1, and a view of each level for
+ * BuildDepthPyramid to write to. It starts out at the far plane everywhere
+ * so the first frame culls nothing.
+ */
+uint32_t CreateDepthPyramid(GraphicsState *state, VkExtent2D extent) {
+  VkExtent2D level = {(extent.width + 1) / 2, (extent.height + 1) / 2};
+  state->depthPyramidLevelCount = 0;
+  while (state->depthPyramidLevelCount < HIZ_MAX_LEVELS) {
+    state->depthPyramidExtents[state->depthPyramidLevelCount++] = level;
+    if (level.width == 1 && level.height == 1) {
+      break;
+    }
+    level.width = level.width > 1 ? (level.width + 1) / 2 : 1;
+    level.height = level.height > 1 ? (level.height + 1) / 2 : 1;
+  }
+  // Always in GENERAL, it's written as a storage image and read sampled
+  VkResult res = vkCreateImage(
+      state->device,
+      &(VkImageCreateInfo){
+          .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+          .imageType = VK_IMAGE_TYPE_2D,
+          .format = VK_FORMAT_R32_SFLOAT,
+          .extent = {.width = state->depthPyramidExtents[0].width,
+                     .height = state->depthPyramidExtents[0].height,
+                     .depth = 1},
+          .mipLevels = state->depthPyramidLevelCount,
+          .arrayLayers = 1,
+          .samples = 1,
+          .tiling = VK_IMAGE_TILING_OPTIMAL,
+          .usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
+                   VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+          .sharingMode = VK_SHARING_MODE_EXCLUSIVE},
+      NULL, &state->depthPyramid);
+  if (res != VK_SUCCESS ||
+      AllocateImageMemory(&state->allocator, state->depthPyramid,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          &state->depthPyramidMemory)) {
+    fprintf(stderr, "Failed to create depth pyramid: %d\n", res);
+    return 1;
+  }
+  for (uint32_t l = 0; l <= state->depthPyramidLevelCount; l++) {
+    // One view of every level for culling, then one of each on its own
+    bool whole = l == state->depthPyramidLevelCount;
+    vkCreateImageView(
+        state->device,
+        &(VkImageViewCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .image = state->depthPyramid,
+            .viewType = VK_IMAGE_VIEW_TYPE_2D,
+            .format = VK_FORMAT_R32_SFLOAT,
+            .subresourceRange = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                 .baseMipLevel = whole ? 0 : l,
+                                 .levelCount =
+                                     whole ? state->depthPyramidLevelCount : 1,
+                                 .baseArrayLayer = 0,
+                                 .layerCount = 1}},
+        NULL,
+        whole ? &state->depthPyramidView : &state->depthPyramidLevels[l]);
+  }
+
+  VkCommandBuffer commandBuffer;
+  vkAllocateCommandBuffers(
+      state->device,
+      &(VkCommandBufferAllocateInfo){
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+          .commandPool = state->commandPool,
+          .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+          .commandBufferCount = 1},
+      &commandBuffer);
+  vkBeginCommandBuffer(
+      commandBuffer,
+      &(VkCommandBufferBeginInfo){
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+          .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT});
+  VkImageSubresourceRange levels = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                    .baseMipLevel = 0,
+                                    .levelCount =
+                                        state->depthPyramidLevelCount,
+                                    .baseArrayLayer = 0,
+                                    .layerCount = 1};
+  vkCmdPipelineBarrier(
+      commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1,
+      &(VkImageMemoryBarrier){
+          .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+          .srcAccessMask = 0,
+          .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+          .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+          .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+          .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .image = state->depthPyramid,
+          .subresourceRange = levels});
+  vkCmdClearColorImage(commandBuffer, state->depthPyramid,
+                       VK_IMAGE_LAYOUT_GENERAL,
+                       &(VkClearColorValue){.float32 = {1, 1, 1, 1}}, 1,
+                       &levels);
+  vkCmdPipelineBarrier(
+      commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+      &(VkMemoryBarrier){.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                         .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                         .dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                                          VK_ACCESS_SHADER_WRITE_BIT},
+      0, NULL, 0, NULL);
+  vkEndCommandBuffer(commandBuffer);
+  // Only when the swapchain is created, so waiting on it is fine
+  uint64_t value = SubmitTimeline(state->graphicsTimeline, &commandBuffer, 1,
+                                  NULL, 0, VK_NULL_HANDLE);
+  WaitTimeline(state->graphicsTimeline, value);
+  vkFreeCommandBuffers(state->device, state->commandPool, 1, &commandBuffer);
+  return 0;
+}
+
+void DestroyDepthPyramid(GraphicsState *state) {
+  for (uint32_t l = 0; l < state->depthPyramidLevelCount; l++) {
+    vkDestroyImageView(state->device, state->depthPyramidLevels[l], NULL);
+  }
+  vkDestroyImageView(state->device, state->depthPyramidView, NULL);
+  vkDestroyImage(state->device, state->depthPyramid, NULL);
+  GpuFree(&state->allocator, &state->depthPyramidMemory);
+  state->depthPyramidLevelCount = 0;
+}
+
+/**
+ * Build variant of the scene pipeline, on the pipeline compiler's thread.
+ * Returns VK_NULL_HANDLE if it couldn't be built.
+ */
+VkPipeline BuildScenePipeline(void *arg, uint32_t variant) {
+  ScenePipelineContext *context = arg;
+  VkPipeline pipeline;
+  VkShaderModule vertex =
+      LoadShaderFromFile(context->device, "./shaders/vertex.spv");
+  VkShaderModule fragment =
+      LoadShaderFromFile(context->device, "./shaders/fragment.spv");
+  VkResult result = vkCreateGraphicsPipelines(
+      context->device, context->cache, 1,
+      (VkGraphicsPipelineCreateInfo[1]){
+          {.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+           .stageCount = 2,
+           .pStages =
+               (VkPipelineShaderStageCreateInfo[2]){
+                   {.sType =
+                        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                    .stage = VK_SHADER_STAGE_VERTEX_BIT,
+                    .module = vertex,
+                    .pName = "main"},
+                   {.sType =
+                        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                    .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+                    .module = fragment,
+                    .pName = "main"}},
+           .pVertexInputState =
+               &(VkPipelineVertexInputStateCreateInfo){
+                   .sType =
+                       VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+                   .vertexBindingDescriptionCount = 2,
+                   .pVertexBindingDescriptions =
+                       (VkVertexInputBindingDescription[2]){
+                           {.binding = 0,
+                            .stride = sizeof(GpuVertex),
+                            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX},
+                           {.binding = 1,
+                            .stride = sizeof(Instance),
+                            .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE}},
+                   .vertexAttributeDescriptionCount = 7,
+                   .pVertexAttributeDescriptions =
+                       (VkVertexInputAttributeDescription[7]){
+                           {.location = 0,
+                            .binding = 0,
+                            .format = GPU_VERTEX_POSITION_FORMAT,
+                            .offset = offsetof(GpuVertex, position)},
+                           {.location = 1,
+                            .binding = 0,
+                            .format = VK_FORMAT_R16_UINT,
+                            .offset = offsetof(GpuVertex, color)},
+                           {.location = 2,
+                            .binding = 0,
+                            .format = GPU_VERTEX_NORMAL_FORMAT,
+                            .offset = offsetof(GpuVertex, normal)},
+                           {.location = 3,
+                            .binding = 1,
+                            .format = VK_FORMAT_R32G32B32_SFLOAT,
+                            .offset = offsetof(Instance, position)},
+                           {.location = 4,
+                            .binding = 1,
+                            .format = VK_FORMAT_R32G32B32_SFLOAT,
+                            .offset = offsetof(Instance, scale)},
+                           {.location = 5,
+                            .binding = 1,
+                            .format = VK_FORMAT_R16G16B16A16_SNORM,
+                            .offset = offsetof(Instance, orientation)},
+                           {.location = 6,
+                            .binding = 1,
+                            .format = VK_FORMAT_R32_UINT,
+                            .offset = offsetof(Instance, instanceId)}}},
+           .pInputAssemblyState =
+               &(VkPipelineInputAssemblyStateCreateInfo){
+                   .sType =
+                       VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+                   .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST},
+           .pViewportState =
+               &(VkPipelineViewportStateCreateInfo){
+                   .sType =
+                       VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+                   .viewportCount = 1,
+                   .scissorCount = 1},
+           .pRasterizationState =
+               &(VkPipelineRasterizationStateCreateInfo){
+                   .sType =
+                       VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+                   .depthClampEnable = VK_FALSE,
+                   .rasterizerDiscardEnable = VK_FALSE,
+                   .polygonMode = variant == SCENE_PIPELINE_WIREFRAME
+                                      ? VK_POLYGON_MODE_LINE
+                                      : VK_POLYGON_MODE_FILL,
+                   .lineWidth = 1.f,
+                   .cullMode = VK_CULL_MODE_BACK_BIT,
+                   .frontFace = VK_FRONT_FACE_CLOCKWISE},
+           .pMultisampleState =
+               &(VkPipelineMultisampleStateCreateInfo){
+                   .sType =
+                       VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+                   .sampleShadingEnable = VK_FALSE,
+                   .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+                   .minSampleShading = 1.f},
+           .pDepthStencilState =
+               &(VkPipelineDepthStencilStateCreateInfo){
+                   .sType =
+                       VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+                   .depthTestEnable = VK_TRUE,
+                   .depthWriteEnable = VK_TRUE,
+                   .depthCompareOp = VK_COMPARE_OP_LESS,
+                   .depthBoundsTestEnable = VK_FALSE,
+                   .stencilTestEnable = VK_FALSE,
+                   .front = {.failOp = VK_STENCIL_OP_KEEP,
+                             .passOp = VK_STENCIL_OP_KEEP,
+                             .compareOp = VK_COMPARE_OP_ALWAYS},
+                   .back = {.failOp = VK_STENCIL_OP_KEEP,
+                            .passOp = VK_STENCIL_OP_KEEP,
+                            .compareOp = VK_COMPARE_OP_ALWAYS},
+                   .minDepthBounds = -5,
+                   .maxDepthBounds = 100},
+           .pColorBlendState =
+               &(VkPipelineColorBlendStateCreateInfo){
+                   .sType =
+                       VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+                   .logicOpEnable = VK_FALSE,
+                   .attachmentCount = 2,
+                   .pAttachments =
+                       (VkPipelineColorBlendAttachmentState[2]){
+                           {.colorWriteMask = VK_COLOR_COMPONENT_R_BIT |
+                                              VK_COLOR_COMPONENT_G_BIT |
+                                              VK_COLOR_COMPONENT_B_BIT |
+                                              VK_COLOR_COMPONENT_A_BIT,
+                            .blendEnable = VK_TRUE,
+                            .srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA,
+                            .dstColorBlendFactor =
+                                VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+                            .colorBlendOp = VK_BLEND_OP_ADD,
+                            .srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
+                            .dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
+                            .alphaBlendOp = VK_BLEND_OP_ADD},
+                           // Integer ids can't be blended
+                           {.colorWriteMask = VK_COLOR_COMPONENT_R_BIT,
+                            .blendEnable = VK_FALSE}},
+                   .blendConstants = {0.f, 0.f, 0.f, 0.f}},
+           // Set as the command buffers are recorded, so a new swapchain
+           // extent doesn't need a new pipeline
+           .pDynamicState =
+               &(VkPipelineDynamicStateCreateInfo){
+                   .sType =
+                       VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+                   .dynamicStateCount = 2,
+                   .pDynamicStates =
+                       (VkDynamicState[2]){VK_DYNAMIC_STATE_VIEWPORT,
+                                           VK_DYNAMIC_STATE_SCISSOR}},
+           .layout = context->layout,
+           .renderPass = context->renderPass,
+           .subpass = 0},
+      },
+      NULL, &pipeline);
+  vkDestroyShaderModule(context->device, vertex, NULL);
+  vkDestroyShaderModule(context->device, fragment, NULL);
+  if (result != VK_SUCCESS) {
+    fprintf(stderr, "Failed to build scene pipeline variant %d: %d\n",
+            variant, result);
+    return VK_NULL_HANDLE;
+  }
+  SavePipelineCache(context->device, context->cache, PIPELINE_CACHE_PATH,
+                    &context->cacheSize);
+  return pipeline;
+}
+
+// The descriptor set and pipeline layouts of the scene pipeline, which last
+// as long as the device does
+void CreateScenePipelineLayout(GraphicsState *state) {
+  vkCreateDescriptorSetLayout(
+      state->device,
+      &(VkDescriptorSetLayoutCreateInfo){
+          .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+          .bindingCount = 3,
+          .pBindings =
+              (VkDescriptorSetLayoutBinding[3]){
+                  {.binding = 0,
+                   .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+                   .descriptorCount = 1,
+                   .stageFlags = VK_SHADER_STAGE_VERTEX_BIT |
+                                 VK_SHADER_STAGE_FRAGMENT_BIT},
+                  {.binding = 1,
+                   .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                   .descriptorCount = 1,
+                   .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT},
+                  {.binding = 3,
+                   .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                   .descriptorCount = 1,
+                   .stageFlags = VK_SHADER_STAGE_VERTEX_BIT}}},
+      NULL, &state->descriptorSetLayout);
+  vkCreatePipelineLayout(
+      state->device,
+      &(VkPipelineLayoutCreateInfo){
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+          .setLayoutCount = 1,
+          .pSetLayouts =
+              (VkDescriptorSetLayout[1]){state->descriptorSetLayout}},
+      NULL, &state->layout);
+}
 
+/**
+ * (Re)create renderPass and loadRenderPass for a swapchain of format. The
+ * device has to be idle. Headless, the colour is left to be copied out
+ * rather than presented.
+ */
+void CreateRenderPasses(GraphicsState *state, VkFormat format) {
+  if (state->renderPass) {
+    vkDestroyRenderPass(state->device, state->renderPass, NULL);
+    vkDestroyRenderPass(state->device, state->loadRenderPass, NULL);
+  }
   vkCreateRenderPass(
       state->device,
       &(VkRenderPassCreateInfo){
           .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
-          .attachmentCount = 2,
+          .attachmentCount = 3,
           .pAttachments =
-              (VkAttachmentDescription[2]){
-                  {.format = formats[0].format,
+              (VkAttachmentDescription[3]){
+                  {.format = format,
                    .samples = VK_SAMPLE_COUNT_1_BIT,
                    .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
                    .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
                    .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-                   .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR},
+                   .finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
                   {.format = VK_FORMAT_D32_SFLOAT,
                    .samples = VK_SAMPLE_COUNT_1_BIT,
                    .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
                    .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
                    .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-                   .finalLayout = VK_IMAGE_LAYOUT_GENERAL}},
+                   .finalLayout = VK_IMAGE_LAYOUT_GENERAL},
+                  {.format = VK_FORMAT_R32_UINT,
+                   .samples = VK_SAMPLE_COUNT_1_BIT,
+                   .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+                   .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+                   .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+                   .finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL}},
           .subpassCount = 1,
           .pSubpasses =
               (VkSubpassDescription[1]){
                   {.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
-                   .colorAttachmentCount = 1,
+                   .colorAttachmentCount = 2,
                    .pColorAttachments =
-                       &(VkAttachmentReference){
-                           0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
+                       (VkAttachmentReference[2]){
+                           {0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
+                           {2, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL}},
                    .pDepthStencilAttachment =
                        &(VkAttachmentReference){
                            1,
@@ -516,64 +2036,207 @@ void CreateRenderState(GraphicsState *state) {
                    .dstAccessMask =
                        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT}}},
       0, &state->renderPass);
+  // Same attachments, keeping what renderPass drew and presenting at the end
+  vkCreateRenderPass(
+      state->device,
+      &(VkRenderPassCreateInfo){
+          .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+          .attachmentCount = 3,
+          .pAttachments =
+              (VkAttachmentDescription[3]){
+                  {.format = format,
+                   .samples = VK_SAMPLE_COUNT_1_BIT,
+                   .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+                   .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+                   .initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                   .finalLayout = state->headless
+                                      ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                      : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR},
+                  {.format = VK_FORMAT_D32_SFLOAT,
+                   .samples = VK_SAMPLE_COUNT_1_BIT,
+                   .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+                   .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+                   .initialLayout = VK_IMAGE_LAYOUT_GENERAL,
+                   .finalLayout = VK_IMAGE_LAYOUT_GENERAL},
+                  // Left for picking to copy out of
+                  {.format = VK_FORMAT_R32_UINT,
+                   .samples = VK_SAMPLE_COUNT_1_BIT,
+                   .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+                   .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+                   .initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                   .finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL}},
+          .subpassCount = 1,
+          .pSubpasses =
+              (VkSubpassDescription[1]){
+                  {.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+                   .colorAttachmentCount = 2,
+                   .pColorAttachments =
+                       (VkAttachmentReference[2]){
+                           {0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
+                           {2, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL}},
+                   .pDepthStencilAttachment =
+                       &(VkAttachmentReference){
+                           1,
+                           VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL}}},
+          .dependencyCount = 2,
+          .pDependencies =
+              (VkSubpassDependency[2]){
+                  // The ids drawn, ahead of picking copying them out
+                  {.srcSubpass = 0,
+                   .dstSubpass = VK_SUBPASS_EXTERNAL,
+                   .srcStageMask =
+                       VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                   .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                   .dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+                   .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT},
+                  {.srcSubpass = VK_SUBPASS_EXTERNAL,
+                   .dstSubpass = 0,
+                   .srcStageMask =
+                       VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                       VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                   .srcAccessMask =
+                       VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                       VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                   .dstStageMask =
+                       VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                       VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+                   .dstAccessMask =
+                       VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+                       VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                       VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                       VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT}}},
+      0, &state->loadRenderPass);
+  state->surfaceFormat = format;
+}
 
-  vkGetSwapchainImagesKHR(state->device, state->swapchain, &count, NULL);
+// Size to make the swapchain, 0 by 0 while the window is minimised
+VkExtent2D SwapchainExtent(GraphicsState *state) {
+  if (state->headless) {
+    return (VkExtent2D){HEADLESS_WIDTH, HEADLESS_HEIGHT};
+  }
+  VkSurfaceCapabilitiesKHR capabilities;
+  vkGetPhysicalDeviceSurfaceCapabilitiesKHR(state->physicalDevice,
+                                            state->surface, &capabilities);
+  if (capabilities.currentExtent.width != UINT32_MAX) {
+    return capabilities.currentExtent;
+  }
+  // The surface goes by whatever the swapchain is made at
+  int width, height;
+  glfwGetFramebufferSize(state->window, &width, &height);
+  VkExtent2D min = capabilities.minImageExtent;
+  VkExtent2D max = capabilities.maxImageExtent;
+  return (VkExtent2D){glm_clamp(width, min.width, max.width),
+                      glm_clamp(height, min.height, max.height)};
+}
+
+// Create the swapchain itself at extent, retiring the one there was if any.
+// Returns the format of its images
+VkFormat CreateSurfaceSwapchain(GraphicsState *state, VkExtent2D extent) {
+  VkSurfaceCapabilitiesKHR capabilities;
+  vkGetPhysicalDeviceSurfaceCapabilitiesKHR(state->physicalDevice,
+                                            state->surface, &capabilities);
+  uint32_t count;
+  vkGetPhysicalDeviceSurfaceFormatsKHR(state->physicalDevice, state->surface,
+                                       &count, 0);
+  VkSurfaceFormatKHR *formats = calloc(count, sizeof(VkSurfaceFormatKHR));
+  vkGetPhysicalDeviceSurfaceFormatsKHR(state->physicalDevice, state->surface,
+                                       &count, formats);
+  VkBool32 supported;
+  vkGetPhysicalDeviceSurfaceSupportKHR(state->physicalDevice,
+                                       state->graphicsFamily, state->surface,
+                                       &supported);
+  if (!supported) {
+    fprintf(stderr, "Surface does not support swapchain! I dont know why :(\n");
+    exit(1);
+  }
+  VkSwapchainKHR oldSwapchain = state->swapchain;
+  vkCreateSwapchainKHR(
+      state->device,
+      &(VkSwapchainCreateInfoKHR){
+          .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+          .surface = state->surface,
+          .minImageCount = capabilities.minImageCount,
+          .imageFormat = formats[0].format,
+          .imageColorSpace = formats[0].colorSpace,
+          .imageExtent = extent,
+          .imageArrayLayers = 1,
+          .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+          .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
+          .queueFamilyIndexCount = 1,
+          .pQueueFamilyIndices = &state->graphicsFamily,
+          .preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
+          .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+          .presentMode = VK_PRESENT_MODE_IMMEDIATE_KHR,
+          .clipped = VK_TRUE,
+          // Lets the old one's images be handed over rather than the
+          // presentation engine starting from nothing
+          .oldSwapchain = oldSwapchain},
+      0, &state->swapchain);
+  if (oldSwapchain) {
+    vkDestroySwapchainKHR(state->device, oldSwapchain, NULL);
+  }
+  VkFormat format = formats[0].format;
+  free(formats);
+  count = MAX_SWAPCHAIN_IMAGES;
   vkGetSwapchainImagesKHR(state->device, state->swapchain, &count,
                           state->swapchainImages);
   state->imageCount = count;
-  vkAllocateCommandBuffers(
-      state->device,
-      &(VkCommandBufferAllocateInfo){
-          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-          .commandPool = state->commandPool,
-          .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-          .commandBufferCount = count},
-      state->commandbuffers);
+  return format;
+}
+
+// Images standing in for a swapchain's without a window, one per frame in
+// flight so a frame only ever draws into its own. Returns their format
+VkFormat CreateHeadlessImages(GraphicsState *state, VkExtent2D extent) {
+  state->imageCount = MAX_FRAMES_IN_FLIGHT;
+  for (uint32_t i = 0; i < state->imageCount; i++) {
+    vkCreateImage(state->device,
+                  &(VkImageCreateInfo){
+                      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+                      .imageType = VK_IMAGE_TYPE_2D,
+                      .format = HEADLESS_FORMAT,
+                      .extent = {.width = extent.width,
+                                 .height = extent.height,
+                                 .depth = 1},
+                      .mipLevels = 1,
+                      .arrayLayers = 1,
+                      .samples = 1,
+                      .tiling = VK_IMAGE_TILING_OPTIMAL,
+                      // Copied out to dump frames
+                      .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                               VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                      .sharingMode = VK_SHARING_MODE_EXCLUSIVE},
+                  NULL, &state->swapchainImages[i]);
+    AllocateImageMemory(&state->allocator, state->swapchainImages[i],
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                        &state->headlessImageMemories[i]);
+  }
+  return HEADLESS_FORMAT;
+}
+
+/**
+ * Create the swapchain at extent, or the images standing in for it when
+ * headless, along with everything sized to it: the depth and id
+ * attachments, framebuffers and depth pyramid. Command buffers have to be
+ * re-recorded after.
+ */
+void CreateSwapchain(GraphicsState *state, VkExtent2D extent) {
+  state->renderArea = extent;
+  VkFormat format = state->headless ? CreateHeadlessImages(state, extent)
+                                    : CreateSurfaceSwapchain(state, extent);
+  if (format != state->surfaceFormat) {
+    // The pipelines only depend on the swapchain through its format, there's
+    // no need for new ones otherwise
+    DiscardPipelines(state->compiler, state->device);
+    CreateRenderPasses(state, format);
+    state->sceneContext->renderPass = state->renderPass;
+    RequestPipeline(state->compiler, SCENE_PIPELINE_FILL);
+    if (state->wireframe) {
+      RequestPipeline(state->compiler, SCENE_PIPELINE_WIREFRAME);
+      state->wireframePending = true;
+    }
+  }
 
-  // Descriptor Set
-  vkCreateDescriptorSetLayout(
-      state->device,
-      &(VkDescriptorSetLayoutCreateInfo){
-          .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-          .bindingCount = 2,
-          .pBindings =
-              (VkDescriptorSetLayoutBinding[2]){
-                  {.binding = 0,
-                   .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-                   .descriptorCount = 1,
-                   .stageFlags = VK_SHADER_STAGE_VERTEX_BIT |
-                                 VK_SHADER_STAGE_FRAGMENT_BIT},
-                  {.binding = 1,
-                   .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-                   .descriptorCount = 1,
-                   .stageFlags = VK_SHADER_STAGE_VERTEX_BIT |
-                                 VK_SHADER_STAGE_FRAGMENT_BIT}}},
-      NULL, &state->descriptorSetLayout);
-  vkCreateDescriptorPool(
-      state->device,
-      &(VkDescriptorPoolCreateInfo){
-          .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-          .maxSets = MAX_SWAPCHAIN_IMAGES,
-          .poolSizeCount = 2,
-          .pPoolSizes =
-              (VkDescriptorPoolSize[2]){
-                  {.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-                   .descriptorCount = MAX_SWAPCHAIN_IMAGES},
-                  {.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-                   .descriptorCount = MAX_SWAPCHAIN_IMAGES}}},
-      NULL, &state->descriptorPool);
-  VkWriteDescriptorSet vwds[MAX_SWAPCHAIN_IMAGES * 2];
-  vkAllocateDescriptorSets(
-      state->device,
-      &(VkDescriptorSetAllocateInfo){
-          .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-          .descriptorPool = state->descriptorPool,
-          .descriptorSetCount = state->imageCount,
-          .pSetLayouts =
-              (VkDescriptorSetLayout[MAX_SWAPCHAIN_IMAGES]){
-                  state->descriptorSetLayout, state->descriptorSetLayout,
-                  state->descriptorSetLayout}},
-      state->descriptorSets);
   // Per image state
   for (uint32_t i = 0; i < state->imageCount; i++) {
     vkCreateImage(state->device,
@@ -581,312 +2244,327 @@ void CreateRenderState(GraphicsState *state) {
                       .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
                       .imageType = VK_IMAGE_TYPE_2D,
                       .format = VK_FORMAT_D32_SFLOAT,
-                      .extent = {.width = capabilites.maxImageExtent.width,
-                                 .height = capabilites.maxImageExtent.height,
+                      .extent = {.width = extent.width,
+                                 .height = extent.height,
                                  .depth = 1},
                       .mipLevels = 1,
                       .arrayLayers = 1,
                       .samples = 1,
                       .tiling = VK_IMAGE_TILING_OPTIMAL,
-                      .usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+                      // Also read into the depth pyramid
+                      .usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                               VK_IMAGE_USAGE_SAMPLED_BIT,
                       .sharingMode = VK_SHARING_MODE_EXCLUSIVE},
                   NULL, &state->depthImages[i]);
-    VkMemoryRequirements requirements;
-    vkGetImageMemoryRequirements(state->device, state->depthImages[i],
-                                 &requirements);
-    vkAllocateMemory(
-        state->device,
-        &(VkMemoryAllocateInfo){
-            .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-            .allocationSize = requirements.size,
-            .memoryTypeIndex = getMemoryTypeMatching(
-                state->physicalDevice, requirements.memoryTypeBits, 0)[0]},
-        NULL, &state->depthImageMemories[i]);
-    vkBindImageMemory(state->device, state->depthImages[i],
-                      state->depthImageMemories[i], 0);
-    VkImageView imageView[2];
+    AllocateImageMemory(&state->allocator, state->depthImages[i],
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                        &state->depthImageMemories[i]);
+    VkImageView imageView[3];
     vkCreateImageView(
         state->device,
         &(VkImageViewCreateInfo){
             .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
             .image = state->swapchainImages[i],
             .viewType = VK_IMAGE_VIEW_TYPE_2D,
-            .format = formats[0].format,
+            .format = state->surfaceFormat,
             .subresourceRange = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
                                  .baseMipLevel = 0,
                                  .levelCount = 1,
                                  .baseArrayLayer = 0,
                                  .layerCount = 1}},
-        0, &imageView[0]);
+        0, &state->swapchainViews[i]);
+    imageView[0] = state->swapchainViews[i];
     vkCreateImageView(
         state->device,
-        &(VkImageViewCreateInfo){
-            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-            .image = state->depthImages[i],
-            .viewType = VK_IMAGE_VIEW_TYPE_2D,
-            .format = VK_FORMAT_D32_SFLOAT,
-            .subresourceRange = {.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT,
-                                 .baseMipLevel = 0,
-                                 .levelCount = 1,
-                                 .baseArrayLayer = 0,
-                                 .layerCount = 1}},
-        0, &imageView[1]);
-    vwds[i * 2] = (VkWriteDescriptorSet){
+        &(VkImageViewCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .image = state->depthImages[i],
+            .viewType = VK_IMAGE_VIEW_TYPE_2D,
+            .format = VK_FORMAT_D32_SFLOAT,
+            .subresourceRange = {.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT,
+                                 .baseMipLevel = 0,
+                                 .levelCount = 1,
+                                 .baseArrayLayer = 0,
+                                 .layerCount = 1}},
+        0, &state->depthViews[i]);
+    imageView[1] = state->depthViews[i];
+    vkCreateImage(state->device,
+                  &(VkImageCreateInfo){
+                      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+                      .imageType = VK_IMAGE_TYPE_2D,
+                      .format = VK_FORMAT_R32_UINT,
+                      .extent = {.width = extent.width,
+                                 .height = extent.height,
+                                 .depth = 1},
+                      .mipLevels = 1,
+                      .arrayLayers = 1,
+                      .samples = 1,
+                      .tiling = VK_IMAGE_TILING_OPTIMAL,
+                      .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                               VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                      .sharingMode = VK_SHARING_MODE_EXCLUSIVE},
+                  NULL, &state->idImages[i]);
+    AllocateImageMemory(&state->allocator, state->idImages[i],
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                        &state->idImageMemories[i]);
+    vkCreateImageView(
+        state->device,
+        &(VkImageViewCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .image = state->idImages[i],
+            .viewType = VK_IMAGE_VIEW_TYPE_2D,
+            .format = VK_FORMAT_R32_UINT,
+            .subresourceRange = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                 .baseMipLevel = 0,
+                                 .levelCount = 1,
+                                 .baseArrayLayer = 0,
+                                 .layerCount = 1}},
+        0, &state->idViews[i]);
+    imageView[2] = state->idViews[i];
+    vkCreateFramebuffer(state->device,
+                        &(VkFramebufferCreateInfo){
+                            .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+                            .renderPass = state->renderPass,
+                            .attachmentCount = 3,
+                            .pAttachments = imageView,
+                            .width = extent.width,
+                            .height = extent.height,
+                            .layers = 1},
+                        0, &state->framebuffers[i]);
+  }
+  CreateDepthPyramid(state, extent);
+  // Level 0 reads each image's depth and every level after the one before,
+  // all writing a single level
+  uint32_t reduceCount = MAX_SWAPCHAIN_IMAGES + state->depthPyramidLevelCount;
+  for (uint32_t i = 0; i < reduceCount; i++) {
+    uint32_t level = i < MAX_SWAPCHAIN_IMAGES ? 0 : i - MAX_SWAPCHAIN_IMAGES;
+    // Images the swapchain doesn't have, and level 0 is only read from depth
+    if (i < MAX_SWAPCHAIN_IMAGES ? i >= state->imageCount : level == 0) {
+      continue;
+    }
+    VkDescriptorImageInfo images[2] = {
+        {.sampler = state->depthSampler,
+         .imageView = i < MAX_SWAPCHAIN_IMAGES
+                          ? state->depthViews[i]
+                          : state->depthPyramidLevels[level - 1],
+         .imageLayout = VK_IMAGE_LAYOUT_GENERAL},
+        {.imageView = state->depthPyramidLevels[level],
+         .imageLayout = VK_IMAGE_LAYOUT_GENERAL}};
+    vkUpdateDescriptorSets(
+        state->device, 2,
+        (VkWriteDescriptorSet[2]){
+            {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+             .dstSet = state->reduceSets[i],
+             .dstBinding = 0,
+             .descriptorCount = 1,
+             .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+             .pImageInfo = &images[0]},
+            {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+             .dstSet = state->reduceSets[i],
+             .dstBinding = 1,
+             .descriptorCount = 1,
+             .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+             .pImageInfo = &images[1]}},
+        0, VK_NULL_HANDLE);
+  }
+
+  glm_perspective(80, (float)extent.width / (float)extent.height, 0.1, 50,
+                  state->camera->proj);
+  state->commandBufferDirty = true;
+}
+
+// Destroy everything CreateSwapchain made but the swapchain, which is kept
+// to hand over to the next one. Nothing in flight can be using any of it
+void CleanSwapchain(GraphicsState *state) {
+  for (uint32_t i = 0; i < state->imageCount; i++) {
+    vkDestroyFramebuffer(state->device, state->framebuffers[i], NULL);
+    vkDestroyImageView(state->device, state->swapchainViews[i], NULL);
+    vkDestroyImageView(state->device, state->depthViews[i], NULL);
+    vkDestroyImage(state->device, state->depthImages[i], NULL);
+    GpuFree(&state->allocator, &state->depthImageMemories[i]);
+    vkDestroyImageView(state->device, state->idViews[i], NULL);
+    vkDestroyImage(state->device, state->idImages[i], NULL);
+    GpuFree(&state->allocator, &state->idImageMemories[i]);
+    if (state->headless) {
+      vkDestroyImage(state->device, state->swapchainImages[i], NULL);
+      GpuFree(&state->allocator, &state->headlessImageMemories[i]);
+    }
+  }
+  DestroyDepthPyramid(state);
+}
+
+/**
+ * Replace the swapchain after it has gone out of date, leaving everything
+ * that doesn't depend on its size alone. Returns false while the window is
+ * minimised, when there's nothing to make one at.
+ */
+bool RecreateSwapchain(GraphicsState *state) {
+  VkExtent2D extent = SwapchainExtent(state);
+  if (extent.width == 0 || extent.height == 0) {
+    return false;
+  }
+  // Presenting goes through the graphics queue too
+  vkQueueWaitIdle(state->graphicsTimeline->queue);
+  CleanSwapchain(state);
+  CreateSwapchain(state, extent);
+  return true;
+}
+
+/**
+ * Create what drawing needs that lasts across swapchains, the command
+ * buffers and descriptor sets, then the swapchain itself.
+ */
+void CreateRenderState(GraphicsState *state) {
+  // Enough for any swapchain, only the first imageCount are recorded
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    vkAllocateCommandBuffers(
+        state->device,
+        &(VkCommandBufferAllocateInfo){
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = state->commandPool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = MAX_SWAPCHAIN_IMAGES},
+        state->frames[i].commandbuffers);
+  }
+
+  // Descriptor Set
+  vkCreateDescriptorPool(
+      state->device,
+      &(VkDescriptorPoolCreateInfo){
+          .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+          // A set for drawing and one for culling per frame, and one for
+          // reducing each level of the depth pyramid
+          .maxSets = MAX_FRAMES_IN_FLIGHT * 2 + MAX_SWAPCHAIN_IMAGES +
+                     HIZ_MAX_LEVELS,
+          .poolSizeCount = 4,
+          .pPoolSizes =
+              (VkDescriptorPoolSize[4]){
+                  {.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+                   .descriptorCount = MAX_FRAMES_IN_FLIGHT * 2},
+                  {.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                   .descriptorCount = MAX_FRAMES_IN_FLIGHT * 10},
+                  {.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                   .descriptorCount = MAX_FRAMES_IN_FLIGHT +
+                                      MAX_SWAPCHAIN_IMAGES + HIZ_MAX_LEVELS},
+                  {.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                   .descriptorCount =
+                       MAX_SWAPCHAIN_IMAGES + HIZ_MAX_LEVELS}}},
+      NULL, &state->descriptorPool);
+  // Per frame state, each frame reads its own camera. The selection, draw
+  // info and culling sets are written as each frame's command buffers are
+  // recorded, see WriteFrameDescriptors
+  VkWriteDescriptorSet vwds[MAX_FRAMES_IN_FLIGHT];
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    FrameResources *frame = &state->frames[i];
+    vkAllocateDescriptorSets(
+        state->device,
+        &(VkDescriptorSetAllocateInfo){
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool = state->descriptorPool,
+            .descriptorSetCount = 1,
+            .pSetLayouts = &state->descriptorSetLayout},
+        &frame->descriptorSet);
+    vkAllocateDescriptorSets(
+        state->device,
+        &(VkDescriptorSetAllocateInfo){
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool = state->descriptorPool,
+            .descriptorSetCount = 1,
+            .pSetLayouts = &state->cullSetLayout},
+        &frame->cullDescriptorSet);
+    vwds[i] = (VkWriteDescriptorSet){
         .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .dstSet = state->descriptorSets[i],
+        .dstSet = frame->descriptorSet,
         .dstArrayElement = 0,
         .descriptorCount = 1,
         .dstBinding = 0,
         .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
         .pBufferInfo =
-            (VkDescriptorBufferInfo[1]){{.buffer = state->cameraBuffer,
+            (VkDescriptorBufferInfo[1]){{.buffer = frame->cameraBuffer,
                                          .offset = 0,
                                          .range = sizeof(CameraState)}}};
-    vwds[i * 2 + 1] = (VkWriteDescriptorSet){
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .dstSet = state->descriptorSets[i],
-        .dstArrayElement = 0,
-        .descriptorCount = 1,
-        .dstBinding = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-        .pBufferInfo =
-            (VkDescriptorBufferInfo[1]){{.buffer = state->inputBuffer,
-                                         .offset = 0,
-                                         .range = sizeof(InputState)}}};
-    vkCreateFramebuffer(state->device,
-                        &(VkFramebufferCreateInfo){
-                            .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
-                            .renderPass = state->renderPass,
-                            .attachmentCount = 2,
-                            .pAttachments = imageView,
-                            .width = capabilites.maxImageExtent.width,
-                            .height = capabilites.maxImageExtent.height,
-                            .layers = 1},
-                        0, &state->framebuffers[i]);
   }
-  vkUpdateDescriptorSets(state->device, state->imageCount * 2, vwds, 0,
+  vkUpdateDescriptorSets(state->device, MAX_FRAMES_IN_FLIGHT, vwds, 0,
                          VK_NULL_HANDLE);
-
-  vkCreatePipelineLayout(
+  // Every reduce set there could be, CreateSwapchain points them at the
+  // depth images and pyramid levels of the swapchain
+  VkDescriptorSetLayout reduceLayouts[MAX_SWAPCHAIN_IMAGES + HIZ_MAX_LEVELS];
+  for (uint32_t i = 0; i < MAX_SWAPCHAIN_IMAGES + HIZ_MAX_LEVELS; i++) {
+    reduceLayouts[i] = state->reduceSetLayout;
+  }
+  vkAllocateDescriptorSets(
       state->device,
-      &(VkPipelineLayoutCreateInfo){
-          .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-          .setLayoutCount = 1,
-          .pSetLayouts = (VkDescriptorSetLayout[1]){state->descriptorSetLayout},
-          .pushConstantRangeCount = 0,
-          .pPushConstantRanges = NULL},
-      NULL, &state->layout);
-  vkCreateGraphicsPipelines(
-      state->device, VK_NULL_HANDLE, 1,
-      (VkGraphicsPipelineCreateInfo[1]){
-          {.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
-           .stageCount = 2,
-           .pStages =
-               (VkPipelineShaderStageCreateInfo[2]){
-                   {.sType =
-                        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-                    .stage = VK_SHADER_STAGE_VERTEX_BIT,
-                    .module = LoadShaderFromFile(state->device,
-                                                 "./shaders/vertex.spv"),
-                    .pName = "main"},
-                   {.sType =
-                        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-                    .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
-                    .module = LoadShaderFromFile(state->device,
-                                                 "./shaders/fragment.spv"),
-                    .pName = "main"}},
-           .pVertexInputState =
-               &(VkPipelineVertexInputStateCreateInfo){
-                   .sType =
-                       VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-                   .vertexBindingDescriptionCount = 2,
-                   .pVertexBindingDescriptions =
-                       (VkVertexInputBindingDescription[2]){
-                           {.binding = 0,
-                            .stride = sizeof(Vertex),
-                            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX},
-                           {.binding = 1,
-                            .stride = sizeof(Instance),
-                            .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE}},
-                   .vertexAttributeDescriptionCount = 11,
-                   .pVertexAttributeDescriptions =
-                       (VkVertexInputAttributeDescription[11]){
-                           {.location = 0,
-                            .binding = 0,
-                            .format = VK_FORMAT_R32G32B32A32_SFLOAT,
-                            .offset = offsetof(Vertex, position)},
-                           {.location = 1,
-                            .binding = 0,
-                            .format = VK_FORMAT_R32G32B32A32_SFLOAT,
-                            .offset = offsetof(Vertex, color)},
-                           {.location = 2,
-                            .binding = 0,
-                            .format = VK_FORMAT_R32G32B32A32_SFLOAT,
-                            .offset = offsetof(Vertex, normal)},
-                           {.location = 3,
-                            .binding = 1,
-                            .format = VK_FORMAT_R32G32B32A32_SFLOAT,
-                            .offset = offsetof(Instance, rotation[0])},
-                           {.location = 4,
-                            .binding = 1,
-                            .format = VK_FORMAT_R32G32B32A32_SFLOAT,
-                            .offset = offsetof(Instance, rotation[1])},
-                           {.location = 5,
-                            .binding = 1,
-                            .format = VK_FORMAT_R32G32B32A32_SFLOAT,
-                            .offset = offsetof(Instance, rotation[2])},
-                           {.location = 6,
-                            .binding = 1,
-                            .format = VK_FORMAT_R32G32B32A32_SFLOAT,
-                            .offset = offsetof(Instance, rotation[3])},
-                           {.location = 7,
-                            .binding = 1,
-                            .format = VK_FORMAT_R32G32B32A32_SFLOAT,
-                            .offset = offsetof(Instance, position)},
-                           {.location = 8,
-                            .binding = 1,
-                            .format = VK_FORMAT_R32G32B32A32_SFLOAT,
-                            .offset = offsetof(Instance, scale)},
-                           {.location = 9,
-                            .binding = 1,
-                            .format = VK_FORMAT_R32_UINT,
-                            .offset = offsetof(Instance, instanceId)},
-                           {.location = 10,
-                            .binding = 1,
-                            .format = VK_FORMAT_R32_UINT,
-                            .offset = offsetof(Instance, selected)}}},
-           .pInputAssemblyState =
-               &(VkPipelineInputAssemblyStateCreateInfo){
-                   .sType =
-                       VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
-                   .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST},
-           .pViewportState =
-               &(VkPipelineViewportStateCreateInfo){
-                   .sType =
-                       VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
-                   .viewportCount = 1,
-                   .pViewports = &(
-                       VkViewport){.x = 0,
-                                   .y = 0,
-                                   .width = capabilites.maxImageExtent.width,
-                                   .height = capabilites.maxImageExtent.height,
-                                   .minDepth = 0,
-                                   .maxDepth = 1},
-                   .scissorCount = 1,
-                   .pScissors =
-                       &(VkRect2D){.extent = capabilites.maxImageExtent,
-                                   .offset = {0, 0}}},
-           .pRasterizationState =
-               &(VkPipelineRasterizationStateCreateInfo){
-                   .sType =
-                       VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
-                   .depthClampEnable = VK_FALSE,
-                   .rasterizerDiscardEnable = VK_FALSE,
-                   .polygonMode = VK_POLYGON_MODE_FILL,
-                   .lineWidth = 1.f,
-                   .cullMode = VK_CULL_MODE_BACK_BIT,
-                   .frontFace = VK_FRONT_FACE_CLOCKWISE},
-           .pMultisampleState =
-               &(VkPipelineMultisampleStateCreateInfo){
-                   .sType =
-                       VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
-                   .sampleShadingEnable = VK_FALSE,
-                   .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
-                   .minSampleShading = 1.f},
-           .pDepthStencilState =
-               &(VkPipelineDepthStencilStateCreateInfo){
-                   .sType =
-                       VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
-                   .depthTestEnable = VK_TRUE,
-                   .depthWriteEnable = VK_TRUE,
-                   .depthCompareOp = VK_COMPARE_OP_LESS,
-                   .depthBoundsTestEnable = VK_FALSE,
-                   .stencilTestEnable = VK_FALSE,
-                   .front = {.failOp = VK_STENCIL_OP_KEEP,
-                             .passOp = VK_STENCIL_OP_KEEP,
-                             .compareOp = VK_COMPARE_OP_ALWAYS},
-                   .back = {.failOp = VK_STENCIL_OP_KEEP,
-                            .passOp = VK_STENCIL_OP_KEEP,
-                            .compareOp = VK_COMPARE_OP_ALWAYS},
-                   .minDepthBounds = -5,
-                   .maxDepthBounds = 100},
-           .pColorBlendState =
-               &(VkPipelineColorBlendStateCreateInfo){
-                   .sType =
-                       VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
-                   .logicOpEnable = VK_FALSE,
-                   .attachmentCount = 1,
-                   .pAttachments =
-                       &(VkPipelineColorBlendAttachmentState){
-                           .colorWriteMask = VK_COLOR_COMPONENT_R_BIT |
-                                             VK_COLOR_COMPONENT_G_BIT |
-                                             VK_COLOR_COMPONENT_B_BIT |
-                                             VK_COLOR_COMPONENT_A_BIT,
-                           .blendEnable = VK_TRUE,
-                           .srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA,
-                           .dstColorBlendFactor =
-                               VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
-                           .colorBlendOp = VK_BLEND_OP_ADD,
-                           .srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
-                           .dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
-                           .alphaBlendOp = VK_BLEND_OP_ADD},
-                   .blendConstants = {0.f, 0.f, 0.f, 0.f}},
-           .pDynamicState = NULL,
-           .layout = state->layout,
-           .renderPass = state->renderPass,
-           .subpass = 0},
-      },
-      NULL, state->graphicsPipelines);
-  glm_perspective(80,
-                  (float)capabilites.currentExtent.width /
-                      (float)capabilites.currentExtent.height,
-                  0.1, 50, state->camera->proj);
+      &(VkDescriptorSetAllocateInfo){
+          .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+          .descriptorPool = state->descriptorPool,
+          .descriptorSetCount = MAX_SWAPCHAIN_IMAGES + HIZ_MAX_LEVELS,
+          .pSetLayouts = reduceLayouts},
+      state->reduceSets);
+  CreateSwapchain(state, SwapchainExtent(state));
 }
 
-void CleanRenderState(GraphicsState *state) {
-  vkFreeCommandBuffers(state->device, state->commandPool, state->imageCount,
-                       state->commandbuffers);
-  for (uint32_t i = 0; i < state->imageCount; i++) {
-    vkDestroyFramebuffer(state->device, state->framebuffers[i], NULL);
+/**
+ * Set up drawing into a new window, or when headless into offscreen images
+ * of HEADLESS_WIDTH by HEADLESS_HEIGHT with no window system involved at
+ * all, so it runs on any Vulkan implementation (lavapipe included) without
+ * a display.
+ */
+GraphicsState InitGraphics(bool headless) {
+  uint32_t count = 0;
+  const char **extensions = NULL;
+  if (!headless) {
+    glfwInit();
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    extensions = glfwGetRequiredInstanceExtensions(&count);
   }
-  vkDestroyDescriptorPool(state->device, state->descriptorPool, NULL);
-  vkDestroySwapchainKHR(state->device, state->swapchain, NULL);
-  vkDestroyRenderPass(state->device, state->renderPass, NULL);
-  vkDestroyPipeline(state->device, state->graphicsPipelines[0], NULL);
-  vkDestroyPipeline(state->device, state->graphicsPipelines[1], NULL);
-  state->commandBufferDirty = true;
-}
-
-GraphicsState InitGraphics() {
-  uint32_t count;
-  glfwInit();
-  glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
   VkInstance instance;
   {
-    const char **extensions = glfwGetRequiredInstanceExtensions(&count);
     vkCreateInstance(
-        &(VkInstanceCreateInfo){.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
-                                .enabledExtensionCount = count,
-                                .ppEnabledExtensionNames = extensions},
+        &(VkInstanceCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+            // Timeline semaphores
+            .pApplicationInfo =
+                &(VkApplicationInfo){
+                    .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+                    .apiVersion = VK_API_VERSION_1_2},
+            .enabledExtensionCount = count,
+            .ppEnabledExtensionNames = extensions},
         0, &instance);
   }
   GLFWwindow *window =
-      glfwCreateWindow(600, 400, "Real Life Fantasy Battles", 0, 0);
+      headless ? NULL
+               : glfwCreateWindow(600, 400, "Real Life Fantasy Battles", 0, 0);
 
   VkPhysicalDevice physicalDevice = NULL;
+  bool fillModeNonSolid = false;
   {
     vkEnumeratePhysicalDevices(instance, &count, 0);
     VkPhysicalDevice *physicalDevices = calloc(count, sizeof(VkPhysicalDevice));
     vkEnumeratePhysicalDevices(instance, &count, physicalDevices);
     for (uint32_t i = 0; i < count; i++) {
       physicalDevice = physicalDevices[i];
-      VkPhysicalDeviceFeatures features;
-      vkGetPhysicalDeviceFeatures(physicalDevice, &features);
-      if (!features.fragmentStoresAndAtomics) {
-        printf("Rejecting device, lacks fragmentStoresAndAtomics\n");
+      VkPhysicalDeviceVulkan12Features features12 = {
+          .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES};
+      VkPhysicalDeviceVulkan11Features features11 = {
+          .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES,
+          .pNext = &features12};
+      VkPhysicalDeviceFeatures2 features = {
+          .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+          .pNext = &features11};
+      vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+      if (!features12.timelineSemaphore) {
+        printf("Rejecting device, lacks timelineSemaphore\n");
+        physicalDevice = NULL;
+        continue;
+      } else if (!features.features.multiDrawIndirect ||
+                 !features11.shaderDrawParameters) {
+        printf("Rejecting device, lacks multiDrawIndirect or "
+               "shaderDrawParameters\n");
         physicalDevice = NULL;
         continue;
       } else {
+        // Optional, only the wireframe pipeline needs it
+        fillModeNonSolid = features.features.fillModeNonSolid;
         break;
       }
     }
@@ -895,164 +2573,232 @@ GraphicsState InitGraphics() {
     fprintf(stderr, "Unable to find good enough physical device\n");
   }
 
-  uint32_t *queues =
-      getQueuesMatching(physicalDevice, VK_QUEUE_GRAPHICS_BIT, 0);
+  uint32_t graphicsFamily =
+      getQueuesMatching(physicalDevice, VK_QUEUE_GRAPHICS_BIT, 0)[0];
+  uint32_t transferFamily = getTransferFamily(physicalDevice, graphicsFamily);
+  float timestampPeriod = 0;
+  {
+    uint32_t familyCount;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount,
+                                             NULL);
+    VkQueueFamilyProperties *families =
+        malloc(sizeof(VkQueueFamilyProperties) * familyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount,
+                                             families);
+    if (families[graphicsFamily].timestampValidBits > 0) {
+      VkPhysicalDeviceProperties properties;
+      vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+      timestampPeriod = properties.limits.timestampPeriod;
+    }
+    free(families);
+  }
+  if (transferFamily != graphicsFamily) {
+    printf("Uploading on dedicated transfer queue family %d\n", transferFamily);
+  } else {
+    printf("No dedicated transfer queue, uploading on the graphics queue\n");
+  }
+  VkPhysicalDeviceVulkan12Features enabled12 = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+      .timelineSemaphore = VK_TRUE};
+  // Draw parameters for gl_DrawID in the vertex shader
+  VkPhysicalDeviceVulkan11Features enabled11 = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES,
+      .pNext = &enabled12,
+      .shaderDrawParameters = VK_TRUE};
   VkDevice device;
   vkCreateDevice(
       physicalDevice,
       &(VkDeviceCreateInfo){
           .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+          .pNext = &enabled11,
           .pEnabledFeatures =
-              &(VkPhysicalDeviceFeatures){.fragmentStoresAndAtomics = true},
-          .enabledExtensionCount = 1,
+              &(VkPhysicalDeviceFeatures){.multiDrawIndirect = true,
+                                          .fillModeNonSolid = fillModeNonSolid},
+          .enabledExtensionCount = headless ? 0 : 1,
           .ppEnabledExtensionNames =
               &(const char *){VK_KHR_SWAPCHAIN_EXTENSION_NAME},
-          .queueCreateInfoCount = 1,
+          .queueCreateInfoCount = transferFamily != graphicsFamily ? 2 : 1,
           .pQueueCreateInfos =
-              &(VkDeviceQueueCreateInfo){
-                  .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-                  .queueFamilyIndex = queues[0],
-                  .queueCount = 1,
-                  .pQueuePriorities = &(float){1.}}
+              (VkDeviceQueueCreateInfo[2]){
+                  {.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+                   .queueFamilyIndex = graphicsFamily,
+                   .queueCount = 1,
+                   .pQueuePriorities = &(float){1.}},
+                  {.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+                   .queueFamilyIndex = transferFamily,
+                   .queueCount = 1,
+                   .pQueuePriorities = &(float){1.}}}
 
       },
       0, &device);
-  VkSurfaceKHR surface;
-  VkResult res;
-  res = glfwCreateWindowSurface(instance, window, 0, &surface);
-  if (res != VK_SUCCESS) {
-    fprintf(stderr, "Failed to create surface: %d\n", res);
-    exit(1);
+  VkSurfaceKHR surface = VK_NULL_HANDLE;
+  if (!headless) {
+    VkResult res = glfwCreateWindowSurface(instance, window, 0, &surface);
+    if (res != VK_SUCCESS) {
+      fprintf(stderr, "Failed to create surface: %d\n", res);
+      exit(1);
+    }
   }
 
   GraphicsState state =
       (GraphicsState){.instance = instance,
+                      .headless = headless,
                       .window = window,
                       .surface = surface,
                       .physicalDevice = physicalDevice,
                       .device = device,
+                      .graphicsFamily = graphicsFamily,
+                      .transferFamily = transferFamily,
+                      .vertexArena = {.usage =
+                                          VK_BUFFER_USAGE_VERTEX_BUFFER_BIT},
+                      .indexArenas = {{.usage =
+                                           VK_BUFFER_USAGE_INDEX_BUFFER_BIT},
+                                      {.usage =
+                                           VK_BUFFER_USAGE_INDEX_BUFFER_BIT}},
                       .entities = calloc(128, sizeof(EntityDef)),
                       .maxEntities = 128,
-                      .commandBufferDirty = true};
+                      .latestInstances = UINT32_MAX,
+                      .framesInFlight = DEFAULT_FRAMES_IN_FLIGHT,
+                      .occlusionCulling = true,
+                      .commandBufferDirty = true,
+                      .timestampPeriod = timestampPeriod,
+                      .wireframeSupported = fillModeNonSolid};
+  InitGpuAllocator(&state.allocator, physicalDevice, device);
+  {
+    // Without a transfer family both timelines submit to the same queue
+    VkQueue queue;
+    vkGetDeviceQueue(device, graphicsFamily, 0, &queue);
+    state.graphicsTimeline = calloc(1, sizeof(Timeline));
+    InitTimeline(state.graphicsTimeline, device, queue);
+    vkGetDeviceQueue(device, transferFamily, 0, &queue);
+    state.transferTimeline = calloc(1, sizeof(Timeline));
+    InitTimeline(state.transferTimeline, device, queue);
+  }
 
   for (uint32_t i = 0; i < MAX_SWAPCHAIN_IMAGES; i++) {
-    vkCreateSemaphore(device,
-                      &(VkSemaphoreCreateInfo){
-                          .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO},
-                      NULL, &state.imageReadySemaphores[i]);
     vkCreateSemaphore(device,
                       &(VkSemaphoreCreateInfo){
                           .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO},
                       NULL, &state.renderFinishedSemaphores[i]);
-    vkCreateFence(
-        state.device,
-        &(VkFenceCreateInfo){.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO},
-        NULL, &state.imageReadyFences[i]);
   }
   vkCreateCommandPool(
       state.device,
       &(VkCommandPoolCreateInfo){
           .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
           .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-          .queueFamilyIndex = getQueuesMatching(state.physicalDevice,
-                                                VK_QUEUE_GRAPHICS_BIT, 0)[0]},
+          .queueFamilyIndex = graphicsFamily},
       0, &state.commandPool);
+  state.transferCommandPool = state.commandPool;
+  if (transferFamily != graphicsFamily) {
+    vkCreateCommandPool(
+        state.device,
+        &(VkCommandPoolCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+            .queueFamilyIndex = transferFamily},
+        0, &state.transferCommandPool);
+  }
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    FrameResources *frame = &state.frames[i];
+    vkCreateSemaphore(device,
+                      &(VkSemaphoreCreateInfo){
+                          .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO},
+                      NULL, &frame->imageReadySemaphore);
+    vkAllocateCommandBuffers(
+        state.device,
+        &(VkCommandBufferAllocateInfo){
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = state.transferCommandPool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1},
+        &frame->uploadCommandBuffer);
+    CreateBuffer(&state.allocator, sizeof(CameraState),
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, &frame->cameraBuffer,
+                 &frame->cameraMemory);
+    frame->selectionSize = MIN_SELECTION_SIZE;
+    CreateBuffer(&state.allocator, frame->selectionSize,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &frame->selectionBuffer,
+                 &frame->selectionMemory);
+    WriteSelectionBuffer(&state.selected, 0, frame->selectionMemory.mapped);
+    vkCreateQueryPool(
+        device,
+        &(VkQueryPoolCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .queryType = VK_QUERY_TYPE_TIMESTAMP,
+            .queryCount = 2},
+        NULL, &frame->timestampPool);
+  }
 
   // Model loading
-  CreateBuffer(device, physicalDevice, 500000 * sizeof(Vertex),
-               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-               VK_BUFFER_USAGE_TRANSFER_SRC_BIT, &state.stagingBuffer,
-               &state.stagingMemory);
-  vkCreateFence(
-      state.device,
-      &(VkFenceCreateInfo){.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO}, NULL,
-      &state.stagingFence);
-
-  CreateBuffer(device, physicalDevice, sizeof(CameraState),
-               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
-                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-               VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-                   VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-               &state.cameraBuffer, &state.cameraMemory);
-  printf("%d\n", vkMapMemory(device, state.cameraMemory, 0, VK_WHOLE_SIZE, 0,
-                             (void **)&state.camera));
-  CreateBuffer(device, physicalDevice, sizeof(InputState),
-               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+  {
+    VkBuffer stagingBuffer;
+    GpuAllocation stagingMemory;
+    CreateBuffer(&state.allocator, STAGING_RING_SIZE,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 VK_BUFFER_USAGE_TRANSFER_SRC_BIT, &stagingBuffer,
+                 &stagingMemory);
+    InitStagingRing(&state.staging, state.transferTimeline,
+                    state.transferCommandPool, stagingBuffer,
+                    stagingMemory.mapped, STAGING_RING_SIZE);
+  }
+  CreateBuffer(&state.allocator, sizeof(DrawInfo) * state.maxEntities,
+               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-               VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-                   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-               &state.inputBuffer, &state.inputMemory);
-  printf("%d\n", vkMapMemory(device, state.inputMemory, 0, VK_WHOLE_SIZE, 0,
-                             (void **)&state.input));
-  memset(state.input->selectionBuffer, 0, sizeof(state.input->selectionBuffer));
-  memset(state.input->selectionMap, 0, sizeof(state.input->selectionMap));
+               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &state.drawInfoBuffer,
+               &state.drawInfoMemory);
+
+  state.camera = calloc(1, sizeof(CameraState));
+  state.input = calloc(1, sizeof(InputState));
 
   glm_mat4_identity_array(&state.camera->model, 3);
+  InitPicker(&state.picker, &state.allocator, state.graphicsTimeline,
+             state.commandPool, MAX_FRAMES_IN_FLIGHT);
+  size_t cacheSize;
+  state.pipelineCache = LoadPipelineCache(physicalDevice, device,
+                                          PIPELINE_CACHE_PATH, &cacheSize);
+  CreateScenePipelineLayout(&state);
+  // Both on the heap, the compiler's thread holds on to them while state is
+  // returned by value
+  state.sceneContext = malloc(sizeof(ScenePipelineContext));
+  *state.sceneContext = (ScenePipelineContext){.device = device,
+                                               .cache = state.pipelineCache,
+                                               .cacheSize = cacheSize,
+                                               .layout = state.layout};
+  state.compiler = malloc(sizeof(PipelineCompiler));
+  if (StartPipelineCompiler(state.compiler, BuildScenePipeline,
+                            state.sceneContext)) {
+    exit(1);
+  }
+  CreateCullPipeline(&state);
   CreateRenderState(&state);
+  // Everything is drawn with it, there's no carrying on without
+  if (!WaitForPipeline(state.compiler, SCENE_PIPELINE_FILL)) {
+    fprintf(stderr, "Failed to build the scene pipeline\n");
+    exit(1);
+  }
   return state;
 }
 
-void ReadInputData(GraphicsState *state) {
-  if (!state->inputReadCommandBuffer) {
-    CreateBuffer(state->device, state->physicalDevice, sizeof(InputState),
-                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                 VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
-                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                 &state->stagingInputBuffer, &state->stagingInputMemory);
-    vkCreateFence(
-        state->device,
-        &(VkFenceCreateInfo){.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO},
-        NULL, &state->inputReadFence);
-    vkAllocateCommandBuffers(
-        state->device,
-        &(VkCommandBufferAllocateInfo){
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-            .commandPool = state->commandPool,
-            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-            .commandBufferCount = 1},
-        &state->entitySyncCommandBuffer);
-
-    vkBeginCommandBuffer(
-        state->inputReadCommandBuffer,
-        &(VkCommandBufferBeginInfo){
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO});
-    vkCmdCopyBuffer(state->inputReadCommandBuffer, state->inputBuffer,
-                    state->stagingInputBuffer, 1,
-                    &(VkBufferCopy){.srcOffset = 0,
-                                    .dstOffset = 0,
-                                    .size = sizeof(InputState)});
-    vkEndCommandBuffer(state->inputReadCommandBuffer);
-  }
-
-  VkQueue queue;
-  vkGetDeviceQueue(
-      state->device,
-      getQueuesMatching(state->physicalDevice, VK_QUEUE_TRANSFER_BIT, 0)[0], 0,
-      &queue);
-  vkQueueSubmit(
-      queue, 1,
-      &(VkSubmitInfo){.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-                      .commandBufferCount = 1,
-                      .pCommandBuffers = &state->inputReadCommandBuffer},
-      state->inputReadFence);
-  uint32_t res =
-      vkWaitForFences(state->device, 1, &state->inputReadFence, 1, 1000000);
-  if (res == VK_TIMEOUT) {
-    printf("Input data timeout\n");
-  }
-  vkResetFences(state->device, 1, &state->inputReadFence);
-  InputState *dat;
-  vkMapMemory(state->device, state->stagingInputMemory, 0, sizeof(InputState),
-              0, (void **)&dat);
-  memcpy(&state->input, dat, sizeof(InputState));
-  vkUnmapMemory(state->device, state->stagingInputMemory);
+// Handle whatever happened to the window, headless there's no window and
+// GLFW was never set up
+void PollWindowEvents(GraphicsState *state) {
+  if (state->window) {
+    glfwPollEvents();
+  }
 }
 
 void MoveCamera(GraphicsState *state) {
 #define CAMERA_MOVE_SPEED 0.002
 #define CAMERA_ROTATE_SPEED 0.01
   static double posx, posy;
+  if (!state->window) {
+    return;
+  }
   if (state->camera->cameraTurning) {
     double deltax, deltay;
     glfwGetCursorPos(state->window, &deltax, &deltay);
@@ -1086,72 +2832,239 @@ void MoveCamera(GraphicsState *state) {
   glm_translate(state->camera->view, cameraVelocity);
 }
 
+// Work out the matrices the shaders get from the camera's view and proj,
+// once a frame rather than for every vertex
+void UpdateCameraMatrices(CameraState *camera) {
+  mat4 inverseView;
+  glm_mat4_inv(camera->view, inverseView);
+  glm_mat4_mul(camera->proj, inverseView, camera->viewProj);
+  glm_mat4_inv(camera->viewProj, camera->inverseViewProj);
+}
+
+// Change how many frames the CPU may queue up ahead of the GPU, clamped to
+// between 1 and MAX_FRAMES_IN_FLIGHT
+void SetFramesInFlight(GraphicsState *state, uint32_t count) {
+  WaitForFrames(state);
+  if (count < 1) {
+    count = 1;
+  }
+  if (count > MAX_FRAMES_IN_FLIGHT) {
+    count = MAX_FRAMES_IN_FLIGHT;
+  }
+  state->framesInFlight = count;
+}
+
+// Turn testing against the depth pyramid on or off, culling only tests
+// against the frustum without it
+void SetOcclusionCulling(GraphicsState *state, bool enabled) {
+  state->occlusionCulling = enabled;
+  // It's pushed as the command buffers are recorded
+  state->commandBufferDirty = true;
+}
+
+/**
+ * Write what the frame copied out to the dump directory as a binary PPM, if
+ * it's waiting to be. The frame has to have been waited on.
+ */
+void WriteFrameDump(GraphicsState *state, FrameResources *frame) {
+  if (frame->dumpNumber == 0) {
+    return;
+  }
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/frame%06lu.ppm", state->dumpDirectory,
+           (unsigned long)(frame->dumpNumber - 1));
+  frame->dumpNumber = 0;
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    fprintf(stderr, "Failed to write frame to %s\n", path);
+    return;
+  }
+  uint32_t width = state->renderArea.width, height = state->renderArea.height;
+  fprintf(file, "P6\n%d %d\n255\n", width, height);
+  // Drop alpha, HEADLESS_FORMAT is RGBA
+  uint8_t *pixels = frame->dumpMemory.mapped;
+  uint8_t *row = malloc(width * 3);
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      memcpy(&row[x * 3], &pixels[(y * width + x) * 4], 3);
+    }
+    fwrite(row, 3, width, file);
+  }
+  free(row);
+  fclose(file);
+}
+
+/**
+ * Write every frame drawn from now on into directory, numbered from the
+ * frame count, or stop with NULL. Only when headless, there's nothing to
+ * copy out of a swapchain. Returns 0 on success.
+ */
+uint32_t SetFrameDump(GraphicsState *state, char *directory) {
+  if (directory && !state->headless) {
+    fprintf(stderr, "Frames can only be dumped when headless\n");
+    return 1;
+  }
+  WaitForFrames(state);
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    FrameResources *frame = &state->frames[i];
+    WriteFrameDump(state, frame);
+    if (directory && !frame->dumpBuffer &&
+        CreateBuffer(&state->allocator,
+                     (VkDeviceSize)state->renderArea.width *
+                         state->renderArea.height * 4,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT, &frame->dumpBuffer,
+                     &frame->dumpMemory)) {
+      fprintf(stderr, "Failed to create frame dump buffer\n");
+      return 1;
+    }
+  }
+  state->dumpDirectory = directory;
+  // The copies are recorded into the command buffers
+  state->commandBufferDirty = true;
+  return 0;
+}
+
+/**
+ * Draw the scene as wireframe or not. The wireframe pipeline is built in the
+ * background the first time, frames keep being drawn filled in until it's
+ * there.
+ */
+void SetWireframe(GraphicsState *state, bool enabled) {
+  if (enabled && !state->wireframeSupported) {
+    printf("Device lacks fillModeNonSolid, can't draw wireframe\n");
+    return;
+  }
+  state->wireframe = enabled;
+  if (enabled) {
+    RequestPipeline(state->compiler, SCENE_PIPELINE_WIREFRAME);
+    state->wireframePending = true;
+  }
+  state->commandBufferDirty = true;
+}
+
 void DrawGraphics(GraphicsState *state) {
+  RecordFrame(&state->frameTimes);
+  uint32_t frameIndex = state->frameCount % state->framesInFlight;
+  FrameResources *frame = &state->frames[frameIndex];
+  // Everything the frame owns is only ours to touch again once the GPU is
+  // through with its last submission, the frames after it keep going
+  WaitTimeline(state->graphicsTimeline, frame->submitted);
+  RetirePickFrame(&state->picker, frameIndex);
+  WriteFrameDump(state, frame);
+  ReleaseRetiredBuffers(state);
   UpdateInputState(state);
-  UpdateGraphicsMemory(state);
+  UpdateSelection(state);
+
+  uint32_t imageId = frameIndex;
+  bool suboptimal = false;
+  if (!state->headless) {
+    VkResult result = vkAcquireNextImageKHR(
+        state->device, state->swapchain, 1e8, frame->imageReadySemaphore,
+        VK_NULL_HANDLE, &imageId);
+    if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+      RecreateSwapchain(state);
+      return;
+    }
+    if (result == VK_TIMEOUT) {
+      printf("Device not ready yet, try again later\n");
+      return;
+    }
+    // Still presentable, it's replaced once this frame has been presented
+    suboptimal = result == VK_SUBOPTIMAL_KHR;
+    if (result != VK_SUCCESS && !suboptimal) {
+      printf("Failure to fetch image err: %d.. Returning\n", result);
+      return;
+    }
+  }
+  // The instances stay as they were on the GPU if they can't be sent
+  bool uploaded = UpdateGraphicsMemory(state, frame) == 0;
+  if (state->wireframePending) {
+    PipelineStatus status =
+        GetPipelineStatus(state->compiler, SCENE_PIPELINE_WIREFRAME);
+    if (status == PIPELINE_READY) {
+      state->wireframePending = false;
+      state->commandBufferDirty = true;
+    } else if (status == PIPELINE_FAILED) {
+      // Frames were never anything but filled in
+      printf("Wireframe pipeline failed to build, drawing filled in\n");
+      state->wireframePending = false;
+      state->wireframe = false;
+    }
+  }
   if (state->commandBufferDirty) {
-    VkSurfaceCapabilitiesKHR capabilites;
-    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(state->physicalDevice,
-                                              state->surface, &capabilites);
-    for (uint32_t i = 0; i < state->imageCount; i++) {
-      vkResetCommandBuffer(state->commandbuffers[i], 0);
-      SetupCommandBuffer(state, i, state->entities, state->entityCount);
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+      state->frames[i].commandBufferDirty = true;
     }
     state->commandBufferDirty = false;
   }
-  uint32_t image_index = (state->imageId + 1) % (state->imageCount + 1);
-
-  uint32_t imageId;
-  VkResult result = vkAcquireNextImageKHR(
-      state->device, state->swapchain, 1e8,
-      state->imageReadySemaphores[image_index], VK_NULL_HANDLE, &imageId);
-  VkQueue queue;
-  vkGetDeviceQueue(
-      state->device,
-      getQueuesMatching(state->physicalDevice, VK_QUEUE_GRAPHICS_BIT, 0)[0], 0,
-      &queue);
-  if (result == VK_SUBOPTIMAL_KHR || result == VK_ERROR_OUT_OF_DATE_KHR) {
-    printf("Swapchain unsuitable, recreating..\n");
-    vkQueueWaitIdle(queue);
-    CleanRenderState(state);
-    CreateRenderState(state);
-    return;
+  WriteDraws(state, frame);
+  WriteFrameSelection(state, frame);
+  // Only this frame's command buffers are known to be idle, the others catch
+  // up when their frame comes around
+  if (frame->commandBufferDirty) {
+    WriteFrameDescriptors(state, frame);
+    for (uint32_t i = 0; i < state->imageCount; i++) {
+      vkResetCommandBuffer(frame->commandbuffers[i], 0);
+      SetupCommandBuffer(state, frame, i);
+    }
+    frame->commandBufferDirty = false;
   }
-  if (result == VK_TIMEOUT) {
-    printf("Device not ready yet, try again later\n");
-    return;
+  UpdateCameraMatrices(state->camera);
+  memcpy(frame->cameraMemory.mapped, state->camera, sizeof(CameraState));
+  TimelineWait waits[2];
+  uint32_t waitCount = 0;
+  if (!state->headless) {
+    waits[waitCount++] = (TimelineWait){
+        .semaphore = frame->imageReadySemaphore,
+        .stage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
   }
-  if (result != VK_SUCCESS) {
-    printf("Failure to fetch image err: %d.. Returning\n", result);
-    return;
+  if (uploaded && frame->uploading) {
+    // Only the frame's own instance buffer is written, and its last draw has
+    // been waited on already
+    uint64_t landed =
+        SubmitTimeline(state->transferTimeline, &frame->uploadCommandBuffer, 1,
+                       NULL, 0, VK_NULL_HANDLE);
+    if (landed) {
+      // Culling reads the instances first
+      waits[waitCount++] = TimelineDependency(
+          state->transferTimeline, landed,
+          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    } else {
+      ResendInstances(state);
+    }
+  }
+  VkCommandBuffer commandBuffers[2] = {frame->commandbuffers[imageId]};
+  commandBuffers[1] = RecordPick(&state->picker, frameIndex,
+                                 state->idImages[imageId], state->renderArea);
+  uint64_t submitted = SubmitTimeline(
+      state->graphicsTimeline, commandBuffers, commandBuffers[1] ? 2 : 1,
+      waits, waitCount,
+      state->headless ? VK_NULL_HANDLE
+                      : state->renderFinishedSemaphores[imageId]);
+  if (submitted) {
+    frame->submitted = submitted;
+    PickSubmitted(&state->picker, frameIndex, submitted);
+    if (state->dumpDirectory) {
+      frame->dumpNumber = state->frameCount + 1;
+    }
+  }
+  VkResult presented = VK_SUCCESS;
+  if (!state->headless) {
+    presented = vkQueuePresentKHR(
+        state->graphicsTimeline->queue,
+        &(VkPresentInfoKHR){
+            .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+            .swapchainCount = 1,
+            .waitSemaphoreCount = 1,
+            .pWaitSemaphores = &state->renderFinishedSemaphores[imageId],
+            .pSwapchains = &state->swapchain,
+            .pImageIndices = &imageId});
+  }
+  state->frameCount++;
+  if (suboptimal || presented == VK_SUBOPTIMAL_KHR ||
+      presented == VK_ERROR_OUT_OF_DATE_KHR) {
+    RecreateSwapchain(state);
   }
-  vkQueueSubmit(
-      queue, 1,
-      &(VkSubmitInfo){
-          .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-          .commandBufferCount = 1,
-          .pCommandBuffers = &state->commandbuffers[imageId],
-          .waitSemaphoreCount = 1,
-          .pWaitSemaphores = &state->imageReadySemaphores[image_index],
-          .signalSemaphoreCount = 1,
-          .pSignalSemaphores = &state->renderFinishedSemaphores[imageId],
-          .pWaitDstStageMask =
-              &(VkPipelineStageFlags){
-                  VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT}},
-      state->imageReadyFences[imageId]);
-  vkQueuePresentKHR(
-      queue, &(VkPresentInfoKHR){.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-                                 .swapchainCount = 1,
-                                 .waitSemaphoreCount = 1,
-                                 .pWaitSemaphores =
-                                     &state->renderFinishedSemaphores[imageId],
-                                 .pSwapchains = &state->swapchain,
-                                 .pImageIndices = &imageId});
-  VkResult res = vkWaitForFences(state->device, 1,
-                                 &state->imageReadyFences[imageId], 1, 100000);
-  if (res == VK_TIMEOUT) {
-    printf("Graphics overloaded, not ready to draw frame\n");
-  }
-  vkResetFences(state->device, 1, &state->imageReadyFences[imageId]);
-  state->imageId = image_index;
 }